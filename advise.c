@@ -0,0 +1,532 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <inttypes.h>
+
+#include "advise.h"
+#include "iptables.h"
+
+
+/*
+ * The counters of the tagged rules are sampled twice, interval seconds
+ * apart. Within every chain, the kernel rules generated from one rule
+ * section form a block, and adjacent blocks can trade places if their
+ * sections have the same target and can never match the same packet,
+ * which is decided from the parsed rule options. Runs of such blocks are
+ * ordered by the packets they matched per rule, which minimises the rules
+ * a matching packet has to traverse.
+ *
+ * Rules generated from anything but a rule section, untagged rules and
+ * rules without a fingerprint stay where they are and separate the runs.
+ * An applied order only lasts until the firewall is reloaded.
+ */
+
+struct advise_rule {
+	unsigned int pos;
+	uint32_t fingerprint;
+	char *comment;
+	uint64_t packets[2];
+};
+
+struct advise_chain {
+	struct list_head list;
+	enum fw3_family family;
+	enum fw3_table table;
+	char name[32];
+	bool changed;
+	unsigned int n, seen;
+	struct advise_rule *rules;
+};
+
+struct advise_block {
+	struct fw3_rule *rule;
+	unsigned int index;
+	unsigned int first;
+	unsigned int n;
+	unsigned int offset;
+	uint64_t packets;
+};
+
+struct advise_sample {
+	struct list_head chains;
+	struct advise_chain *cur;
+	enum fw3_table table;
+	int pass;
+};
+
+
+static struct advise_chain *
+find_chain(struct advise_sample *s, struct fw3_ipt_handle *h, const char *name)
+{
+	struct advise_chain *c;
+
+	if (s->cur && s->cur->family == h->family && s->cur->table == s->table &&
+	    !strcmp(s->cur->name, name))
+		return s->cur;
+
+	list_for_each_entry(c, &s->chains, list)
+		if (c->family == h->family && c->table == s->table &&
+		    !strcmp(c->name, name))
+			return (s->cur = c);
+
+	if (s->pass || !(c = calloc(1, sizeof(*c))))
+		return NULL;
+
+	c->family = h->family;
+	c->table = s->table;
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	list_add_tail(&c->list, &s->chains);
+
+	return (s->cur = c);
+}
+
+static void
+sample_rule(struct fw3_ipt_handle *h, const struct fw3_ipt_tagged *t,
+            void *priv)
+{
+	struct advise_sample *s = priv;
+	struct advise_chain *c = find_chain(s, h, t->chain);
+	struct advise_rule *r, *tmp;
+
+	if (!c)
+		return;
+
+	if (s->pass)
+	{
+		r = (c->seen < c->n) ? &c->rules[c->seen] : NULL;
+		c->seen++;
+
+		/* counters zeroed in the meanwhile are just as useless */
+		if (!r || r->pos != t->pos || r->fingerprint != t->fingerprint ||
+		    t->packets < r->packets[0])
+			c->changed = true;
+		else
+			r->packets[1] = t->packets;
+
+		return;
+	}
+
+	if (!(c->n % 16))
+	{
+		if (!(tmp = realloc(c->rules, (c->n + 16) * sizeof(*c->rules))))
+		{
+			c->changed = true;
+			return;
+		}
+
+		c->rules = tmp;
+	}
+
+	r = &c->rules[c->n++];
+	r->pos = t->pos;
+	r->fingerprint = t->fingerprint;
+	r->comment = strdup(t->comment);
+	r->packets[0] = r->packets[1] = t->packets;
+}
+
+static void
+sample(struct advise_sample *s, int pass)
+{
+	enum fw3_family family;
+	struct fw3_ipt_handle *handle;
+	struct advise_chain *c;
+
+	s->pass = pass;
+	s->cur = NULL;
+
+	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
+	{
+		for (s->table = FW3_TABLE_FILTER; s->table <= FW3_TABLE_RAW; s->table++)
+		{
+			if (!fw3_has_table(family == FW3_FAMILY_V6, fw3_flag_names[s->table]))
+				continue;
+
+			if (!(handle = fw3_ipt_open(family, s->table)))
+				continue;
+
+			fw3_ipt_foreach_tagged(handle, sample_rule, s);
+			fw3_ipt_close(handle);
+		}
+	}
+
+	if (pass)
+		list_for_each_entry(c, &s->chains, list)
+			if (c->seen != c->n)
+				c->changed = true;
+}
+
+static struct fw3_rule *
+lookup_rule(struct fw3_state *state, const char *comment)
+{
+	struct fw3_rule *rule;
+	char name[32];
+	int num = 0;
+
+	if (!comment || !*comment)
+		return NULL;
+
+	list_for_each_entry(rule, &state->rules, list)
+	{
+		if (rule->name)
+		{
+			if (!strcmp(rule->name, comment))
+				return rule;
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "@rule[%u]", num);
+
+			if (!strcmp(name, comment))
+				return rule;
+		}
+
+		num++;
+	}
+
+	return NULL;
+}
+
+static void
+address_bounds(const struct fw3_address *a, uint8_t *lo, uint8_t *hi,
+               size_t *len)
+{
+	const uint8_t *addr, *mask;
+	size_t i;
+
+	*len = (a->family == FW3_FAMILY_V6) ? 16 : 4;
+	addr = (const uint8_t *)&a->address;
+	mask = (const uint8_t *)&a->mask;
+
+	for (i = 0; i < *len; i++)
+	{
+		/* ranges keep their end address in the mask */
+		lo[i] = a->range ? addr[i] : (addr[i] & mask[i]);
+		hi[i] = a->range ? mask[i] : (addr[i] | ~mask[i]);
+	}
+}
+
+static bool
+addresses_disjoint(const struct fw3_array *x, const struct fw3_array *y)
+{
+	const struct fw3_address *a, *b;
+	uint8_t alo[16], ahi[16], blo[16], bhi[16];
+	size_t alen, blen;
+
+	if (!x->count || !y->count)
+		return false;
+
+	fw3_foreach_array(a, x)
+	{
+		if (a->invert)
+			return false;
+
+		address_bounds(a, alo, ahi, &alen);
+
+		fw3_foreach_array(b, y)
+		{
+			if (b->invert)
+				return false;
+
+			if (a->family != b->family)
+				continue;
+
+			address_bounds(b, blo, bhi, &blen);
+
+			if (memcmp(ahi, blo, alen) >= 0 && memcmp(bhi, alo, blen) >= 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+ports_disjoint(const struct fw3_array *x, const struct fw3_array *y)
+{
+	const struct fw3_port *a, *b;
+
+	if (!x->count || !y->count)
+		return false;
+
+	fw3_foreach_array(a, x)
+	{
+		fw3_foreach_array(b, y)
+		{
+			if (!a->set || !b->set || a->invert || b->invert)
+				return false;
+
+			if (a->port_max >= b->port_min && b->port_max >= a->port_min)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+protocols_disjoint(const struct fw3_array *x, const struct fw3_array *y)
+{
+	const struct fw3_protocol *a, *b;
+
+	if (!x->count || !y->count)
+		return false;
+
+	fw3_foreach_array(a, x)
+	{
+		fw3_foreach_array(b, y)
+		{
+			if (a->any || b->any || a->invert || b->invert)
+				return false;
+
+			if (a->protocol == b->protocol)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* whether the two sections may be emitted in either order */
+static bool
+rules_independent(struct fw3_rule *a, struct fw3_rule *b)
+{
+	if (a == b || a->target != b->target || a->extra || b->extra)
+		return false;
+
+	return (protocols_disjoint(&a->packed.proto, &b->packed.proto) ||
+	        ports_disjoint(&a->packed.port_dest, &b->packed.port_dest) ||
+	        ports_disjoint(&a->packed.port_src, &b->packed.port_src) ||
+	        addresses_disjoint(&a->packed.ip_dest, &b->packed.ip_dest) ||
+	        addresses_disjoint(&a->packed.ip_src, &b->packed.ip_src));
+}
+
+/* Smith's rule, the most packets per rule first */
+static int
+cmp_block(const void *x, const void *y)
+{
+	const struct advise_block *a = x, *b = y;
+	double l = (double)a->packets / a->n;
+	double r = (double)b->packets / b->n;
+
+	if (l != r)
+		return (l < r) - (l > r);
+
+	return (a->first > b->first) - (a->first < b->first);
+}
+
+static bool
+propose(struct advise_chain *c, struct advise_block *blocks, unsigned int n,
+        unsigned int interval, bool apply, struct fw3_ipt_handle *h)
+{
+	struct advise_block *b;
+	unsigned int i, j, k, off = 0, first = blocks[0].first;
+	uint64_t saved = 0;
+	uint32_t *order;
+	bool rv;
+
+	qsort(blocks, n, sizeof(*blocks), cmp_block);
+
+	for (i = 0; i < n; i++)
+	{
+		if (blocks[i].offset > off)
+			saved += blocks[i].packets * (blocks[i].offset - off);
+		else
+			saved -= blocks[i].packets * (off - blocks[i].offset);
+
+		off += blocks[i].n;
+	}
+
+	if (!saved || saved > INT64_MAX)
+		return true;
+
+	printf("%s %s %s, rules %u-%u: %" PRIu64 " fewer rule traversals (%.1f/s)\n",
+	       fw3_flag_names[c->table], fw3_flag_names[c->family], c->name,
+	       first, first + off - 1, saved, (double)saved / interval);
+
+	for (i = 0; i < n; i++)
+	{
+		b = &blocks[i];
+		printf("\t%-32s %" PRIu64 " packets, %u rule%s\n",
+		       c->rules[b->index].comment, b->packets,
+		       b->n, (b->n == 1) ? "" : "s");
+	}
+
+	if (!apply || !h)
+		return true;
+
+	if (!(order = calloc(off, sizeof(*order))))
+		return false;
+
+	for (i = 0, k = 0; i < n; i++)
+		for (j = 0; j < blocks[i].n; j++)
+			order[k++] = c->rules[blocks[i].index + j].fingerprint;
+
+	if (!(rv = fw3_ipt_reorder_rules(h, c->name, first, order, off)))
+		warn("Unable to reorder rules %u-%u of chain %s",
+		     first, first + off - 1, c->name);
+
+	free(order);
+	return rv;
+}
+
+static bool
+independent_of_run(struct advise_block *run, unsigned int n,
+                   struct fw3_rule *rule)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (!rules_independent(run[i].rule, rule))
+			return false;
+
+	return true;
+}
+
+static bool
+advise_chain(struct fw3_state *state, struct advise_chain *c,
+             unsigned int interval, bool apply, struct fw3_ipt_handle *h)
+{
+	struct advise_block *blocks, *b;
+	struct advise_rule *r;
+	struct fw3_rule *rule;
+	unsigned int i, n = 0, start = 0;
+	bool rv = true;
+
+	if (c->changed || !c->n)
+		return true;
+
+	if (!(blocks = calloc(c->n, sizeof(*blocks))))
+		return false;
+
+	for (i = 0; i < c->n; i++)
+	{
+		r = &c->rules[i];
+		rule = r->fingerprint ? lookup_rule(state, r->comment) : NULL;
+
+		/* the last block of the current run */
+		b = (n > start) ? &blocks[n - 1] : NULL;
+
+		if (rule && b && b->rule == rule && b->first + b->n == r->pos)
+		{
+			b->n++;
+			b->packets += r->packets[1] - r->packets[0];
+			continue;
+		}
+
+		/* the run ends at a rule not adjacent to it, not generated from a
+		 * rule section or not independent of every block in it */
+		if (b && (!rule || b->first + b->n != r->pos ||
+		          !independent_of_run(blocks + start, n - start, rule)))
+		{
+			if (n - start > 1 &&
+			    !propose(c, blocks + start, n - start, interval, apply, h))
+				rv = false;
+
+			start = n;
+		}
+
+		if (!rule)
+			continue;
+
+		b = &blocks[n++];
+		b->rule = rule;
+		b->index = i;
+		b->first = r->pos;
+		b->n = 1;
+		b->offset = r->pos - blocks[start].first;
+		b->packets = r->packets[1] - r->packets[0];
+	}
+
+	if (n - start > 1 &&
+	    !propose(c, blocks + start, n - start, interval, apply, h))
+		rv = false;
+
+	free(blocks);
+	return rv;
+}
+
+static void
+finish_table(struct fw3_ipt_handle *h, bool ok)
+{
+	if (ok)
+		fw3_ipt_commit(h);
+	else
+		warn("Discarding the new order of the %s %s table",
+		     fw3_flag_names[h->family], fw3_flag_names[h->table]);
+
+	fw3_ipt_close(h);
+}
+
+/*
+ * Samples the counters for the given number of seconds and prints the
+ * proposed orders, applying them if requested. The changes to a table are
+ * only committed if every reordered run read back intact. The lock is only
+ * taken to apply, not while sampling.
+ */
+int
+fw3_advise(struct fw3_state *state, unsigned int interval, bool apply)
+{
+	struct advise_sample s = { .chains = LIST_HEAD_INIT(s.chains) };
+	struct advise_chain *c, *tmp;
+	struct fw3_ipt_handle *h = NULL;
+	unsigned int i;
+	bool ok = true;
+
+	if (!interval)
+		interval = FW3_ADVISE_INTERVAL;
+
+	sample(&s, 0);
+	sleep(interval);
+	sample(&s, 1);
+
+	if (apply && !fw3_lock())
+		apply = false;
+
+	list_for_each_entry(c, &s.chains, list)
+	{
+		if (apply && (!h || h->family != c->family || h->table != c->table))
+		{
+			if (h)
+				finish_table(h, ok);
+
+			h = fw3_ipt_open(c->family, c->table);
+			ok = true;
+		}
+
+		if (!advise_chain(state, c, interval, apply, h))
+			ok = false;
+	}
+
+	if (h)
+		finish_table(h, ok);
+
+	if (apply)
+		fw3_unlock();
+
+	list_for_each_entry_safe(c, tmp, &s.chains, list)
+	{
+		for (i = 0; i < c->n; i++)
+			free(c->rules[i].comment);
+
+		list_del(&c->list);
+		free(c->rules);
+		free(c);
+	}
+
+	return 0;
+}
@@ -0,0 +1,374 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "conntrack.h"
+
+
+#define CT_BUFSIZE	16384
+
+struct ct_request {
+	struct nlmsghdr nlh;
+	struct nfgenmsg nfg;
+	char attrs[64];
+};
+
+struct ct_victim {
+	uint8_t family;
+	uint16_t len;
+	char tuple[];
+};
+
+struct ct_victims {
+	char *buf;
+	size_t len;
+	size_t size;
+	int count;
+};
+
+static char ct_buf[CT_BUFSIZE];
+static uint32_t ct_seq;
+
+
+static int
+ct_open(void)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+ct_init_request(struct ct_request *req, uint8_t type, uint16_t flags,
+                uint8_t family)
+{
+	memset(req, 0, sizeof(*req));
+
+	req->nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+	req->nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | type;
+	req->nlh.nlmsg_flags = NLM_F_REQUEST | flags;
+	req->nlh.nlmsg_seq = ++ct_seq;
+
+	req->nfg.nfgen_family = family;
+	req->nfg.version = NFNETLINK_V0;
+}
+
+static void
+ct_put_u32(struct ct_request *req, uint16_t type, uint32_t val)
+{
+	struct nlattr *nla = (void *)&req->nlh + NLMSG_ALIGN(req->nlh.nlmsg_len);
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + sizeof(val);
+	memcpy((char *)nla + NLA_HDRLEN, &val, sizeof(val));
+
+	req->nlh.nlmsg_len = NLMSG_ALIGN(req->nlh.nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+/*
+ * Send a request and process the replies until the kernel acknowledges it
+ * or finishes the dump. Each data message is passed to cb.
+ */
+static bool
+ct_talk(int fd, struct nlmsghdr *nlh,
+        void (*cb)(struct nlmsghdr *, void *), void *ctx)
+{
+	int len;
+	struct nlmsghdr *msg;
+	struct nlmsgerr *err;
+
+	if (send(fd, nlh, nlh->nlmsg_len, 0) != nlh->nlmsg_len)
+		return false;
+
+	while (true)
+	{
+		len = recv(fd, ct_buf, sizeof(ct_buf), 0);
+
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		for (msg = (struct nlmsghdr *)ct_buf; NLMSG_OK(msg, len);
+		     msg = NLMSG_NEXT(msg, len))
+		{
+			if (msg->nlmsg_seq != nlh->nlmsg_seq)
+				continue;
+
+			if (msg->nlmsg_type == NLMSG_DONE)
+				return true;
+
+			if (msg->nlmsg_type == NLMSG_ERROR)
+			{
+				err = NLMSG_DATA(msg);
+
+				/* entry may have timed out in the meantime */
+				return (!err->error || err->error == -ENOENT);
+			}
+
+			if (cb)
+				cb(msg, ctx);
+		}
+	}
+}
+
+static struct nlattr *
+ct_find_attr(void *data, int len, uint16_t type)
+{
+	struct nlattr *nla;
+
+	for (nla = data; len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	                 nla->nla_len <= len;
+	     len -= NLA_ALIGN(nla->nla_len),
+	     nla = (void *)nla + NLA_ALIGN(nla->nla_len))
+	{
+		if ((nla->nla_type & NLA_TYPE_MASK) == type)
+			return nla;
+	}
+
+	return NULL;
+}
+
+#define ct_attr_data(nla) ((void *)(nla) + NLA_HDRLEN)
+#define ct_attr_len(nla)  ((nla)->nla_len - NLA_HDRLEN)
+
+static bool
+ct_match_addr(const struct fw3_ct_filter *filter, struct nlattr *nla,
+              enum fw3_family family)
+{
+	int i;
+	size_t alen = (family == FW3_FAMILY_V4) ? 4 : 16;
+
+	if (!nla || ct_attr_len(nla) < alen)
+		return false;
+
+	for (i = 0; i < filter->n_addrs; i++)
+		if (filter->addrs[i]->family == family &&
+		    !memcmp(&filter->addrs[i]->address.v6, ct_attr_data(nla), alen))
+			return true;
+
+	return false;
+}
+
+static bool
+ct_match_tuple(const struct fw3_ct_filter *filter, struct nlattr *tuple)
+{
+	struct nlattr *ip;
+	enum fw3_family family;
+	uint16_t src, dst;
+
+	if (!tuple)
+		return false;
+
+	ip = ct_find_attr(ct_attr_data(tuple), ct_attr_len(tuple), CTA_TUPLE_IP);
+
+	if (!ip)
+		return false;
+
+	if (ct_find_attr(ct_attr_data(ip), ct_attr_len(ip), CTA_IP_V4_SRC))
+	{
+		family = FW3_FAMILY_V4;
+		src = CTA_IP_V4_SRC;
+		dst = CTA_IP_V4_DST;
+	}
+	else
+	{
+		family = FW3_FAMILY_V6;
+		src = CTA_IP_V6_SRC;
+		dst = CTA_IP_V6_DST;
+	}
+
+	return (ct_match_addr(filter,
+	            ct_find_attr(ct_attr_data(ip), ct_attr_len(ip), src), family) ||
+	        ct_match_addr(filter,
+	            ct_find_attr(ct_attr_data(ip), ct_attr_len(ip), dst), family));
+}
+
+static void
+ct_collect_cb(struct nlmsghdr *msg, void *ctx)
+{
+	void **args = ctx;
+	const struct fw3_ct_filter *filter = args[0];
+	struct ct_victims *victims = args[1];
+	struct nfgenmsg *nfg = NLMSG_DATA(msg);
+	struct nlattr *orig, *reply, *zone;
+	struct ct_victim *v;
+	size_t need;
+	char *tmp;
+	void *attrs = (void *)nfg + NLMSG_ALIGN(sizeof(*nfg));
+	int len = msg->nlmsg_len - NLMSG_SPACE(sizeof(*nfg));
+
+	orig = ct_find_attr(attrs, len, CTA_TUPLE_ORIG);
+	reply = ct_find_attr(attrs, len, CTA_TUPLE_REPLY);
+	zone = ct_find_attr(attrs, len, CTA_ZONE);
+
+	if (!orig)
+		return;
+
+	if (filter->n_addrs > 0 &&
+	    !ct_match_tuple(filter, orig) && !ct_match_tuple(filter, reply))
+		return;
+
+	need = sizeof(*v) + NLA_ALIGN(orig->nla_len) +
+	       (zone ? NLA_ALIGN(zone->nla_len) : 0);
+
+	if (victims->len + need > victims->size)
+	{
+		tmp = realloc(victims->buf, victims->size + need + CT_BUFSIZE);
+
+		if (!tmp)
+			return;
+
+		victims->buf = tmp;
+		victims->size += need + CT_BUFSIZE;
+	}
+
+	v = (struct ct_victim *)(victims->buf + victims->len);
+	v->family = nfg->nfgen_family;
+	v->len = NLA_ALIGN(orig->nla_len);
+
+	memcpy(v->tuple, orig, orig->nla_len);
+
+	if (zone)
+	{
+		memcpy(v->tuple + v->len, zone, zone->nla_len);
+		v->len += NLA_ALIGN(zone->nla_len);
+	}
+
+	victims->len += NLA_ALIGN(sizeof(*v) + v->len);
+	victims->count++;
+}
+
+static bool
+ct_collect(int fd, uint8_t family, const struct fw3_ct_filter *filter,
+           struct ct_victims *victims)
+{
+	struct ct_request req;
+	void *args[] = { (void *)filter, victims };
+
+	ct_init_request(&req, IPCTNL_MSG_CT_GET, NLM_F_DUMP, family);
+
+	if (filter->mask)
+	{
+		ct_put_u32(&req, CTA_MARK, htonl(filter->mark));
+		ct_put_u32(&req, CTA_MARK_MASK, htonl(filter->mask));
+	}
+
+	return ct_talk(fd, &req.nlh, ct_collect_cb, args);
+}
+
+static bool
+ct_delete_victim(int fd, struct ct_victim *v)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct nfgenmsg nfg;
+	} *req = (void *)ct_buf;
+
+	if (NLMSG_SPACE(sizeof(req->nfg)) + v->len > sizeof(ct_buf))
+		return false;
+
+	memset(req, 0, sizeof(*req));
+
+	req->nlh.nlmsg_len = NLMSG_SPACE(sizeof(req->nfg)) + v->len;
+	req->nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE;
+	req->nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req->nlh.nlmsg_seq = ++ct_seq;
+
+	req->nfg.nfgen_family = v->family;
+	req->nfg.version = NFNETLINK_V0;
+
+	memcpy((void *)req + NLMSG_SPACE(sizeof(req->nfg)), v->tuple, v->len);
+
+	return ct_talk(fd, &req->nlh, NULL, NULL);
+}
+
+bool
+fw3_ct_flush(void)
+{
+	bool rv;
+	struct ct_request req;
+	int fd = ct_open();
+
+	if (fd < 0)
+		return false;
+
+	ct_init_request(&req, IPCTNL_MSG_CT_DELETE, NLM_F_ACK, AF_UNSPEC);
+	rv = ct_talk(fd, &req.nlh, NULL, NULL);
+
+	close(fd);
+	return rv;
+}
+
+/*
+ * Dump the conntrack table and delete only the entries matching the given
+ * filter, unrelated flows are left alone. Entries are collected first and
+ * removed afterwards to not interfere with the running dump.
+ * Returns the number of deleted entries or -1 if ctnetlink is unavailable.
+ */
+int
+fw3_ct_delete(const struct fw3_ct_filter *filter)
+{
+	int fd, n = 0;
+	size_t off;
+	struct ct_victim *v;
+	struct ct_victims victims = { };
+
+	if (filter->n_addrs <= 0 && !filter->mask)
+		return 0;
+
+	if ((fd = ct_open()) < 0)
+		return -1;
+
+	if (!ct_collect(fd, AF_INET, filter, &victims) ||
+	    !ct_collect(fd, AF_INET6, filter, &victims))
+	{
+		free(victims.buf);
+		close(fd);
+		return -1;
+	}
+
+	for (off = 0; off < victims.len; off += NLA_ALIGN(sizeof(*v) + v->len))
+	{
+		v = (struct ct_victim *)(victims.buf + off);
+
+		if (ct_delete_victim(fd, v))
+			n++;
+	}
+
+	free(victims.buf);
+	close(fd);
+
+	return n;
+}
@@ -0,0 +1,40 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FW3_CONNTRACK_H
+#define __FW3_CONNTRACK_H
+
+#include "options.h"
+#include "utils.h"
+
+
+struct fw3_ct_filter {
+	/* only entries with an original or reply tuple address in this set */
+	const struct fw3_address **addrs;
+	int n_addrs;
+
+	/* only entries whose ctmark matches when mask is non-zero */
+	uint32_t mark;
+	uint32_t mask;
+};
+
+bool fw3_ct_flush(void);
+
+int fw3_ct_delete(const struct fw3_ct_filter *filter);
+
+#endif
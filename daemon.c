@@ -0,0 +1,399 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE /* accept4, MSG_CMSG_CLOEXEC */
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libubox/usock.h>
+
+#include "daemon.h"
+#include "ubus.h"
+
+
+#define FW3_DAEMON_MAXREQ	65536
+#define FW3_DAEMON_EVENTS	16
+#define FW3_DAEMON_SETTLE	250
+
+static volatile sig_atomic_t daemon_quit = 0;
+
+/* networks with pending interface events, netifd usually sends a burst of
+ * them for a single change so they are collected until things settle */
+static char pending[FW3_DAEMON_EVENTS][64];
+static int n_pending = 0;
+static bool pending_overflow = false;
+
+
+/*
+ * A request consists of a 32 bit length followed by the NUL terminated
+ * argument strings. The caller's stdout and stderr descriptors travel along
+ * with the length as SCM_RIGHTS, so the daemon writes into them directly and
+ * output, quiet mode and terminal detection behave as for a local run. The
+ * reply is the 32 bit exit code of the command.
+ */
+
+static bool
+write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+	const char *p = buf;
+
+	while (len > 0)
+	{
+		n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+read_full(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+	char *p = buf;
+
+	while (len > 0)
+	{
+		n = read(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+send_request(int fd, int argc, char **argv)
+{
+	int i, fds[2] = { 1, 2 };
+	uint32_t len = 0;
+	char *buf, *p;
+	char ctl[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg = { };
+	struct cmsghdr *cmsg;
+	bool rv = false;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	if (len > FW3_DAEMON_MAXREQ || !(buf = malloc(len)))
+		return false;
+
+	for (i = 0, p = buf; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(len))
+		rv = write_full(fd, buf, len);
+
+	free(buf);
+	return rv;
+}
+
+int
+fw3_daemon_forward(int argc, char **argv)
+{
+	int fd;
+	int32_t rv;
+
+	if (getenv(FW3_DIRECT_ENV))
+		return -1;
+
+	fd = usock(USOCK_UNIX, FW3_SOCKFILE, NULL);
+
+	if (fd < 0)
+		return -1;
+
+	if (!send_request(fd, argc, argv))
+	{
+		close(fd);
+		return -1;
+	}
+
+	/* from here on the command may have been applied partially, so do not
+	 * fall back to a local run if the daemon goes away */
+	if (!read_full(fd, &rv, sizeof(rv)))
+	{
+		warn("Lost connection to the firewall daemon");
+		rv = 1;
+	}
+
+	close(fd);
+	return rv;
+}
+
+
+static bool
+recv_request(int fd, int *fds, int *argc, char ***argv, char **buf)
+{
+	uint32_t len;
+	char ctl[CMSG_SPACE(2 * sizeof(int))];
+	char *p, **args;
+	int i, n;
+	struct iovec iov = { &len, sizeof(len) };
+	struct msghdr msg = { };
+	struct cmsghdr *cmsg;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(len))
+		return false;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		if (n == 2)
+			memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+		else
+			for (i = 0; i < n; i++)
+				close(((int *)CMSG_DATA(cmsg))[i]);
+	}
+
+	if (fds[0] < 0 || fds[1] < 0)
+		return false;
+
+	if (!len || len > FW3_DAEMON_MAXREQ || !(*buf = malloc(len)))
+		return false;
+
+	if (!read_full(fd, *buf, len) || (*buf)[len - 1])
+		return false;
+
+	for (p = *buf, n = 0; p < *buf + len; p += strlen(p) + 1)
+		n++;
+
+	if (!(args = calloc(n + 1, sizeof(*args))))
+		return false;
+
+	for (p = *buf, i = 0; i < n; p += strlen(p) + 1)
+		args[i++] = p;
+
+	*argc = n;
+	*argv = args;
+
+	return true;
+}
+
+static void
+handle_request(int fd, fw3_daemon_handler_t handler)
+{
+	int32_t rv;
+	int argc, out, err, fds[2] = { -1, -1 };
+	char **argv = NULL, *buf = NULL;
+	struct timeval tv = { 1, 0 };
+
+	/* a stuck client must not block the daemon */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (recv_request(fd, fds, &argc, &argv, &buf))
+	{
+		fflush(stdout);
+		fflush(stderr);
+
+		out = dup(1);
+		err = dup(2);
+
+		dup2(fds[0], 1);
+		dup2(fds[1], 2);
+
+		rv = handler(argc, argv);
+
+		/* restoring the descriptors also undoes a freopen() of stderr
+		 * done by the command, since that keeps the descriptor number */
+		fflush(stdout);
+		fflush(stderr);
+
+		dup2(out, 1);
+		dup2(err, 2);
+
+		close(out);
+		close(err);
+
+		clearerr(stdout);
+		clearerr(stderr);
+
+		write_full(fd, &rv, sizeof(rv));
+	}
+
+	if (fds[0] >= 0)
+		close(fds[0]);
+
+	if (fds[1] >= 0)
+		close(fds[1]);
+
+	free(argv);
+	free(buf);
+}
+
+static void
+handle_signal(int signo)
+{
+	daemon_quit = 1;
+}
+
+static void
+queue_event(const char *net)
+{
+	int i;
+
+	for (i = 0; i < n_pending; i++)
+		if (!strcmp(pending[i], net))
+			return;
+
+	if (n_pending >= FW3_DAEMON_EVENTS || strlen(net) >= sizeof(pending[0]))
+	{
+		pending_overflow = true;
+		return;
+	}
+
+	strcpy(pending[n_pending++], net);
+}
+
+static void
+handle_events(fw3_daemon_event_t event)
+{
+	int i;
+
+	if (pending_overflow)
+		event(NULL);
+	else
+		for (i = 0; i < n_pending; i++)
+			event(pending[i]);
+
+	n_pending = 0;
+	pending_overflow = false;
+}
+
+int
+fw3_daemon_run(fw3_daemon_handler_t handler, fw3_daemon_event_t event)
+{
+	int fd, cfd, n;
+	bool busy;
+	struct pollfd pfd[2];
+	struct sigaction sa = { .sa_handler = handle_signal };
+
+	fd = usock(USOCK_UNIX, FW3_SOCKFILE, NULL);
+
+	if (fd >= 0)
+	{
+		close(fd);
+		warn("Another firewall daemon is listening on %s", FW3_SOCKFILE);
+		return 1;
+	}
+
+	unlink(FW3_SOCKFILE);
+
+	fd = usock(USOCK_UNIX | USOCK_SERVER, FW3_SOCKFILE, NULL);
+
+	if (fd < 0)
+	{
+		warn("Unable to listen on %s: %s", FW3_SOCKFILE, strerror(errno));
+		return 1;
+	}
+
+	chmod(FW3_SOCKFILE, 0600);
+
+	setenv(FW3_DIRECT_ENV, "1", 1);
+	signal(SIGPIPE, SIG_IGN);
+
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	info(" * Firewall daemon listening on %s", FW3_SOCKFILE);
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
+
+	while (!daemon_quit)
+	{
+		/* commands fire hotplug events without waiting for them, reap
+		 * whatever finished in the meanwhile */
+		while (waitpid(-1, NULL, WNOHANG) > 0);
+
+		/* (re)subscribes if ubus was not available or went away */
+		pfd[1].fd = fw3_ubus_subscribe(queue_event);
+
+		busy = (n_pending > 0 || pending_overflow);
+		n = poll(pfd, 2, busy ? FW3_DAEMON_SETTLE : 5000);
+
+		if (n == 0 && busy)
+			handle_events(event);
+
+		if (n <= 0)
+			continue;
+
+		if (pfd[1].revents)
+			fw3_ubus_handle_events();
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (cfd < 0)
+			continue;
+
+		handle_request(cfd, handler);
+		close(cfd);
+	}
+
+	close(fd);
+	unlink(FW3_SOCKFILE);
+
+	return 0;
+}
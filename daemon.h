@@ -0,0 +1,39 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FW3_DAEMON_H
+#define __FW3_DAEMON_H
+
+#include "options.h"
+#include "utils.h"
+
+/* set in the environment of the daemon so that fw3 invocations from its
+ * own children (hotplug handlers, includes) never wait on the daemon */
+#define FW3_DIRECT_ENV	"FW3_DIRECT"
+
+
+typedef int (*fw3_daemon_handler_t)(int argc, char **argv);
+
+/* called with the name of a changed network, NULL if too many changed */
+typedef void (*fw3_daemon_event_t)(const char *net);
+
+int fw3_daemon_forward(int argc, char **argv);
+
+int fw3_daemon_run(fw3_daemon_handler_t handler, fw3_daemon_event_t event);
+
+#endif
@@ -17,6 +17,7 @@
  */
 
 #include "defaults.h"
+#include "probe.h"
 
 
 #define C(f, tbl, def, fmt) \
@@ -62,6 +63,11 @@ const struct fw3_option fw3_flag_opts[] = {
 	FW3_OPT("flow_offloading",     bool,     defaults, flow_offloading),
 	FW3_OPT("flow_offloading_hw",  bool,     defaults, flow_offloading_hw),
 
+	FW3_OPT("hotplug_workers",     int,      defaults, hotplug_workers),
+	FW3_OPT("hotplug_timeout",     int,      defaults, hotplug_timeout),
+
+	FW3_OPT("probe_cache",         bool,     defaults, probe_cache),
+
 	FW3_OPT("__flags_v4",          int,      defaults, flags[0]),
 	FW3_OPT("__flags_v6",          int,      defaults, flags[1]),
 
@@ -87,21 +93,11 @@ check_policy(struct uci_element *e, enum fw3_flag *pol, const char *name)
 static void
 check_kmod(struct uci_element *e, bool *module, const char *name)
 {
-	FILE *f;
-	char buf[128];
-
 	if (!*module)
 		return;
 
-	snprintf(buf, sizeof(buf), "/sys/module/%s/refcnt", name);
-
-	f = fopen(buf, "r");
-
-	if (f)
-	{
-		fclose(f);
+	if (fw3_probe_module(name))
 		return;
-	}
 
 	warn_elem(e, "requires not available kernel module %s, disabling", name);
 	*module = false;
@@ -465,6 +461,20 @@ fw3_flush_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	del(defs->flags, handle->family, handle->table);
 }
 
+/* whether the given chain is flushed by fw3_flush_rules() on reload */
+bool
+fw3_default_chain_reloaded(enum fw3_table table, const char *chain)
+{
+	const struct fw3_chain_spec *c;
+
+	for (c = default_chains; c->format; c++)
+		if (c->table == table && c->flag != FW3_FLAG_CUSTOM_CHAINS &&
+		    !strcmp(c->format, chain))
+			return true;
+
+	return false;
+}
+
 void
 fw3_flush_all(struct fw3_ipt_handle *handle)
 {
@@ -40,6 +40,8 @@ void fw3_set_defaults(struct fw3_state *state);
 void fw3_flush_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
                      bool reload);
 
+bool fw3_default_chain_reloaded(enum fw3_table table, const char *chain);
+
 void fw3_flush_all(struct fw3_ipt_handle *handle);
 
 #endif
@@ -17,6 +17,7 @@
  */
 
 #include "forwards.h"
+#include "pool.h"
 
 
 const struct fw3_option fw3_forward_opts[] = {
@@ -67,28 +68,44 @@ check_forward(struct fw3_state *state, struct fw3_forward *forward, struct uci_e
 	return true;
 }
 
-static struct fw3_forward *
-fw3_alloc_forward(struct fw3_state *state)
+static void *
+fw3_alloc_forward(void)
 {
 	struct fw3_forward *forward;
 
-	forward = calloc(1, sizeof(*forward));
+	forward = fw3_slab_alloc(sizeof(*forward));
 	if (!forward)
 		return NULL;
 
 	forward->enabled = true;
 
-	list_add_tail(&forward->list, &state->forwards);
+	INIT_LIST_HEAD(&forward->list);
 
 	return forward;
 }
 
+static void
+finish_forward(struct fw3_state *state, void *obj, struct uci_element *e,
+               bool valid)
+{
+	struct fw3_forward *forward = obj;
+
+	if (!valid)
+		warn_elem(e, "has invalid options");
+
+	if (!check_forward(state, forward, e))
+	{
+		fw3_free_forward(forward);
+		return;
+	}
+
+	list_add_tail(&forward->list, &state->forwards);
+}
+
 void
 fw3_load_forwards(struct fw3_state *state, struct uci_package *p,
 		struct blob_attr *a)
 {
-	struct uci_section *s;
-	struct uci_element *e;
 	struct fw3_forward *forward;
 	struct blob_attr *entry;
 	unsigned rem;
@@ -106,7 +123,7 @@ fw3_load_forwards(struct fw3_state *state, struct uci_package *p,
 		if (strcmp(type, "forwarding"))
 			continue;
 
-		forward = fw3_alloc_forward(state);
+		forward = fw3_alloc_forward();
 		if (!forward)
 			continue;
 
@@ -118,26 +135,16 @@ fw3_load_forwards(struct fw3_state *state, struct uci_package *p,
 		}
 
 		if (!check_forward(state, forward, NULL))
+		{
 			fw3_free_forward(forward);
-	}
-
-	uci_foreach_element(&p->sections, e)
-	{
-		s = uci_to_section(e);
-
-		if (strcmp(s->type, "forwarding"))
-			continue;
-
-		forward = fw3_alloc_forward(state);
-		if (!forward)
 			continue;
+		}
 
-		if (!fw3_parse_options(forward, fw3_forward_opts, s))
-			warn_elem(e, "has invalid options");
-
-		if (!check_forward(state, forward, e))
-			fw3_free_forward(forward);
+		list_add_tail(&forward->list, &state->forwards);
 	}
+
+	fw3_pool_load(state, p, "forwarding", fw3_forward_opts,
+	              fw3_alloc_forward, finish_forward);
 }
 
 
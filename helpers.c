@@ -17,6 +17,8 @@
  */
 
 #include "helpers.h"
+#include "snapshot.h"
+#include "probe.h"
 
 
 const struct fw3_option fw3_cthelper_opts[] = {
@@ -35,15 +37,7 @@ const struct fw3_option fw3_cthelper_opts[] = {
 static bool
 test_module(struct fw3_cthelper *helper)
 {
-	struct stat s;
-	char path[sizeof("/sys/module/nf_conntrack_xxxxxxxxxxxxxxxx")];
-
-	snprintf(path, sizeof(path), "/sys/module/%s", helper->module);
-
-	if (stat(path, &s) || !S_ISDIR(s.st_mode))
-		return false;
-
-	return true;
+	return fw3_probe_module(helper->module);
 }
 
 static bool
@@ -90,12 +84,19 @@ check_cthelper(struct fw3_state *state, struct fw3_cthelper *helper, struct uci_
 	return false;
 }
 
+/* helper names are matched case-insensitively */
+static int
+cthelper_cmp(const void *k1, const void *k2, void *ptr)
+{
+	return strcasecmp(k1, k2);
+}
+
 static struct fw3_cthelper *
 fw3_alloc_cthelper(struct fw3_state *state)
 {
 	struct fw3_cthelper *helper;
 
-	helper = calloc(1, sizeof(*helper));
+	helper = fw3_slab_alloc(sizeof(*helper));
 	if (!helper)
 		return NULL;
 
@@ -131,7 +132,13 @@ load_cthelpers(struct fw3_state *state, struct uci_package *p)
 			warn_elem(e, "has invalid options");
 
 		if (!check_cthelper(state, helper, e))
+		{
 			fw3_free_cthelper(helper);
+			continue;
+		}
+
+		helper->node.key = helper->name;
+		avl_insert(&state->cthelper_index, &helper->node);
 	}
 }
 
@@ -142,17 +149,18 @@ fw3_load_cthelpers(struct fw3_state *state, struct uci_package *p)
 	FILE *fp;
 
 	INIT_LIST_HEAD(&state->cthelpers);
+	avl_init(&state->cthelper_index, cthelper_cmp, false, NULL);
 
-	fp = fopen(FW3_HELPERCONF, "r");
+	hp = fw3_snapshot_package(state->uci, "fw3_ct_helpers");
 
-	if (fp) {
+	if (!hp && (fp = fopen(FW3_HELPERCONF, "r")) != NULL) {
 		uci_import(state->uci, fp, "fw3_ct_helpers", &hp, true);
 		fclose(fp);
-
-		if (hp)
-			load_cthelpers(state, hp);
 	}
 
+	if (hp)
+		load_cthelpers(state, hp);
+
 	load_cthelpers(state, p);
 }
 
@@ -164,15 +172,7 @@ fw3_lookup_cthelper(struct fw3_state *state, const char *name)
 	if (list_empty(&state->cthelpers))
 		return NULL;
 
-	list_for_each_entry(h, &state->cthelpers, list)
-	{
-		if (strcasecmp(h->name, name))
-			continue;
-
-		return h;
-	}
-
-	return NULL;
+	return avl_find_element(&state->cthelper_index, name, h, node);
 }
 
 bool
@@ -16,7 +16,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <libubox/md5.h>
+
 #include "includes.h"
+#include "defaults.h"
+#include "zones.h"
 
 
 const struct fw3_option fw3_include_opts[] = {
@@ -26,6 +30,12 @@ const struct fw3_option fw3_include_opts[] = {
 	FW3_OPT("type",                include_type,   include,     type),
 	FW3_OPT("family",              family,         include,     family),
 	FW3_OPT("reload",              bool,           include,     reload),
+	FW3_OPT("independent",         bool,           include,     independent),
+	FW3_OPT("idempotent",          bool,           include,     idempotent),
+
+	FW3_OPT("__hash",              string,         include,     old_hash),
+	FW3_OPT("__mtime",             int,            include,     old_mtime),
+	FW3_OPT("__size",              int,            include,     old_size),
 
 	{ }
 };
@@ -49,17 +59,18 @@ check_include(struct fw3_state *state, struct fw3_include *include, struct uci_e
 	return true;
 }
 
-static struct fw3_include *
+struct fw3_include *
 fw3_alloc_include(struct fw3_state *state)
 {
 	struct fw3_include *include;
 
-	include = calloc(1, sizeof(*include));
+	include = fw3_slab_alloc(sizeof(*include));
 	if (!include)
 		return NULL;
 
 	include->enabled = true;
 
+	INIT_LIST_HEAD(&include->records);
 	list_add_tail(&include->list, &state->includes);
 
 	return include;
@@ -125,6 +136,478 @@ fw3_load_includes(struct fw3_state *state, struct uci_package *p,
 }
 
 
+struct include_record {
+	struct list_head list;
+	enum fw3_table table;
+	int argc;
+	char *argv[];
+};
+
+static const char *restore_cmds[][2] = {
+	{ "-A", "--append" },
+	{ "-I", "--insert" },
+	{ "-N", "--new-chain" },
+	{ "-F", "--flush" },
+	{ "-X", "--delete-chain" },
+	{ "-P", "--policy" },
+	{ }
+};
+
+/* options of -A and -I handled by apply_rule() and rule_apply() */
+static const char *rule_opts[][2] = {
+	{ "-p", "--protocol" },
+	{ "-i", "--in-interface" },
+	{ "-o", "--out-interface" },
+	{ "-s", "--source" },
+	{ "-d", "--destination" },
+	{ "-m", "--match" },
+	{ "-j", "--jump" },
+	{ }
+};
+
+/* split a restore line into words, honouring quotes like iptables-restore */
+static int
+split_line(char *line, char **words, int max)
+{
+	int n = 0;
+	char *p = line, *w, quote;
+
+	while (*p)
+	{
+		while (isspace(*p))
+			p++;
+
+		if (!*p || *p == '#')
+			break;
+
+		if (n >= max)
+			return -1;
+
+		for (w = words[n++] = p, quote = 0; *p; p++)
+		{
+			if (quote)
+			{
+				if (*p == '\\' && p[1] == quote)
+					*w++ = *++p;
+				else if (*p == quote)
+					quote = 0;
+				else
+					*w++ = *p;
+			}
+			else if (*p == '"' || *p == '\'')
+			{
+				quote = *p;
+			}
+			else if (isspace(*p))
+			{
+				p++;
+				break;
+			}
+			else
+			{
+				*w++ = *p;
+			}
+		}
+
+		if (quote)
+			return -1;
+
+		*w = 0;
+	}
+
+	return n;
+}
+
+static bool
+is_word(const char *word, const char *(*words)[2])
+{
+	int i;
+
+	for (i = 0; words[i][0]; i++)
+		if (!strcmp(word, words[i][0]) || !strcmp(word, words[i][1]))
+			return true;
+
+	return false;
+}
+
+static bool
+is_policy(const char *word)
+{
+	return (!strcmp(word, "ACCEPT") || !strcmp(word, "DROP"));
+}
+
+/*
+ * Check that a command only uses options the in-process rule parser
+ * understands: the generic ones with an argument rule_apply() accepts, and
+ * long options following a match or target, which are handed to its
+ * extension.
+ */
+static bool
+check_record(char **words, int n)
+{
+	int i = 2;
+	bool ext = false;
+	char *e, *o;
+	struct fw3_protocol proto;
+	struct fw3_device dev;
+	struct fw3_address addr;
+
+	if (!strcmp(words[0], "-P") || !strcmp(words[0], "--policy"))
+		return (n == 3 && is_policy(words[2]));
+
+	if (strcmp(words[0], "-A") && strcmp(words[0], "--append") &&
+	    strcmp(words[0], "-I") && strcmp(words[0], "--insert"))
+		return (n == 2);
+
+	/* -I chain [rulenum] ... */
+	if (words[0][1] == 'I' || !strcmp(words[0], "--insert"))
+		if (i < n && strtoul(words[i], &e, 10) && !*e)
+			i++;
+
+	for (; i < n; i++)
+	{
+		if (!strcmp(words[i], "!"))
+			continue;
+
+		if (!is_word(words[i], rule_opts))
+		{
+			/* extension options and their arguments */
+			if (!ext || (words[i][0] == '-' && words[i][1] != '-'))
+				return false;
+
+			continue;
+		}
+
+		if (++i >= n)
+			return false;
+
+		o = words[i - 1];
+
+		if (!strcmp(o, "-p") || !strcmp(o, "--protocol"))
+		{
+			if (!fw3_parse_protocol(&proto, words[i], false))
+				return false;
+		}
+		else if (!strcmp(o, "-i") || !strcmp(o, "--in-interface") ||
+		         !strcmp(o, "-o") || !strcmp(o, "--out-interface"))
+		{
+			if (!fw3_parse_device(&dev, words[i], false) ||
+			    dev.any || dev.invert || *dev.network)
+				return false;
+		}
+		else if (!strcmp(o, "-s") || !strcmp(o, "--source") ||
+		         !strcmp(o, "-d") || !strcmp(o, "--destination"))
+		{
+			if (!fw3_parse_address(&addr, words[i], false) ||
+			    addr.range || addr.invert)
+				return false;
+		}
+		else
+		{
+			ext = true;
+		}
+	}
+
+	return true;
+}
+
+static bool
+add_record(struct fw3_include *include, enum fw3_table table,
+           char **words, int n)
+{
+	int i;
+	size_t len = 0;
+	char *p;
+	struct include_record *rec;
+
+	for (i = 0; i < n; i++)
+		len += strlen(words[i]) + 1;
+
+	rec = calloc(1, sizeof(*rec) + (n + 1) * sizeof(char *) + len);
+
+	if (!rec)
+		return false;
+
+	rec->table = table;
+	rec->argc = n;
+
+	for (i = 0, p = (char *)&rec->argv[n + 1]; i < n; i++)
+	{
+		rec->argv[i] = strcpy(p, words[i]);
+		p += strlen(words[i]) + 1;
+	}
+
+	list_add_tail(&rec->list, &include->records);
+	return true;
+}
+
+/*
+ * Parse a restore include into records which can be applied to an open
+ * table handle. Any construct not understood here causes the include to
+ * be passed to iptables-restore as a whole, like before.
+ */
+static bool
+parse_records(struct fw3_include *include)
+{
+	FILE *f;
+	int n, lineno = 0;
+	char line[1024], *words[128];
+	enum fw3_table table = -1;
+	bool ok = true;
+
+	if (!(f = fopen(include->path, "r")))
+		return false;
+
+	while (ok && fgets(line, sizeof(line), f))
+	{
+		lineno++;
+
+		if (!strchr(line, '\n') && !feof(f))
+		{
+			ok = false;
+			break;
+		}
+
+		n = split_line(line, words, ARRAY_SIZE(words));
+
+		if (n < 0)
+		{
+			ok = false;
+		}
+		else if (n == 0)
+		{
+			continue;
+		}
+		else if (words[0][0] == '*')
+		{
+			for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
+				if (!strcmp(words[0] + 1, fw3_flag_names[table]))
+					break;
+
+			ok = (n == 1 && table <= FW3_TABLE_RAW);
+		}
+		else if (!strcmp(words[0], "COMMIT"))
+		{
+			ok = (n == 1 && table != -1);
+			table = -1;
+		}
+		else if (table == -1)
+		{
+			ok = false;
+		}
+		else if (words[0][0] == ':')
+		{
+			ok = (n >= 2 && words[0][1] &&
+			      (!strcmp(words[1], "-") || is_policy(words[1])) &&
+			      add_record(include, table, words, 2));
+		}
+		else
+		{
+			/* drop leading packet counters */
+			if (words[0][0] == '[')
+			{
+				n--;
+				memmove(words, words + 1, n * sizeof(*words));
+			}
+
+			ok = (n >= 2 && is_word(words[0], restore_cmds) &&
+			      check_record(words, n) &&
+			      add_record(include, table, words, n));
+		}
+	}
+
+	fclose(f);
+
+	if (!ok || table != -1)
+	{
+		info(" * Include '%s' cannot be applied in-process (line %d), "
+		     "passing it to iptables-restore", include->path, lineno);
+
+		fw3_free_include_records(include);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+load_records(struct fw3_include *include)
+{
+	if (!include->loaded)
+	{
+		include->parsed = parse_records(include);
+		include->loaded = true;
+	}
+
+	return include->parsed;
+}
+
+static void
+apply_rule(struct fw3_ipt_handle *handle, struct include_record *rec)
+{
+	int i = 2;
+	unsigned int pos = 0;
+	char *e;
+	struct fw3_protocol proto;
+	struct fw3_ipt_rule *r;
+
+	/* -I chain [rulenum] ... */
+	if (rec->argv[0][1] == 'I' || !strcmp(rec->argv[0], "--insert"))
+	{
+		pos = 1;
+
+		if (i < rec->argc)
+		{
+			pos = strtoul(rec->argv[i], &e, 10);
+
+			if (*e || !pos)
+				pos = 1;
+			else
+				i++;
+		}
+	}
+
+	r = fw3_ipt_rule_new(handle);
+
+	for (; i < rec->argc; i++)
+	{
+		if (!strcmp(rec->argv[i], "!") && (i + 2) < rec->argc &&
+		    (!strcmp(rec->argv[i + 1], "-p") ||
+		     !strcmp(rec->argv[i + 1], "--protocol")))
+			continue;
+
+		if ((!strcmp(rec->argv[i], "-p") || !strcmp(rec->argv[i], "--protocol")) &&
+		    (i + 1) < rec->argc)
+		{
+			if (fw3_parse_protocol(&proto, rec->argv[i + 1], false) &&
+			    !proto.any)
+			{
+				proto.invert = (i > 2 && !strcmp(rec->argv[i - 1], "!"));
+				fw3_ipt_rule_proto(r, &proto);
+			}
+
+			i++;
+			continue;
+		}
+
+		fw3_ipt_rule_addarg(r, false, rec->argv[i], NULL);
+	}
+
+	fw3_ipt_rule_restore(r, rec->argv[1], pos);
+}
+
+static void
+apply_record(struct fw3_ipt_handle *handle, struct include_record *rec)
+{
+	char *cmd = rec->argv[0];
+	char *chain = rec->argv[1];
+	enum fw3_flag policy;
+
+	if (cmd[0] == ':')
+	{
+		chain = cmd + 1;
+
+		if (fw3_ipt_is_builtin(handle, chain))
+		{
+			if (strcmp(rec->argv[1], "-"))
+			{
+				policy = strcmp(rec->argv[1], "DROP")
+					? FW3_FLAG_ACCEPT : FW3_FLAG_DROP;
+
+				fw3_ipt_set_policy(handle, chain, policy);
+			}
+		}
+		else if (fw3_ipt_is_chain(handle, chain))
+		{
+			fw3_ipt_flush_chain(handle, chain);
+		}
+		else
+		{
+			fw3_ipt_create_chain(handle, "%s", chain);
+		}
+	}
+	else if (!strcmp(cmd, "-A") || !strcmp(cmd, "--append") ||
+	         !strcmp(cmd, "-I") || !strcmp(cmd, "--insert"))
+	{
+		apply_rule(handle, rec);
+	}
+	else if (!strcmp(cmd, "-N") || !strcmp(cmd, "--new-chain"))
+	{
+		if (!fw3_ipt_is_chain(handle, chain))
+			fw3_ipt_create_chain(handle, "%s", chain);
+	}
+	else if (!strcmp(cmd, "-F") || !strcmp(cmd, "--flush"))
+	{
+		fw3_ipt_flush_chain(handle, chain);
+	}
+	else if (!strcmp(cmd, "-X") || !strcmp(cmd, "--delete-chain"))
+	{
+		fw3_ipt_delete_chain(handle, chain);
+	}
+	else if (rec->argc >= 3 && is_policy(rec->argv[2]))
+	{
+		policy = strcmp(rec->argv[2], "DROP")
+			? FW3_FLAG_ACCEPT : FW3_FLAG_DROP;
+
+		fw3_ipt_set_policy(handle, chain, policy);
+	}
+}
+
+void
+fw3_print_include_rules(struct fw3_ipt_handle *handle,
+                        struct fw3_state *state, bool reload)
+{
+	bool loaded;
+	struct fw3_include *include;
+	struct include_record *rec;
+
+	list_for_each_entry(include, &state->includes, list)
+	{
+		if (reload && !include->reload)
+			continue;
+
+		if (include->type != FW3_INC_TYPE_RESTORE)
+			continue;
+
+		if (!fw3_is_family(include, handle->family))
+			continue;
+
+		if (!load_records(include))
+			continue;
+
+		if (reload && include->unchanged)
+			continue;
+
+		loaded = false;
+
+		list_for_each_entry(rec, &include->records, list)
+		{
+			if (rec->table != handle->table)
+				continue;
+
+			if (!loaded)
+			{
+				info("   * Applying include '%s'", include->path);
+				loaded = true;
+			}
+
+			apply_record(handle, rec);
+		}
+	}
+}
+
+void
+fw3_free_include_records(struct fw3_include *include)
+{
+	struct include_record *rec, *tmp;
+
+	list_for_each_entry_safe(rec, tmp, &include->records, list)
+	{
+		list_del(&rec->list);
+		free(rec);
+	}
+}
+
 static void
 print_include(struct fw3_include *include)
 {
@@ -167,6 +650,16 @@ fw3_print_includes(struct fw3_state *state, enum fw3_family family, bool reload)
 		if (!fw3_is_family(include, family))
 			continue;
 
+		/* already applied along with the table contents */
+		if (load_records(include))
+			continue;
+
+		if (reload && include->unchanged)
+		{
+			info(" * Skipping unchanged include '%s'", include->path);
+			continue;
+		}
+
 		if (!exec)
 		{
 			exec = fw3_command_pipe(false, restore, "--noflush");
@@ -183,45 +676,394 @@ fw3_print_includes(struct fw3_state *state, enum fw3_family family, bool reload)
 }
 
 
-static void
-run_include(struct fw3_include *include)
+static bool
+is_builtin_chain(const char *chain)
 {
-	int rv;
+	return (!strcmp(chain, "INPUT") || !strcmp(chain, "OUTPUT") ||
+	        !strcmp(chain, "FORWARD") || !strcmp(chain, "PREROUTING") ||
+	        !strcmp(chain, "POSTROUTING"));
+}
+
+/*
+ * Whether the effect of a restore include survives a reload untouched:
+ * it must only populate chains which fw3 does not flush on reload and
+ * must not touch builtin chains, whose fw3 rules get re-appended behind
+ * the include rules.
+ */
+static bool
+survives_reload(struct fw3_state *state, struct fw3_include *include)
+{
+	const char *chain;
+	struct include_record *rec;
+
+	list_for_each_entry(rec, &include->records, list)
+	{
+		chain = (rec->argv[0][0] == ':') ? rec->argv[0] + 1 : rec->argv[1];
+
+		if (is_builtin_chain(chain) ||
+		    fw3_default_chain_reloaded(rec->table, chain) ||
+		    fw3_zone_chain_reloaded(state, rec->table, chain))
+			return false;
+	}
+
+	return true;
+}
+
+static struct fw3_include *
+find_include(struct fw3_state *state, struct fw3_include *include)
+{
+	struct fw3_include *i;
+
+	if (!state)
+		return NULL;
+
+	list_for_each_entry(i, &state->includes, list)
+		if (i->type == include->type && !strcmp(i->path, include->path))
+			return i;
+
+	return NULL;
+}
+
+/*
+ * Fingerprint idempotent includes and compare them against the ones
+ * recorded in the state file. Unchanged includes are skipped on reload.
+ */
+void
+fw3_check_includes(struct fw3_state *state, struct fw3_state *run_state)
+{
+	int i;
 	struct stat s;
-	const char *tmpl =
-		"config() { "
-			"echo \"You cannot use UCI in firewall includes!\" >&2; "
-			"exit 1; "
-		"}; . %s";
+	uint8_t digest[16];
+	struct fw3_include *include, *prev;
 
-	char buf[PATH_MAX + sizeof(tmpl)];
+	list_for_each_entry(include, &state->includes, list)
+	{
+		include->unchanged = false;
+		include->hash[0] = 0;
 
-	info(" * Running script '%s'", include->path);
+		if (!include->idempotent || stat(include->path, &s))
+			continue;
+
+		include->mtime = s.st_mtime;
+		include->size = s.st_size;
+
+		prev = find_include(run_state, include);
+
+		if (prev && prev->old_hash && strlen(prev->old_hash) == 32 &&
+		    prev->old_mtime == include->mtime && prev->old_size == include->size)
+		{
+			strcpy(include->hash, prev->old_hash);
+		}
+		else
+		{
+			if (md5sum(include->path, digest) < 0)
+				continue;
+
+			for (i = 0; i < 16; i++)
+				sprintf(include->hash + i * 2, "%02x", digest[i]);
+		}
+
+		if (!prev || !prev->old_hash || strcmp(prev->old_hash, include->hash))
+			continue;
+
+		if (include->type == FW3_INC_TYPE_RESTORE &&
+		    (!load_records(include) || !survives_reload(state, include)))
+			continue;
+
+		include->unchanged = true;
+	}
+}
+
+#define INCLUDE_GUARD \
+	"config() { " \
+		"echo \"You cannot use UCI in firewall includes!\" >&2; " \
+		"exit 1; " \
+	"}; . %s"
+
+/*
+ * Script includes are fed to one long-lived shell which runs each of them
+ * in a subshell with the usual config() guard and reports the exit code
+ * as "<index> <status>" line on a dedicated status pipe (fd 9). The stdin
+ * of fw3 is passed to the includes as fd 7, fd 0 of the shell carries the
+ * commands.
+ */
+struct include_worker {
+	pid_t pid;
+	FILE *cmd;
+	FILE *status;
+	void (*sigpipe)(int);
+};
+
+struct include_job {
+	struct fw3_include *include;
+	struct timespec start;
+	bool started;
+	bool done;
+};
+
+static bool
+worker_start(struct include_worker *w)
+{
+	int cmd[2], st[2], in, c, s;
+
+	if (pipe(cmd))
+		return false;
+
+	if (pipe(st))
+	{
+		close(cmd[0]);
+		close(cmd[1]);
+		return false;
+	}
+
+	switch ((w->pid = fork()))
+	{
+	case -1:
+		close(cmd[0]);
+		close(cmd[1]);
+		close(st[0]);
+		close(st[1]);
+		return false;
+
+	case 0:
+		/* move everything out of the way before assigning fixed fds */
+		in = fcntl(0, F_DUPFD, 10);
+		c = fcntl(cmd[0], F_DUPFD, 10);
+		s = fcntl(st[1], F_DUPFD, 10);
+
+		if (in < 0)
+			in = open("/dev/null", O_RDONLY);
+
+		dup2(in, 7);
+		dup2(c, 0);
+		dup2(s, 9);
+
+		close(in);
+		close(c);
+		close(s);
+		close(cmd[0]);
+		close(cmd[1]);
+		close(st[0]);
+		close(st[1]);
+
+		execl("/bin/sh", "sh", "-s", NULL);
+		_exit(127);
+
+	default:
+		close(cmd[0]);
+		close(st[1]);
+
+		fcntl(cmd[1], F_SETFD, FD_CLOEXEC);
+		fcntl(st[0], F_SETFD, FD_CLOEXEC);
+
+		w->cmd = fdopen(cmd[1], "w");
+		w->status = fdopen(st[0], "r");
+
+		if (!w->cmd || !w->status)
+		{
+			if (w->cmd)
+				fclose(w->cmd);
+			else
+				close(cmd[1]);
+
+			if (w->status)
+				fclose(w->status);
+			else
+				close(st[0]);
+
+			waitpid(w->pid, NULL, 0);
+			return false;
+		}
+
+		w->sigpipe = signal(SIGPIPE, SIG_IGN);
+		return true;
+	}
+}
+
+static void
+worker_stop(struct include_worker *w)
+{
+	fclose(w->cmd);
+	fclose(w->status);
+	waitpid(w->pid, NULL, 0);
+	signal(SIGPIPE, w->sigpipe);
+}
+
+static void
+job_finish(struct include_job *job, int rv)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	job->done = true;
+
+	if (rv)
+		info("   ! Script '%s' failed with exit code %u",
+		     job->include->path, rv);
+
+	info("   ~ Script '%s' took %ld ms", job->include->path,
+	     (now.tv_sec - job->start.tv_sec) * 1000 +
+	     (now.tv_nsec - job->start.tv_nsec) / 1000000);
+}
+
+static bool
+jobs_done(struct include_job *jobs, int n, int want)
+{
+	int i;
+
+	if (want >= 0)
+		return jobs[want].done;
+
+	for (i = 0; i < n; i++)
+		if (!jobs[i].done)
+			return false;
+
+	return true;
+}
+
+/* collect status lines until job "want" completed or, if want is negative,
+ * until no job is pending anymore */
+static void
+worker_collect(struct include_worker *w, struct include_job *jobs, int n,
+               int want)
+{
+	int i, idx, rv;
+	char line[32];
+
+	while (!jobs_done(jobs, n, want))
+	{
+		if (!fgets(line, sizeof(line), w->status))
+		{
+			/* the shell went away, account the pending jobs as failed */
+			for (i = 0; i < n; i++)
+				if (jobs[i].started && !jobs[i].done)
+					job_finish(&jobs[i], 255);
+
+			return;
+		}
+
+		if (sscanf(line, "%d %d", &idx, &rv) == 2 &&
+		    idx >= 0 && idx < n && jobs[idx].started && !jobs[idx].done)
+			job_finish(&jobs[idx], rv);
+	}
+}
+
+static void
+worker_launch(struct include_worker *w, struct include_job *jobs, int idx)
+{
+	struct fw3_include *include = jobs[idx].include;
+	bool bg = include->independent;
+
+	info(" * Running script '%s'%s", include->path, bg ? " in background" : "");
+
+	clock_gettime(CLOCK_MONOTONIC, &jobs[idx].start);
+	jobs[idx].started = true;
+
+	fprintf(w->cmd, "%s( " INCLUDE_GUARD " ) <&7 7<&- 9>&-; "
+	                "echo \"%d $?\" >&9%s\n",
+	        bg ? "{ " : "", include->path, idx, bg ? "; } &" : "");
+
+	fflush(w->cmd);
+}
+
+static bool
+check_script(struct fw3_include *include)
+{
+	struct stat s;
 
 	if (stat(include->path, &s))
 	{
+		info(" * Running script '%s'", include->path);
 		info("   ! Skipping due to path error: %s", strerror(errno));
-		return;
+		return false;
 	}
 
-	snprintf(buf, sizeof(buf), tmpl, include->path);
+	return true;
+}
+
+static void
+run_include(struct fw3_include *include)
+{
+	int rv;
+	char buf[PATH_MAX + sizeof(INCLUDE_GUARD)];
+
+	if (!check_script(include))
+		return;
+
+	info(" * Running script '%s'", include->path);
+
+	snprintf(buf, sizeof(buf), INCLUDE_GUARD, include->path);
 	rv = system(buf);
 
 	if (rv)
 		info("   ! Failed with exit code %u", WEXITSTATUS(rv));
 }
 
+static bool
+run_on(struct fw3_include *include, bool reload)
+{
+	if (include->type != FW3_INC_TYPE_SCRIPT)
+		return false;
+
+	if (reload && (!include->reload || include->unchanged))
+		return false;
+
+	return true;
+}
+
 void
 fw3_run_includes(struct fw3_state *state, bool reload)
 {
+	int i, n = 0;
 	struct fw3_include *include;
+	struct include_job *jobs;
+	struct include_worker w;
 
 	list_for_each_entry(include, &state->includes, list)
 	{
-		if (reload && !include->reload)
+		if (run_on(include, reload))
+			n++;
+		else if (reload && include->reload && include->unchanged &&
+		         include->type == FW3_INC_TYPE_SCRIPT)
+			info(" * Skipping unchanged script '%s'", include->path);
+	}
+
+	if (!n)
+		return;
+
+	jobs = calloc(n, sizeof(*jobs));
+
+	/* fall back to one shell per include if the worker cannot be spawned */
+	if (!jobs || !worker_start(&w))
+	{
+		list_for_each_entry(include, &state->includes, list)
+			if (run_on(include, reload))
+				run_include(include);
+
+		free(jobs);
+		return;
+	}
+
+	i = 0;
+	list_for_each_entry(include, &state->includes, list)
+		if (run_on(include, reload))
+			jobs[i++].include = include;
+
+	for (i = 0; i < n; i++)
+	{
+		if (!check_script(jobs[i].include))
+		{
+			jobs[i].done = true;
 			continue;
+		}
+
+		worker_launch(&w, jobs, i);
 
-		if (include->type == FW3_INC_TYPE_SCRIPT)
-			run_include(include);
+		if (!jobs[i].include->independent)
+			worker_collect(&w, jobs, n, i);
 	}
+
+	worker_collect(&w, jobs, n, -1);
+	worker_stop(&w);
+	free(jobs);
 }
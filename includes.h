@@ -21,19 +21,30 @@
 
 #include "options.h"
 #include "utils.h"
+#include "iptables.h"
 
 extern const struct fw3_option fw3_include_opts[];
 
+struct fw3_include * fw3_alloc_include(struct fw3_state *state);
+
 void fw3_load_includes(struct fw3_state *state, struct uci_package *p, struct blob_attr *a);
 
+void fw3_check_includes(struct fw3_state *state, struct fw3_state *run_state);
+
+void fw3_print_include_rules(struct fw3_ipt_handle *handle,
+                             struct fw3_state *state, bool reload);
+
 void fw3_print_includes(struct fw3_state *state, enum fw3_family family,
                         bool reload);
 
 void fw3_run_includes(struct fw3_state *state, bool reload);
 
+void fw3_free_include_records(struct fw3_include *include);
+
 static inline void fw3_free_include(struct fw3_include *include)
 {
 	list_del(&include->list);
+	fw3_free_include_records(include);
 	fw3_free_object(include, fw3_include_opts);
 }
 
@@ -240,12 +240,12 @@ check_ipset(struct fw3_state *state, struct fw3_ipset *ipset, struct uci_element
 	return false;
 }
 
-static struct fw3_ipset *
+struct fw3_ipset *
 fw3_alloc_ipset(struct fw3_state *state)
 {
 	struct fw3_ipset *ipset;
 
-	ipset = calloc(1, sizeof(*ipset));
+	ipset = fw3_slab_alloc(sizeof(*ipset));
 	if (!ipset)
 		return NULL;
 
@@ -271,6 +271,7 @@ fw3_load_ipsets(struct fw3_state *state, struct uci_package *p,
 	unsigned rem;
 
 	INIT_LIST_HEAD(&state->ipsets);
+	avl_init(&state->ipset_index, avl_strcmp, false, NULL);
 
 	if (state->disable_ipsets)
 		return;
@@ -298,7 +299,13 @@ fw3_load_ipsets(struct fw3_state *state, struct uci_package *p,
 		}
 
 		if (!check_ipset(state, ipset, NULL))
+		{
 			fw3_free_ipset(ipset);
+			continue;
+		}
+
+		ipset->node.key = ipset->name;
+		avl_insert(&state->ipset_index, &ipset->node);
 	}
 
 	uci_foreach_element(&p->sections, e)
@@ -317,7 +324,13 @@ fw3_load_ipsets(struct fw3_state *state, struct uci_package *p,
 			warn_elem(e, "has invalid options");
 
 		if (!check_ipset(state, ipset, e))
+		{
 			fw3_free_ipset(ipset);
+			continue;
+		}
+
+		ipset->node.key = ipset->name;
+		avl_insert(&state->ipset_index, &ipset->node);
 	}
 }
 
@@ -397,10 +410,81 @@ create_ipset(struct fw3_ipset *ipset, struct fw3_state *state)
 	load_file(ipset);
 }
 
+static int
+open_ipset_socket(unsigned int *version)
+{
+	socklen_t sz;
+	struct ip_set_req_version req_ver;
+	int s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+
+	if (s < 0 || fcntl(s, F_SETFD, FD_CLOEXEC))
+		goto err;
+
+	sz = sizeof(req_ver);
+	req_ver.op = IP_SET_OP_VERSION;
+
+	if (getsockopt(s, SOL_IP, SO_IP_SET, &req_ver, &sz))
+		goto err;
+
+	*version = req_ver.version;
+	return s;
+
+err:
+	if (s >= 0)
+		close(s);
+
+	return -1;
+}
+
+static bool
+query_ipset(int s, unsigned int version, struct fw3_ipset *set)
+{
+	socklen_t sz;
+	struct ip_set_req_get_set req_name;
+
+	sz = sizeof(req_name);
+	req_name.op = IP_SET_OP_GET_BYNAME;
+	req_name.version = version;
+	snprintf(req_name.set.name, IPSET_MAXNAMELEN - 1, "%s",
+	         set->external ? set->external : set->name);
+
+	if (getsockopt(s, SOL_IP, SO_IP_SET, &req_name, &sz))
+		return false;
+
+	return ((sz == sizeof(req_name)) && (req_name.set.index != IPSET_INVALID_ID));
+}
+
+/*
+ * The ipset utility only exits after the kernel acknowledged every command,
+ * so once the child has been reaped a single query round is sufficient to
+ * confirm the outcome - there is nothing left to wait for.
+ */
+static void
+verify_ipsets(struct fw3_state *state, bool present)
+{
+	int s;
+	unsigned int version;
+	struct fw3_ipset *ipset;
+
+	if ((s = open_ipset_socket(&version)) < 0)
+		return;
+
+	list_for_each_entry(ipset, &state->ipsets, list)
+	{
+		if (!ipset->enabled || ipset->external)
+			continue;
+
+		if (query_ipset(s, version, ipset) != present)
+			warn("Unable to %s ipset '%s'",
+			     present ? "create" : "delete", ipset->name);
+	}
+
+	close(s);
+}
+
 void
 fw3_create_ipsets(struct fw3_state *state)
 {
-	int tries;
 	bool exec = false;
 	struct fw3_ipset *ipset;
 
@@ -427,30 +511,26 @@ fw3_create_ipsets(struct fw3_state *state)
 	if (exec)
 	{
 		fw3_pr("quit\n");
-		fw3_command_close();
-	}
 
-	/* wait for ipsets to appear */
-	list_for_each_entry(ipset, &state->ipsets, list)
-	{
-		if (ipset->external)
-			continue;
+		if (!fw3_command_close())
+			warn("The ipset utility reported errors while creating sets");
 
-		for (tries = 0; !fw3_check_ipset(ipset) && tries < 10; tries++)
-			usleep(50000);
+		verify_ipsets(state, true);
 	}
 }
 
 void
 fw3_destroy_ipsets(struct fw3_state *state)
 {
-	int tries;
 	bool exec = false;
 	struct fw3_ipset *ipset;
 
 	/* destroy ipsets */
 	list_for_each_entry(ipset, &state->ipsets, list)
 	{
+		if (!ipset->enabled || ipset->external)
+			continue;
+
 		if (!exec)
 		{
 			exec = fw3_command_pipe(false, "ipset", "-exist", "-");
@@ -468,17 +548,11 @@ fw3_destroy_ipsets(struct fw3_state *state)
 	if (exec)
 	{
 		fw3_pr("quit\n");
-		fw3_command_close();
-	}
 
-	/* wait for ipsets to disappear */
-	list_for_each_entry(ipset, &state->ipsets, list)
-	{
-		if (ipset->external)
-			continue;
+		if (!fw3_command_close())
+			warn("The ipset utility reported errors while deleting sets");
 
-		for (tries = 0; fw3_check_ipset(ipset) && tries < 10; tries++)
-			usleep(50000);
+		verify_ipsets(state, false);
 	}
 }
 
@@ -490,50 +564,21 @@ fw3_lookup_ipset(struct fw3_state *state, const char *name)
 	if (list_empty(&state->ipsets))
 		return NULL;
 
-	list_for_each_entry(s, &state->ipsets, list)
-	{
-		if (strcmp(s->name, name))
-			continue;
-
-		return s;
-	}
-
-	return NULL;
+	return avl_find_element(&state->ipset_index, name, s, node);
 }
 
 bool
 fw3_check_ipset(struct fw3_ipset *set)
 {
-	bool rv = false;
-
-	socklen_t sz;
-	int s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-	struct ip_set_req_version req_ver;
-	struct ip_set_req_get_set req_name;
-
-	if (s < 0 || fcntl(s, F_SETFD, FD_CLOEXEC))
-		goto out;
+	bool rv;
+	unsigned int version;
+	int s = open_ipset_socket(&version);
 
-	sz = sizeof(req_ver);
-	req_ver.op = IP_SET_OP_VERSION;
+	if (s < 0)
+		return false;
 
-	if (getsockopt(s, SOL_IP, SO_IP_SET, &req_ver, &sz))
-		goto out;
-
-	sz = sizeof(req_name);
-	req_name.op = IP_SET_OP_GET_BYNAME;
-	req_name.version = req_ver.version;
-	snprintf(req_name.set.name, IPSET_MAXNAMELEN - 1, "%s",
-	         set->external ? set->external : set->name);
-
-	if (getsockopt(s, SOL_IP, SO_IP_SET, &req_name, &sz))
-		goto out;
-
-	rv = ((sz == sizeof(req_name)) && (req_name.set.index != IPSET_INVALID_ID));
-
-out:
-	if (s >= 0)
-		close(s);
+	rv = query_ipset(s, version, set);
+	close(s);
 
 	return rv;
 }
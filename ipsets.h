@@ -27,6 +27,8 @@
 
 extern const struct fw3_option fw3_ipset_opts[];
 
+struct fw3_ipset * fw3_alloc_ipset(struct fw3_state *state);
+
 void fw3_load_ipsets(struct fw3_state *state, struct uci_package *p, struct blob_attr *a);
 void fw3_create_ipsets(struct fw3_state *state);
 void fw3_destroy_ipsets(struct fw3_state *state);
@@ -337,8 +337,83 @@ fw3_ipt_delete_chain(struct fw3_ipt_handle *h, const char *chain)
 		iptc_delete_chain(chain, h->handle);
 }
 
+/*
+ * Rules generated by fw3 carry a comment starting with "!fw3#" and eight
+ * hex digits, a fingerprint of the chain and the arguments of the rule,
+ * followed by ": " and the comment of the rule if it had one. Rules tagged
+ * by earlier versions only carry "!fw3" and are read with a fingerprint of
+ * zero.
+ */
+static bool
+parse_rule_tag(const char *comment, uint32_t *fingerprint)
+{
+	unsigned long v;
+	char *e;
+
+	if (strncmp(comment, "!fw3", 4))
+		return false;
+
+	*fingerprint = 0;
+
+	if (comment[4] == '#')
+	{
+		v = strtoul(comment + 5, &e, 16);
+
+		if (e == comment + 13 && (*e == ':' || *e == 0))
+			*fingerprint = v;
+	}
+
+	return true;
+}
+
+/* returns the tagged comment of the rule, NULL if it was not tagged by fw3 */
+static const char *
+has_rule_tag(const void *base, unsigned int start, unsigned int end,
+             uint32_t *fingerprint)
+{
+	unsigned int i;
+	uint32_t fp;
+	const struct xt_entry_match *em;
+
+	for (i = start; i < end; i += em->u.match_size)
+	{
+		em = base + i;
+
+		if (strcmp(em->u.user.name, "comment"))
+			continue;
+
+		if (parse_rule_tag((const char *)em->data, &fp))
+		{
+			if (fingerprint)
+				*fingerprint = fp;
+
+			return (const char *)em->data;
+		}
+	}
+
+	return NULL;
+}
+
+static const char *
+entry_tag(struct fw3_ipt_handle *h, const void *e, uint32_t *fingerprint)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+	{
+		const struct ip6t_entry *e6 = e;
+
+		return has_rule_tag(e6, sizeof(*e6), e6->target_offset, fingerprint);
+	}
+#endif
+
+	const struct ipt_entry *e4 = e;
+
+	return has_rule_tag(e4, sizeof(*e4), e4->target_offset, fingerprint);
+}
+
 static bool
-has_rule_tag(const void *base, unsigned int start, unsigned int end)
+has_rule_comment(const void *base, unsigned int start, unsigned int end,
+                 const char *comment)
 {
 	unsigned int i;
 	const struct xt_entry_match *em;
@@ -350,71 +425,431 @@ has_rule_tag(const void *base, unsigned int start, unsigned int end)
 		if (strcmp(em->u.user.name, "comment"))
 			continue;
 
-		if (!memcmp(em->data, "!fw3", 4))
+		if (strstr((const char *)em->data, comment))
 			return true;
 	}
 
 	return false;
 }
 
+static bool
+rule_matches(struct fw3_ipt_handle *h, const void *e,
+             const char *target, const char *comment)
+{
+	const char *t;
+
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+	{
+		const struct ip6t_entry *e6 = e;
+
+		if (target)
+		{
+			t = ip6tc_get_target(e6, h->handle);
+
+			if (*t && !strcmp(t, target))
+				return true;
+		}
+
+		return (comment &&
+		        has_rule_comment(e6, sizeof(*e6), e6->target_offset, comment));
+	}
+	else
+#endif
+	{
+		const struct ipt_entry *e4 = e;
+
+		if (target)
+		{
+			t = iptc_get_target(e4, h->handle);
+
+			if (*t && !strcmp(t, target))
+				return true;
+		}
+
+		return (comment &&
+		        has_rule_comment(e4, sizeof(*e4), e4->target_offset, comment));
+	}
+}
+
+static const void *
+first_rule(struct fw3_ipt_handle *h, const char *chain)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_first_rule(chain, h->handle);
+#endif
+
+	return iptc_first_rule(chain, h->handle);
+}
+
+static const void *
+next_rule(struct fw3_ipt_handle *h, const void *e)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_next_rule(e, h->handle);
+#endif
+
+	return iptc_next_rule(e, h->handle);
+}
+
 void
 fw3_ipt_delete_id_rules(struct fw3_ipt_handle *h, const char *chain)
 {
 	unsigned int num;
-	const struct ipt_entry *e;
+	const void *e;
 	bool found;
 
+	if (!fw3_ipt_is_chain(h, chain))
+		return;
+
+	do {
+		found = false;
+
+		for (num = 0, e = first_rule(h, chain); e; num++, e = next_rule(h, e))
+		{
+			if (!entry_tag(h, e, NULL))
+				continue;
+
+			if (fw3_pr_debug)
+				debug(h, "-D %s %u\n", chain, num + 1);
+
+#ifndef DISABLE_IPV6
+			if (h->family == FW3_FAMILY_V6)
+				ip6tc_delete_num_entry(chain, num, h->handle);
+			else
+#endif
+				iptc_delete_num_entry(chain, num, h->handle);
+
+			found = true;
+			break;
+		}
+	} while (found);
+}
+
+static const char *
+first_chain(struct fw3_ipt_handle *h)
+{
 #ifndef DISABLE_IPV6
 	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_first_chain(h->handle);
+#endif
+
+	return iptc_first_chain(h->handle);
+}
+
+static const char *
+next_chain(struct fw3_ipt_handle *h)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_next_chain(h->handle);
+#endif
+
+	return iptc_next_chain(h->handle);
+}
+
+/*
+ * Calls cb for every rule tagged by fw3 in any chain of the table. The
+ * comment passed on is the text following the tag, empty if the rule had
+ * none, along with the position and the counters of the rule.
+ */
+void
+fw3_ipt_foreach_tagged(struct fw3_ipt_handle *h, fw3_ipt_tagged_cb cb,
+                       void *priv)
+{
+	struct fw3_ipt_tagged t;
+	const char *chain, *tag;
+	const void *e;
+
+	for (chain = first_chain(h); chain; chain = next_chain(h))
 	{
-		if (!ip6tc_is_chain(chain, h->handle))
-			return;
+		t.chain = chain;
 
-		do {
-			found = false;
+		for (t.pos = 1, e = first_rule(h, chain); e; t.pos++, e = next_rule(h, e))
+		{
+			if (!(tag = entry_tag(h, e, &t.fingerprint)))
+				continue;
 
-			const struct ip6t_entry *e6;
-			for (num = 0, e6 = ip6tc_first_rule(chain, h->handle);
-				 e6 != NULL;
-				 num++, e6 = ip6tc_next_rule(e6, h->handle))
-			{
-				if (has_rule_tag(e6, sizeof(*e6), e6->target_offset))
-				{
-					if (fw3_pr_debug)
-						debug(h, "-D %s %u\n", chain, num + 1);
+			if ((t.comment = strstr(tag, ": ")) != NULL)
+				t.comment += 2;
+			else
+				t.comment = "";
 
-					ip6tc_delete_num_entry(chain, num, h->handle);
-					found = true;
-					break;
-				}
+#ifndef DISABLE_IPV6
+			if (h->family == FW3_FAMILY_V6)
+			{
+				t.packets = ((const struct ip6t_entry *)e)->counters.pcnt;
+				t.bytes = ((const struct ip6t_entry *)e)->counters.bcnt;
 			}
-		} while (found);
+			else
+#endif
+			{
+				t.packets = ((const struct ipt_entry *)e)->counters.pcnt;
+				t.bytes = ((const struct ipt_entry *)e)->counters.bcnt;
+			}
+
+			cb(h, &t, priv);
+		}
 	}
+}
+
+static size_t
+entry_size(struct fw3_ipt_handle *h, const void *e)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ((const struct ip6t_entry *)e)->next_offset;
+#endif
+
+	return ((const struct ipt_entry *)e)->next_offset;
+}
+
+static const char *
+entry_target(struct fw3_ipt_handle *h, const void *e)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_get_target(e, h->handle);
+#endif
+
+	return iptc_get_target(e, h->handle);
+}
+
+/*
+ * The entries cached by libiptc carry an empty target name for standard
+ * verdicts and jumps to user chains, which libiptc would insert as a fall
+ * through. Put back the name libiptc resolved for the original entry.
+ */
+static void
+restore_target_name(struct fw3_ipt_handle *h, void *copy, const char *name)
+{
+	struct xt_entry_target *t;
+
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		t = (void *)((char *)copy + ((struct ip6t_entry *)copy)->target_offset);
 	else
 #endif
+		t = (void *)((char *)copy + ((struct ipt_entry *)copy)->target_offset);
+
+	if (!t->u.user.name[0])
+		snprintf(t->u.user.name, sizeof(t->u.user.name), "%s", name);
+}
+
+/*
+ * Rearrange the n rules starting at the 1-based position first so that they
+ * carry the given fingerprints in the given order. The rules keep their
+ * counters. Fails without touching the chain unless exactly these rules are
+ * found at these positions. Also fails if the rearranged rules do not read
+ * back with the same targets, the caller must then discard the handle.
+ */
+bool
+fw3_ipt_reorder_rules(struct fw3_ipt_handle *h, const char *chain,
+                      unsigned int first, const uint32_t *order,
+                      unsigned int n)
+{
+	const void *e, **entries = NULL;
+	void **copies = NULL;
+	char (*targets)[XT_EXTENSION_MAXNAMELEN] = NULL;
+	bool *used = NULL, rv = false;
+	unsigned int i, j, num;
+	uint32_t fp;
+	int ok;
+
+	if (!first || !n || !fw3_ipt_is_chain(h, chain))
+		return false;
+
+	entries = calloc(n, sizeof(*entries));
+	copies = calloc(n, sizeof(*copies));
+	targets = calloc(n, sizeof(*targets));
+	used = calloc(n, sizeof(*used));
+
+	if (!entries || !copies || !targets || !used)
+		goto out;
+
+	for (num = 1, e = first_rule(h, chain); e && num < first + n;
+	     num++, e = next_rule(h, e))
+		if (num >= first)
+			entries[num - first] = e;
+
+	if (num < first + n)
+		goto out;
+
+	for (i = 0; i < n; i++)
 	{
-		if (!iptc_is_chain(chain, h->handle))
-			return;
+		for (j = 0; j < n; j++)
+			if (!used[j] && entry_tag(h, entries[j], &fp) && fp == order[i])
+				break;
 
-		do {
-			found = false;
+		if (j == n)
+			goto out;
 
-			for (num = 0, e = iptc_first_rule(chain, h->handle);
-				 e != NULL;
-				 num++, e = iptc_next_rule(e, h->handle))
-			{
-				if (has_rule_tag(e, sizeof(*e), e->target_offset))
-				{
-					if (fw3_pr_debug)
-						debug(h, "-D %s %u\n", chain, num + 1);
+		used[j] = true;
 
-					iptc_delete_num_entry(chain, num, h->handle);
-					found = true;
-					break;
-				}
-			}
-		} while (found);
+		if (!(copies[i] = malloc(entry_size(h, entries[j]))))
+			goto out;
+
+		memcpy(copies[i], entries[j], entry_size(h, entries[j]));
+		snprintf(targets[i], sizeof(targets[i]), "%s",
+		         entry_target(h, entries[j]));
+		restore_target_name(h, copies[i], targets[i]);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (fw3_pr_debug)
+			debug(h, "-D %s %u\n", chain, first);
+
+#ifndef DISABLE_IPV6
+		if (h->family == FW3_FAMILY_V6)
+			ok = ip6tc_delete_num_entry(chain, first - 1, h->handle);
+		else
+#endif
+			ok = iptc_delete_num_entry(chain, first - 1, h->handle);
+
+		if (!ok)
+			goto out;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+#ifndef DISABLE_IPV6
+		if (h->family == FW3_FAMILY_V6)
+			ok = ip6tc_insert_entry(chain, copies[i], first - 1 + i, h->handle);
+		else
+#endif
+			ok = iptc_insert_entry(chain, copies[i], first - 1 + i, h->handle);
+
+		if (!ok)
+			goto out;
+	}
+
+	for (num = 1, i = 0, e = first_rule(h, chain); e && i < n;
+	     num++, e = next_rule(h, e))
+	{
+		if (num < first)
+			continue;
+
+		if (!entry_tag(h, e, &fp) || fp != order[i] ||
+		    strcmp(entry_target(h, e), targets[i]))
+			break;
+
+		i++;
+	}
+
+	rv = (i == n);
+
+out:
+	if (copies)
+		for (i = 0; i < n; i++)
+			free(copies[i]);
+
+	free(entries);
+	free(copies);
+	free(targets);
+	free(used);
+
+	return rv;
+}
+
+/*
+ * Find the rules in the given chain jumping to the given target or carrying
+ * the given string in their comment. Returns the 1-based position of the
+ * first (or last) such rule like "iptables -I" expects it, 0 if none.
+ */
+unsigned int
+fw3_ipt_find_rule(struct fw3_ipt_handle *h, const char *chain,
+                  const char *target, const char *comment, bool last)
+{
+	unsigned int num, pos = 0;
+	const void *e;
+
+	if (!fw3_ipt_is_chain(h, chain))
+		return 0;
+
+	for (num = 1, e = first_rule(h, chain); e; num++, e = next_rule(h, e))
+	{
+		if (!rule_matches(h, e, target, comment))
+			continue;
+
+		pos = num;
+
+		if (!last)
+			break;
 	}
+
+	return pos;
+}
+
+/* like fw3_ipt_find_rule() but deletes all matches, returns the position
+ * of the first deleted rule */
+unsigned int
+fw3_ipt_delete_rules(struct fw3_ipt_handle *h, const char *chain,
+                     const char *target, const char *comment)
+{
+	unsigned int num, first = 0;
+
+	while ((num = fw3_ipt_find_rule(h, chain, target, comment, false)) > 0)
+	{
+		if (fw3_pr_debug)
+			debug(h, "-D %s %u\n", chain, num);
+
+#ifndef DISABLE_IPV6
+		if (h->family == FW3_FAMILY_V6)
+			ip6tc_delete_num_entry(chain, num - 1, h->handle);
+		else
+#endif
+			iptc_delete_num_entry(chain, num - 1, h->handle);
+
+		if (!first || num < first)
+			first = num;
+	}
+
+	return first;
+}
+
+/*
+ * Let subsequently appended rules of the given chain be inserted starting
+ * at the given position instead, used to regenerate rules in place.
+ */
+void
+fw3_ipt_set_anchor(struct fw3_ipt_handle *h, const char *chain,
+                   unsigned int pos)
+{
+	int i;
+
+	for (i = 0; i < h->n_anchors; i++)
+		if (!strcmp(h->anchors[i].chain, chain))
+			break;
+
+	if (i >= FW3_IPT_MAX_ANCHORS)
+		return;
+
+	snprintf(h->anchors[i].chain, sizeof(h->anchors[i].chain), "%s", chain);
+	h->anchors[i].pos = pos;
+
+	if (i == h->n_anchors)
+		h->n_anchors++;
+}
+
+void
+fw3_ipt_clear_anchors(struct fw3_ipt_handle *h)
+{
+	h->n_anchors = 0;
+}
+
+static unsigned int
+next_anchor(struct fw3_ipt_handle *h, const char *chain)
+{
+	int i;
+
+	for (i = 0; i < h->n_anchors; i++)
+		if (!strcmp(h->anchors[i].chain, chain))
+			return h->anchors[i].pos ? h->anchors[i].pos++ : 0;
+
+	return 0;
 }
 
 void
@@ -590,6 +1025,23 @@ is_chain(struct fw3_ipt_handle *h, const char *name)
 		return iptc_is_chain(name, h->handle);
 }
 
+bool
+fw3_ipt_is_chain(struct fw3_ipt_handle *h, const char *chain)
+{
+	return is_chain(h, chain);
+}
+
+bool
+fw3_ipt_is_builtin(struct fw3_ipt_handle *h, const char *chain)
+{
+#ifndef DISABLE_IPV6
+	if (h->family == FW3_FAMILY_V6)
+		return ip6tc_builtin(chain, h->handle);
+	else
+#endif
+		return iptc_builtin(chain, h->handle);
+}
+
 static char *
 get_protoname(struct fw3_ipt_rule *r)
 {
@@ -1535,26 +1987,55 @@ rule_build(struct fw3_ipt_rule *r)
 	}
 }
 
+/* FNV-1a over the chain and the arguments, before the rule got tagged */
+uint32_t
+fw3_ipt_rule_fingerprint(struct fw3_ipt_rule *r, const char *chain)
+{
+	uint32_t h = 2166136261u;
+	const char *p;
+	int i;
+
+	for (p = chain; *p; p++)
+		h = (h ^ (unsigned char)*p) * 16777619u;
+
+	for (i = 1; i < r->argc; i++)
+	{
+		/* keep the boundaries of the arguments apart */
+		h *= 16777619u;
+
+		for (p = r->argv[i]; *p; p++)
+			h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+
+	/* zero is read back from rules without a fingerprint */
+	return h ? h : 1;
+}
+
 static void
-set_rule_tag(struct fw3_ipt_rule *r)
+set_rule_tag(struct fw3_ipt_rule *r, const char *chain)
 {
 	int i;
-	char *p, **tmp;
-	const char *tag = "!fw3";
+	char tag[256], **tmp;
+	uint32_t fp = fw3_ipt_rule_fingerprint(r, chain);
 
+	/* the comment match takes at most 255 characters, cut the text */
 	for (i = 0; i < r->argc; i++)
+	{
 		if (!strcmp(r->argv[i], "--comment") && (i + 1) < r->argc)
-			if (asprintf(&p, "%s: %s", tag, r->argv[i + 1]) > 0)
-			{
-				free(r->argv[i + 1]);
-				r->argv[i + 1] = p;
-				return;
-			}
+		{
+			snprintf(tag, sizeof(tag), "!fw3#%08x: %s", fp, r->argv[i + 1]);
+			free(r->argv[i + 1]);
+			r->argv[i + 1] = fw3_strdup(tag);
+			return;
+		}
+	}
 
 	tmp = realloc(r->argv, (r->argc + 4) * sizeof(*r->argv));
 
 	if (tmp)
 	{
+		snprintf(tag, sizeof(tag), "!fw3#%08x", fp);
+
 		r->argv = tmp;
 		r->argv[r->argc++] = fw3_strdup("-m");
 		r->argv[r->argc++] = fw3_strdup("comment");
@@ -1563,8 +2044,9 @@ set_rule_tag(struct fw3_ipt_rule *r)
 	}
 }
 
-void
-__fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
+static void
+rule_apply(struct fw3_ipt_rule *r, const char *chain, bool repl, bool tag,
+           unsigned int pos)
 {
 	void *rule;
 	unsigned char *mask;
@@ -1581,12 +2063,6 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 
 	int i, optc;
 	bool inv = false;
-	char buf[32];
-	va_list ap;
-
-	va_start(ap, fmt);
-	vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
-	va_end(ap);
 
 	g = (r->h->family == FW3_FAMILY_V6) ? &xtg6 : &xtg;
 	g->opts = g->orig_opts;
@@ -1602,7 +2078,8 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 		goto free;
 	}
 
-	set_rule_tag(r);
+	if (tag)
+		set_rule_tag(r, chain);
 
 	while ((optc = getopt_long(r->argc, r->argv, "-:m:j:i:o:s:d:", g->opts,
 	                           NULL)) != -1)
@@ -1674,6 +2151,11 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 		default:
 			if (parse_option(r, optc, inv))
 				continue;
+
+			/* never insert the rule without an option it was given */
+			if (optc == ':' || optc == '?')
+				goto free;
+
 			break;
 		}
 
@@ -1695,18 +2177,29 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 		{
 			mask = rule_mask(r);
 
-			while (ip6tc_delete_entry(buf, rule, mask, r->h->handle))
+			while (ip6tc_delete_entry(chain, rule, mask, r->h->handle))
 				if (fw3_pr_debug)
-					rule_print(r, "-D", buf);
+					rule_print(r, "-D", chain);
 
 			free(mask);
 		}
 
-		if (fw3_pr_debug)
-			rule_print(r, "-A", buf);
+		if (pos)
+		{
+			if (fw3_pr_debug)
+				rule_print(r, "-I", chain);
 
-		if (!ip6tc_append_entry(buf, rule, r->h->handle))
-			warn("ip6tc_append_entry(): %s", ip6tc_strerror(errno));
+			if (!ip6tc_insert_entry(chain, rule, pos - 1, r->h->handle))
+				warn("ip6tc_insert_entry(): %s", ip6tc_strerror(errno));
+		}
+		else
+		{
+			if (fw3_pr_debug)
+				rule_print(r, "-A", chain);
+
+			if (!ip6tc_append_entry(chain, rule, r->h->handle))
+				warn("ip6tc_append_entry(): %s", ip6tc_strerror(errno));
+		}
 	}
 	else
 #endif
@@ -1715,18 +2208,29 @@ __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
 		{
 			mask = rule_mask(r);
 
-			while (iptc_delete_entry(buf, rule, mask, r->h->handle))
+			while (iptc_delete_entry(chain, rule, mask, r->h->handle))
 				if (fw3_pr_debug)
-					rule_print(r, "-D", buf);
+					rule_print(r, "-D", chain);
 
 			free(mask);
 		}
 
-		if (fw3_pr_debug)
-			rule_print(r, "-A", buf);
+		if (pos)
+		{
+			if (fw3_pr_debug)
+				rule_print(r, "-I", chain);
+
+			if (!iptc_insert_entry(chain, rule, pos - 1, r->h->handle))
+				warn("iptc_insert_entry(): %s\n", iptc_strerror(errno));
+		}
+		else
+		{
+			if (fw3_pr_debug)
+				rule_print(r, "-A", chain);
 
-		if (!iptc_append_entry(buf, rule, r->h->handle))
-			warn("iptc_append_entry(): %s\n", iptc_strerror(errno));
+			if (!iptc_append_entry(chain, rule, r->h->handle))
+				warn("iptc_append_entry(): %s\n", iptc_strerror(errno));
+		}
 	}
 
 	free(rule);
@@ -1757,6 +2261,31 @@ free:
 	xtables_free_opts(1);
 }
 
+void
+__fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl, const char *fmt, ...)
+{
+	char buf[32];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+
+	rule_apply(r, buf, repl, true, next_anchor(r->h, buf));
+}
+
+/*
+ * Add a rule read from an iptables-restore include. Unlike rules generated
+ * by fw3 itself these are not tagged, so they survive like before when
+ * fw3 clears its own rules from builtin chains.
+ */
+void
+fw3_ipt_rule_restore(struct fw3_ipt_rule *r, const char *chain,
+                     unsigned int pos)
+{
+	rule_apply(r, chain, false, false, pos);
+}
+
 struct fw3_ipt_rule *
 fw3_ipt_rule_create(struct fw3_ipt_handle *handle, struct fw3_protocol *proto,
                     struct fw3_device *in, struct fw3_device *out,
@@ -34,14 +34,37 @@ static inline void init_extensions6(void) { }
 extern int kernel_version;
 void get_kernel_version(void);
 
+#define FW3_IPT_MAX_ANCHORS	4
+
+struct fw3_ipt_anchor {
+	char chain[32];
+	unsigned int pos;
+};
+
 struct fw3_ipt_handle {
 	enum fw3_family family;
 	enum fw3_table table;
 	void *handle;
+
+	int n_anchors;
+	struct fw3_ipt_anchor anchors[FW3_IPT_MAX_ANCHORS];
 };
 
 struct fw3_ipt_rule;
 
+/* a rule tagged by fw3, as passed to fw3_ipt_foreach_tagged() */
+struct fw3_ipt_tagged {
+	const char *chain;
+	unsigned int pos;
+	const char *comment;
+	uint32_t fingerprint;
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+typedef void (*fw3_ipt_tagged_cb)(struct fw3_ipt_handle *h,
+                                  const struct fw3_ipt_tagged *t, void *priv);
+
 struct fw3_ipt_handle *fw3_ipt_open(enum fw3_family family,
                                     enum fw3_table table);
 
@@ -54,6 +77,25 @@ void fw3_ipt_delete_chain(struct fw3_ipt_handle *h, const char *chain);
 
 void fw3_ipt_delete_id_rules(struct fw3_ipt_handle *h, const char *chain);
 
+void fw3_ipt_foreach_tagged(struct fw3_ipt_handle *h, fw3_ipt_tagged_cb cb,
+                            void *priv);
+bool fw3_ipt_reorder_rules(struct fw3_ipt_handle *h, const char *chain,
+                           unsigned int first, const uint32_t *order,
+                           unsigned int n);
+
+unsigned int fw3_ipt_find_rule(struct fw3_ipt_handle *h, const char *chain,
+                               const char *target, const char *comment,
+                               bool last);
+unsigned int fw3_ipt_delete_rules(struct fw3_ipt_handle *h, const char *chain,
+                                  const char *target, const char *comment);
+
+void fw3_ipt_set_anchor(struct fw3_ipt_handle *h, const char *chain,
+                        unsigned int pos);
+void fw3_ipt_clear_anchors(struct fw3_ipt_handle *h);
+
+bool fw3_ipt_is_chain(struct fw3_ipt_handle *h, const char *chain);
+bool fw3_ipt_is_builtin(struct fw3_ipt_handle *h, const char *chain);
+
 void fw3_ipt_create_chain(struct fw3_ipt_handle *h, const char *fmt, ...);
 
 void fw3_ipt_flush(struct fw3_ipt_handle *h);
@@ -102,6 +144,8 @@ void fw3_ipt_rule_extra(struct fw3_ipt_rule *r, const char *extra);
 void fw3_ipt_rule_addarg(struct fw3_ipt_rule *r, bool inv,
                          const char *k, const char *v);
 
+uint32_t fw3_ipt_rule_fingerprint(struct fw3_ipt_rule *r, const char *chain);
+
 struct fw3_ipt_rule * fw3_ipt_rule_create(struct fw3_ipt_handle *handle,
                                           struct fw3_protocol *proto,
                                           struct fw3_device *in,
@@ -112,6 +156,9 @@ struct fw3_ipt_rule * fw3_ipt_rule_create(struct fw3_ipt_handle *handle,
 void __fw3_ipt_rule_append(struct fw3_ipt_rule *r, bool repl,
                            const char *fmt, ...);
 
+void fw3_ipt_rule_restore(struct fw3_ipt_rule *r, const char *chain,
+                          unsigned int pos);
+
 #define fw3_ipt_rule_append(rule, ...) \
 	__fw3_ipt_rule_append(rule, false, __VA_ARGS__)
 
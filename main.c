@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "options.h"
 #include "defaults.h"
@@ -31,6 +32,12 @@
 #include "ubus.h"
 #include "iptables.h"
 #include "helpers.h"
+#include "probe.h"
+#include "daemon.h"
+#include "snapshot.h"
+#include "state.h"
+#include "stats.h"
+#include "advise.h"
 
 
 static enum fw3_family print_family = FW3_FAMILY_ANY;
@@ -38,13 +45,123 @@ static enum fw3_family print_family = FW3_FAMILY_ANY;
 static struct fw3_state *run_state = NULL;
 static struct fw3_state *cfg_state = NULL;
 
+/* identity of the state file matching a resident run_state */
+static struct stat run_stat;
 
+/*
+ * The kinds of objects loaded from the configuration, in the order they are
+ * loaded. A kind may refer to all kinds loaded before it, so requesting one
+ * pulls in those as well. The ubus data is fetched right before the first
+ * kind depending on it.
+ */
+enum fw3_load {
+	FW3_LOAD_DEFAULTS = (1 << 0),
+	FW3_LOAD_UBUS     = (1 << 1),
+	FW3_LOAD_HELPERS  = (1 << 2),
+	FW3_LOAD_IPSETS   = (1 << 3),
+	FW3_LOAD_ZONES    = (1 << 4),
+	FW3_LOAD_RULES    = (1 << 5),
+	FW3_LOAD_INCLUDES = (1 << 6),
+
+	FW3_LOAD_ALL      = (1 << 7) - 1,
+};
+
+
+/*
+ * Loads the requested kinds into a configuration state which lacks them.
+ * The snapshot is only stored if everything got loaded at once, a state
+ * which did not need all of the configuration does not replace it.
+ */
+static void
+load_state(struct fw3_state *state, unsigned int load, bool requested)
+{
+	struct uci_package *p = state->package;
+	struct fw3_slab *prev;
+	unsigned int bit;
+
+	for (bit = FW3_LOAD_INCLUDES; bit; bit >>= 1)
+	{
+		if (load & bit)
+		{
+			load |= bit - 1;
+			break;
+		}
+	}
+
+	load &= ~state->loaded;
+
+	if (!load)
+		return;
+
+	prev = fw3_slab_use(&state->slab);
+
+	if (load & FW3_LOAD_DEFAULTS)
+	{
+		fw3_load_defaults(state, p);
+		fw3_probe_persist(state->defaults.probe_cache);
+	}
+
+	if (load & FW3_LOAD_UBUS)
+	{
+		if (!requested)
+			requested = fw3_ubus_request();
+
+		if (!requested || !fw3_ubus_complete())
+			warn("Failed to connect to ubus");
+
+		if (!fw3_find_command("ipset"))
+		{
+			warn("Unable to locate ipset utility, disabling ipset support");
+			state->disable_ipsets = true;
+		}
+
+		fw3_ubus_rules(&state->ubus_rules);
+	}
+
+	if (load & FW3_LOAD_HELPERS)
+		fw3_load_cthelpers(state, p);
+
+	if (load & FW3_LOAD_IPSETS)
+		fw3_load_ipsets(state, p, state->ubus_rules.head);
+
+	if (load & FW3_LOAD_ZONES)
+		fw3_load_zones(state, p);
+
+	if (load & FW3_LOAD_RULES)
+	{
+		fw3_load_rules(state, p, state->ubus_rules.head);
+		fw3_load_redirects(state, p, state->ubus_rules.head);
+		fw3_load_snats(state, p, state->ubus_rules.head);
+		fw3_load_forwards(state, p, state->ubus_rules.head);
+	}
+
+	if (load & FW3_LOAD_INCLUDES)
+		fw3_load_includes(state, p, state->ubus_rules.head);
+
+	state->loaded |= load;
+
+	if (state->loaded == FW3_LOAD_ALL)
+		fw3_snapshot_finish(state);
+	else
+		fw3_snapshot_abort();
+
+	fw3_slab_use(prev);
+}
+
+/*
+ * Builds the runtime state from the state file, or the configuration state
+ * with the kinds of objects given in load. The configuration state can be
+ * completed later on by passing it to load_state().
+ */
 static bool
-build_state(bool runtime)
+build_state(bool runtime, unsigned int load)
 {
 	struct fw3_state *state = NULL;
 	struct uci_package *p = NULL;
-	FILE *sf;
+	bool requested = false;
+
+	if (runtime && run_state)
+		return true;
 
 	state = calloc(1, sizeof(*state));
 	if (!state)
@@ -55,17 +172,10 @@ build_state(bool runtime)
 	if (!state->uci)
 		error("Out of memory");
 
+	/* the state file holds everything needed to tear the firewall down */
 	if (runtime)
 	{
-		sf = fopen(FW3_STATEFILE, "r");
-
-		if (sf)
-		{
-			uci_import(state->uci, sf, "fw3_state", &p, true);
-			fclose(sf);
-		}
-
-		if (!p)
+		if (!fw3_read_statefile(state))
 		{
 			uci_free_context(state->uci);
 			free(state);
@@ -73,43 +183,45 @@ build_state(bool runtime)
 			return false;
 		}
 
-		state->statefile = true;
-
 		run_state = state;
+		return true;
 	}
-	else
+
+	/* let netifd and procd answer while the config is parsed */
+	if (load & ~FW3_LOAD_DEFAULTS)
+		requested = fw3_ubus_request();
+
+	if (!fw3_snapshot_load(state, &p) &&
+	    uci_load(state->uci, "firewall", &p))
 	{
-		if (!fw3_ubus_connect())
-			warn("Failed to connect to ubus");
+		uci_perror(state->uci, NULL);
+		warn("Failed to load /etc/config/firewall");
 
-		if (uci_load(state->uci, "firewall", &p))
-		{
-			uci_perror(state->uci, NULL);
-			error("Failed to load /etc/config/firewall");
-		}
+		/* a resident daemon must survive this, leave exiting to run() */
+		if (requested)
+			fw3_ubus_disconnect();
 
-		if (!fw3_find_command("ipset"))
-		{
-			warn("Unable to locate ipset utility, disabling ipset support");
-			state->disable_ipsets = true;
-		}
+		fw3_snapshot_free(state);
+		uci_free_context(state->uci);
+		free(state);
 
-		cfg_state = state;
+		return false;
 	}
 
+	/* kinds not loaded yet are walked by free_state() all the same */
+	INIT_LIST_HEAD(&state->zones);
+	INIT_LIST_HEAD(&state->rules);
+	INIT_LIST_HEAD(&state->redirects);
+	INIT_LIST_HEAD(&state->snats);
+	INIT_LIST_HEAD(&state->forwards);
+	INIT_LIST_HEAD(&state->ipsets);
+	INIT_LIST_HEAD(&state->includes);
+	INIT_LIST_HEAD(&state->cthelpers);
 
-	struct blob_buf b = {NULL, NULL, 0, NULL};
-	fw3_ubus_rules(&b);
+	state->package = p;
+	cfg_state = state;
 
-	fw3_load_defaults(state, p);
-	fw3_load_cthelpers(state, p);
-	fw3_load_ipsets(state, p, b.head);
-	fw3_load_zones(state, p);
-	fw3_load_rules(state, p, b.head);
-	fw3_load_redirects(state, p, b.head);
-	fw3_load_snats(state, p, b.head);
-	fw3_load_forwards(state, p, b.head);
-	fw3_load_includes(state, p, b.head);
+	load_state(state, load, requested);
 
 	return true;
 }
@@ -118,32 +230,24 @@ static void
 free_state(struct fw3_state *state)
 {
 	struct list_head *cur, *tmp;
+	struct fw3_include *inc;
 
+	/* objects and their option lists are released along with the slab,
+	 * only zones refreshed at runtime and the records of parsed includes
+	 * hold memory of their own */
 	list_for_each_safe(cur, tmp, &state->zones)
 		fw3_free_zone((struct fw3_zone *)cur);
 
-	list_for_each_safe(cur, tmp, &state->rules)
-		fw3_free_rule((struct fw3_rule *)cur);
-
-	list_for_each_safe(cur, tmp, &state->redirects)
-		fw3_free_redirect((struct fw3_redirect *)cur);
-
-	list_for_each_safe(cur, tmp, &state->snats)
-		fw3_free_snat((struct fw3_snat *)cur);
+	list_for_each_entry(inc, &state->includes, list)
+		fw3_free_include_records(inc);
 
-	list_for_each_safe(cur, tmp, &state->forwards)
-		fw3_free_forward((struct fw3_forward *)cur);
-
-	list_for_each_safe(cur, tmp, &state->ipsets)
-		fw3_free_ipset((struct fw3_ipset *)cur);
+	uci_free_context(state->uci);
 
-	list_for_each_safe(cur, tmp, &state->includes)
-		fw3_free_include((struct fw3_include *)cur);
+	blob_buf_free(&state->ubus_rules);
 
-	list_for_each_safe(cur, tmp, &state->cthelpers)
-		fw3_free_cthelper((struct fw3_cthelper *)cur);
-
-	uci_free_context(state->uci);
+	fw3_snapshot_free(state);
+	fw3_free_statefile(state);
+	fw3_slab_free(&state->slab);
 
 	free(state);
 
@@ -244,9 +348,13 @@ start(void)
 	enum fw3_table table;
 	struct fw3_ipt_handle *handle;
 
+	load_state(cfg_state, FW3_LOAD_ALL, false);
+
 	if (!print_family)
 		fw3_create_ipsets(cfg_state);
 
+	fw3_check_includes(cfg_state, run_state);
+
 	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
 	{
 		if (family == FW3_FAMILY_V6 && cfg_state->defaults.disable_ipv6)
@@ -284,6 +392,7 @@ start(void)
 			fw3_print_forwards(handle, cfg_state);
 			fw3_print_zone_rules(handle, cfg_state, false);
 			fw3_print_default_tail_rules(handle, cfg_state, false);
+			fw3_print_include_rules(handle, cfg_state, false);
 
 			if (!print_family)
 				fw3_ipt_commit(handle);
@@ -328,6 +437,8 @@ reload(void)
 	if (!run_state)
 		return start();
 
+	load_state(cfg_state, FW3_LOAD_ALL, false);
+	fw3_check_includes(cfg_state, run_state);
 	fw3_hotplug_zones(run_state, false);
 
 	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
@@ -379,6 +490,7 @@ start:
 			fw3_print_forwards(handle, cfg_state);
 			fw3_print_zone_rules(handle, cfg_state, true);
 			fw3_print_default_tail_rules(handle, cfg_state, true);
+			fw3_print_include_rules(handle, cfg_state, true);
 
 			fw3_ipt_commit(handle);
 			fw3_ipt_close(handle);
@@ -434,75 +546,285 @@ gc(void)
 	return 0;
 }
 
-static int
-lookup_network(const char *net)
+/*
+ * The lookup commands are run by the hotplug scripts on every interface
+ * event and only need the zones. These are taken from the state file if it
+ * is at least as recent as the configuration, otherwise or if the name is
+ * not found there the zones alone are loaded from the configuration.
+ */
+struct zone_ref {
+	struct zone_ref *next;
+	const char *key;
+	struct fw3_zone *zone;
+};
+
+struct zone_index {
+	unsigned int mask;
+	unsigned int n;
+	struct zone_ref **buckets;
+	struct zone_ref *refs;
+};
+
+static struct zone_index zone_names, zone_networks, zone_devices;
+
+static unsigned int
+zone_hash(const char *key)
 {
-	struct fw3_zone *z;
-	struct fw3_device *d;
+	unsigned int h = 2166136261u;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)key; *p; p++)
+		h = (h ^ *p) * 16777619u;
+
+	return h;
+}
+
+static bool
+zone_index_init(struct zone_index *idx, unsigned int n)
+{
+	unsigned int size = 16;
+
+	while (size < n * 2)
+		size <<= 1;
+
+	idx->n = 0;
+	idx->mask = size - 1;
+	idx->buckets = calloc(size, sizeof(*idx->buckets));
+	idx->refs = calloc(n ? n : 1, sizeof(*idx->refs));
+
+	return (idx->buckets && idx->refs);
+}
+
+static struct fw3_zone *
+zone_index_get(struct zone_index *idx, const char *key)
+{
+	struct zone_ref *ref;
+
+	for (ref = idx->buckets[zone_hash(key) & idx->mask]; ref; ref = ref->next)
+		if (!strcmp(ref->key, key))
+			return ref->zone;
+
+	return NULL;
+}
 
-	list_for_each_entry(z, &cfg_state->zones, list)
+/* the first zone listing a name wins, as with the former list walks */
+static void
+zone_index_add(struct zone_index *idx, const char *key, struct fw3_zone *zone)
+{
+	struct zone_ref *ref;
+	unsigned int h;
+
+	if (zone_index_get(idx, key))
+		return;
+
+	h = zone_hash(key) & idx->mask;
+	ref = &idx->refs[idx->n++];
+	ref->key = key;
+	ref->zone = zone;
+	ref->next = idx->buckets[h];
+	idx->buckets[h] = ref;
+}
+
+static void
+zone_index_free(struct zone_index *idx)
+{
+	free(idx->buckets);
+	free(idx->refs);
+	memset(idx, 0, sizeof(*idx));
+}
+
+static bool
+statefile_current(void)
+{
+	struct stat s, c;
+	const char **path;
+	const char *paths[] = { FW3_CONFIG, FW3_CONFIGDELTA, NULL };
+
+	if (stat(FW3_STATEFILE, &s))
+		return false;
+
+	for (path = paths; *path; path++)
 	{
-		list_for_each_entry(d, &z->networks, list)
-		{
-			if (!strcmp(d->name, net))
-			{
-				printf("%s\n", z->name);
-				return 0;
-			}
-		}
+		if (stat(*path, &c))
+			continue;
+
+		if (c.st_mtim.tv_sec > s.st_mtim.tv_sec ||
+		    (c.st_mtim.tv_sec == s.st_mtim.tv_sec &&
+		     c.st_mtim.tv_nsec > s.st_mtim.tv_nsec))
+			return false;
 	}
 
-	return 1;
+	return true;
 }
 
-static int
-lookup_device(const char *dev)
+static struct fw3_state *
+build_zone_state(bool statefile)
 {
+	struct fw3_state *state;
+	struct uci_package *p = NULL;
 	struct fw3_zone *z;
 	struct fw3_device *d;
+	unsigned int n_zones = 0, n_nets = 0, n_devs = 0;
+
+	if (statefile && !statefile_current())
+		return NULL;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		error("Out of memory");
+
+	state->uci = uci_alloc_context();
+
+	if (!state->uci)
+		error("Out of memory");
 
-	list_for_each_entry(z, &cfg_state->zones, list)
+	if (statefile)
 	{
-		list_for_each_entry(d, &z->devices, list)
+		if (!fw3_read_statefile(state))
 		{
-			if (!strcmp(d->name, dev))
-			{
-				printf("%s\n", z->name);
-				return 0;
-			}
+			free_state(state);
+			return NULL;
 		}
 	}
+	else
+	{
+		INIT_LIST_HEAD(&state->rules);
+		INIT_LIST_HEAD(&state->redirects);
+		INIT_LIST_HEAD(&state->snats);
+		INIT_LIST_HEAD(&state->forwards);
+		INIT_LIST_HEAD(&state->ipsets);
+		INIT_LIST_HEAD(&state->includes);
 
-	return 1;
+		if (!fw3_ubus_connect())
+			warn("Failed to connect to ubus");
+
+		if (uci_load(state->uci, "firewall", &p))
+		{
+			uci_perror(state->uci, NULL);
+			INIT_LIST_HEAD(&state->zones);
+			INIT_LIST_HEAD(&state->cthelpers);
+			free_state(state);
+			return NULL;
+		}
+
+		fw3_slab_use(&state->slab);
+		fw3_load_defaults(state, p);
+		fw3_load_cthelpers(state, p);
+		fw3_load_zones(state, p);
+		fw3_slab_use(NULL);
+	}
+
+	list_for_each_entry(z, &state->zones, list)
+	{
+		n_zones++;
+
+		list_for_each_entry(d, statefile ? &z->old_networks : &z->networks, list)
+			n_nets++;
+
+		list_for_each_entry(d, &z->devices, list)
+			n_devs++;
+	}
+
+	if (!zone_index_init(&zone_names, n_zones) ||
+	    !zone_index_init(&zone_networks, n_nets) ||
+	    !zone_index_init(&zone_devices, n_devs))
+		error("Out of memory");
+
+	list_for_each_entry(z, &state->zones, list)
+	{
+		zone_index_add(&zone_names, z->name, z);
+
+		list_for_each_entry(d, statefile ? &z->old_networks : &z->networks, list)
+			zone_index_add(&zone_networks, d->name, z);
+
+		list_for_each_entry(d, &z->devices, list)
+			zone_index_add(&zone_devices, d->name, z);
+	}
+
+	return state;
+}
+
+static void
+free_zone_state(struct fw3_state *state)
+{
+	zone_index_free(&zone_names);
+	zone_index_free(&zone_networks);
+	zone_index_free(&zone_devices);
+
+	free_state(state);
+}
+
+static int
+lookup_network(const char *net)
+{
+	struct fw3_zone *z = zone_index_get(&zone_networks, net);
+
+	if (!z)
+		return 1;
+
+	printf("%s\n", z->name);
+	return 0;
+}
+
+static int
+lookup_device(const char *dev)
+{
+	struct fw3_zone *z = zone_index_get(&zone_devices, dev);
+
+	if (!z)
+		return 1;
+
+	printf("%s\n", z->name);
+	return 0;
 }
 
 static int
 lookup_zone(const char *zone, const char *device)
 {
-	struct fw3_zone *z;
+	struct fw3_zone *z = zone_index_get(&zone_names, zone);
 	struct fw3_device *d;
 
-	list_for_each_entry(z, &cfg_state->zones, list)
+	if (!z)
+		return 1;
+
+	list_for_each_entry(d, &z->devices, list)
 	{
-		if (strcmp(z->name, zone))
+		if (device && strcmp(device, d->name))
 			continue;
 
-		list_for_each_entry(d, &z->devices, list)
-		{
-			if (device && strcmp(device, d->name))
-				continue;
+		printf("%s\n", d->name);
 
-			printf("%s\n", d->name);
+		if (device)
+			return 0;
+	}
 
-			if (device)
-				return 0;
-		}
+	return device ? 1 : 0;
+}
 
-		if (!device)
-			return 0;
+static int
+lookup(const char *cmd, const char *arg, const char *device)
+{
+	struct fw3_state *state;
+	int pass, rv = 1;
+
+	for (pass = 0; pass < 2 && rv; pass++)
+	{
+		state = build_zone_state(pass == 0);
+
+		if (!state)
+			continue;
+
+		if (!strcmp(cmd, "network"))
+			rv = lookup_network(arg);
+		else if (!strcmp(cmd, "device"))
+			rv = lookup_device(arg);
+		else
+			rv = lookup_zone(arg, device);
+
+		free_zone_state(state);
 	}
 
-	return 1;
+	return rv;
 }
 
 static int
@@ -513,14 +835,21 @@ usage(void)
 	fprintf(stderr, "fw3 [-q] network {net}\n");
 	fprintf(stderr, "fw3 [-q] device {dev}\n");
 	fprintf(stderr, "fw3 [-q] zone {zone} [dev]\n");
+	fprintf(stderr, "fw3 state\n");
+	fprintf(stderr, "fw3 stats [json|prometheus]\n");
+	fprintf(stderr, "fw3 advise [interval] [apply]\n");
+	fprintf(stderr, "fw3 daemon\n");
 
 	return 1;
 }
 
 
-int main(int argc, char **argv)
+static int
+run(int argc, char **argv)
 {
-	int ch, rv = 1;
+	int i, ch, rv = 1;
+	unsigned int interval = 0, load;
+	bool apply = false;
 	enum fw3_family family = FW3_FAMILY_ANY;
 	struct fw3_defaults *defs = NULL;
 
@@ -545,20 +874,39 @@ int main(int argc, char **argv)
 			break;
 
 		case 'h':
-			rv = usage();
-			goto out;
+			return usage();
 		}
 	}
 
-	build_state(false);
-	defs = &cfg_state->defaults;
-
 	if (optind >= argc)
+		return usage();
+
+	if ((!strcmp(argv[optind], "network") ||
+	     !strcmp(argv[optind], "device") ||
+	     !strcmp(argv[optind], "zone")) && (optind + 1) < argc)
 	{
-		rv = usage();
-		goto out;
+		return lookup(argv[optind], argv[optind + 1], argv[optind + 2]);
 	}
 
+	if (!strcmp(argv[optind], "state"))
+		return fw3_dump_statefile();
+
+	if (!strcmp(argv[optind], "stats"))
+		return fw3_stats(argv[optind + 1]) ? usage() : 0;
+
+	/* tearing down and garbage collection only consult the defaults */
+	if (!strcmp(argv[optind], "stop") ||
+	    !strcmp(argv[optind], "flush") ||
+	    !strcmp(argv[optind], "gc"))
+		load = FW3_LOAD_DEFAULTS;
+	else
+		load = FW3_LOAD_ALL;
+
+	if (!build_state(false, load))
+		return 1;
+
+	defs = &cfg_state->defaults;
+
 	if (!strcmp(argv[optind], "print"))
 	{
 		if (family == FW3_FAMILY_ANY)
@@ -583,7 +931,7 @@ int main(int argc, char **argv)
 
 		if (fw3_lock())
 		{
-			build_state(true);
+			build_state(true, 0);
 			rv = start();
 			fw3_unlock();
 		}
@@ -592,7 +940,7 @@ int main(int argc, char **argv)
 	{
 		if (fw3_lock())
 		{
-			build_state(true);
+			build_state(true, 0);
 			rv = start();
 			fw3_unlock();
 		}
@@ -601,7 +949,7 @@ int main(int argc, char **argv)
 	{
 		if (fw3_lock())
 		{
-			build_state(true);
+			build_state(true, 0);
 			rv = stop(false);
 			fw3_unlock();
 		}
@@ -610,7 +958,7 @@ int main(int argc, char **argv)
 	{
 		if (fw3_lock())
 		{
-			build_state(true);
+			build_state(true, 0);
 			rv = stop(true);
 			fw3_unlock();
 		}
@@ -619,7 +967,7 @@ int main(int argc, char **argv)
 	{
 		if (fw3_lock())
 		{
-			build_state(true);
+			build_state(true, 0);
 			stop(true);
 			rv = start();
 			fw3_unlock();
@@ -629,7 +977,7 @@ int main(int argc, char **argv)
 	{
 		if (fw3_lock())
 		{
-			build_state(true);
+			build_state(true, 0);
 			rv = reload();
 			fw3_unlock();
 		}
@@ -642,29 +990,348 @@ int main(int argc, char **argv)
 			fw3_unlock();
 		}
 	}
-	else if (!strcmp(argv[optind], "network") && (optind + 1) < argc)
+	else if (!strcmp(argv[optind], "advise"))
 	{
-		rv = lookup_network(argv[optind + 1]);
+		for (i = optind + 1; i < argc; i++)
+		{
+			if (!strcmp(argv[i], "apply"))
+				apply = true;
+			else if (!(interval = strtoul(argv[i], NULL, 10)))
+				return usage();
+		}
+
+		rv = fw3_advise(cfg_state, interval, apply);
 	}
-	else if (!strcmp(argv[optind], "device") && (optind + 1) < argc)
+	else
 	{
-		rv = lookup_device(argv[optind + 1]);
+		rv = usage();
 	}
-	else if (!strcmp(argv[optind], "zone") && (optind + 1) < argc)
+
+	return rv;
+}
+
+static bool
+run_state_current(void)
+{
+	struct stat s;
+
+	if (stat(FW3_STATEFILE, &s))
+		return false;
+
+	return (s.st_ino == run_stat.st_ino &&
+	        s.st_size == run_stat.st_size &&
+	        s.st_mtim.tv_sec == run_stat.st_mtim.tv_sec &&
+	        s.st_mtim.tv_nsec == run_stat.st_mtim.tv_nsec);
+}
+
+/*
+ * Record the include fingerprints of an applied configuration state the way
+ * the state file reader does, so that the next reload can tell unchanged
+ * includes apart when this state becomes the runtime state.
+ */
+static void
+adopt_includes(struct fw3_state *state)
+{
+	struct fw3_include *include;
+
+	list_for_each_entry(include, &state->includes, list)
 	{
-		rv = lookup_zone(argv[optind + 1], argv[optind + 2]);
+		if (!include->hash[0])
+			continue;
+
+		include->old_hash = include->hash;
+		include->old_mtime = include->mtime;
+		include->old_size = include->size;
 	}
-	else
+}
+
+/*
+ * Runs one command inside the daemon. The runtime state stays resident
+ * between commands and is replaced by the configuration state after it got
+ * applied, so only the configuration is parsed per command. Probe results
+ * are kept until the set of loaded kernel modules changes. The state file
+ * is still written for the benefit of other tools, and a resident state is
+ * dropped if somebody else rewrote the file in the meanwhile.
+ */
+static int
+daemon_command(int argc, char **argv)
+{
+	int rv;
+	const char *cmd;
+
+	print_family = FW3_FAMILY_ANY;
+	fw3_pr_debug = false;
+	fw3_probe_refresh();
+	optind = 0;
+
+	if (run_state && !run_state_current())
 	{
-		rv = usage();
+		free_state(run_state);
+		run_state = NULL;
+	}
+
+	rv = run(argc, argv);
+	cmd = (optind < argc) ? argv[optind] : "";
+
+	if (!rv && cfg_state && !print_family &&
+	    (!strcmp(cmd, "start") || !strcmp(cmd, "restart") ||
+	     !strcmp(cmd, "reload")))
+	{
+		fw3_snapshot_zone_addrs(cfg_state);
+		adopt_includes(cfg_state);
+
+		if (run_state)
+			free_state(run_state);
+
+		run_state = cfg_state;
+		cfg_state = NULL;
+	}
+
+	if (cfg_state)
+	{
+		free_state(cfg_state);
+		cfg_state = NULL;
+	}
+
+	if (run_state &&
+	    (stat(FW3_STATEFILE, &run_stat) ||
+	     (fw3_no_family(run_state->defaults.flags[0]) &&
+	      fw3_no_family(run_state->defaults.flags[1]))))
+	{
+		free_state(run_state);
+		run_state = NULL;
+	}
+
+	return rv;
+}
+
+static int
+zone_index(struct fw3_zone *zone)
+{
+	int i = 0;
+	struct fw3_zone *z;
+
+	list_for_each_entry(z, &run_state->zones, list)
+	{
+		if (z == zone)
+			return i;
+
+		i++;
+	}
+
+	return -1;
+}
+
+/*
+ * Apply a changed network to the resident runtime state: re-resolve the
+ * zones covering it and regenerate only their interface rules, nat chains
+ * and the reflection rules depending on their addresses. Returns false if
+ * a full reload is needed instead.
+ */
+static bool
+update_network(const char *net)
+{
+	int i, n = 0;
+	bool rv = false, any = false;
+	bool *affected = NULL, *nat = NULL;
+	enum fw3_family family;
+	enum fw3_table table;
+	struct fw3_ipt_handle *handle;
+	struct fw3_redirect *redir;
+	struct fw3_zone *z;
+	struct uci_context *ctx;
+	struct uci_package *p = NULL;
+
+	/* a state read from the state file lacks the rules */
+	if (!run_state || run_state->statefile)
+		return false;
+
+	if (!fw3_ubus_connect())
+		return false;
+
+	list_for_each_entry(z, &run_state->zones, list)
+		n++;
+
+	affected = calloc(n + 1, sizeof(*affected));
+	nat = calloc(n + 1, sizeof(*nat));
+	ctx = uci_alloc_context();
+
+	if (!affected || !nat || !ctx || uci_load(ctx, "firewall", &p))
+		goto out;
+
+	i = 0;
+
+	list_for_each_entry(z, &run_state->zones, list)
+	{
+		switch (fw3_refresh_zone(run_state, p, z, net))
+		{
+		case -1:
+			goto out;
+
+		case 1:
+			affected[i] = nat[i] = any = true;
+			break;
+		}
+
+		i++;
+	}
+
+	rv = true;
+
+	if (!any)
+		goto out;
+
+	info(" * Updating zones of network '%s'", net);
+
+	/* reflection rules live in the chains of the internal zone */
+	list_for_each_entry(redir, &run_state->redirects, list)
+		if (redir->reflection && redir->_src && redir->_dest &&
+		    affected[zone_index(redir->_src)])
+			nat[zone_index(redir->_dest)] = true;
+
+	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6 && rv; family++)
+	{
+		if (!family_running(family))
+			continue;
+
+		for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
+		{
+			if (!fw3_has_table(family == FW3_FAMILY_V6, fw3_flag_names[table]))
+				continue;
+
+			if (!(handle = fw3_ipt_open(family, table)))
+				continue;
+
+			i = 0;
+
+			list_for_each_entry(z, &run_state->zones, list)
+			{
+				if (affected[i++] &&
+				    !fw3_update_zone_rules(handle, run_state, z))
+				{
+					rv = false;
+					break;
+				}
+			}
+
+			if (!rv)
+			{
+				fw3_ipt_close(handle);
+				break;
+			}
+
+			i = 0;
+
+			list_for_each_entry(z, &run_state->zones, list)
+			{
+				if (!nat[i++])
+					continue;
+
+				fw3_reset_zone_nat(handle, z);
+				fw3_print_zone_redirects(handle, run_state, z);
+				fw3_print_zone_snats(handle, run_state, z);
+				fw3_print_zone_masq(handle, z);
+			}
+
+			fw3_ipt_commit(handle);
+			fw3_ipt_close(handle);
+		}
+	}
+
+	if (rv)
+	{
+		fw3_flush_conntrack(run_state);
+		fw3_snapshot_zone_addrs(run_state);
+		fw3_write_statefile(run_state);
 	}
 
 out:
+	if (ctx)
+		uci_free_context(ctx);
+
+	free(affected);
+	free(nat);
+
+	return rv;
+}
+
+static void
+daemon_event(const char *net)
+{
+	bool done = false;
+	char *argv[] = { "fw3", "reload", NULL };
+
+	print_family = FW3_FAMILY_ANY;
+	fw3_pr_debug = false;
+	fw3_probe_refresh();
+
+	if (run_state && !run_state_current())
+	{
+		free_state(run_state);
+		run_state = NULL;
+	}
+
+	/* nothing to update while stopped */
+	if (!run_state)
+		return;
+
+	if (net && fw3_lock())
+	{
+		done = update_network(net);
+		fw3_unlock();
+	}
+
+	if (!done)
+	{
+		info(" * Reloading firewall due to changes of %s",
+		     net ? net : "multiple networks");
+
+		daemon_command(2, argv);
+		return;
+	}
+
+	if (stat(FW3_STATEFILE, &run_stat))
+	{
+		free_state(run_state);
+		run_state = NULL;
+	}
+}
+
+static const char *
+command_name(int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++)
+		if (*argv[i] != '-')
+			return argv[i];
+
+	return "";
+}
+
+
+int main(int argc, char **argv)
+{
+	int rv;
+	const char *cmd = command_name(argc, argv);
+
+	if (!strcmp(cmd, "daemon"))
+		return fw3_daemon_run(daemon_command, daemon_event);
+
+	/* sampling would keep the daemon from serving anything else */
+	if (strcmp(cmd, "advise") &&
+	    (rv = fw3_daemon_forward(argc, argv)) >= 0)
+		return rv;
+
+	rv = run(argc, argv);
+
 	if (cfg_state)
 		free_state(cfg_state);
 
 	if (run_state)
 		free_state(run_state);
 
+	fw3_ubus_close();
+
 	return rv;
 }
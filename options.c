@@ -18,6 +18,7 @@
 
 #include "options.h"
 #include "ubus.h"
+#include "snapshot.h"
 
 
 static bool
@@ -27,7 +28,7 @@ put_value(void *ptr, void *val, int elem_size, bool is_list)
 
 	if (is_list)
 	{
-		copy = malloc(elem_size);
+		copy = fw3_slab_alloc(elem_size);
 
 		if (!copy)
 			return false;
@@ -284,7 +285,7 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 	struct fw3_address addr = { };
 	struct in_addr v4;
 	struct in6_addr v6;
-	char *p = NULL, *m = NULL, *s, *e;
+	char *p = NULL, *m = NULL, *e, s[INET6_ADDRSTRLEN * 2 + 2];
 	int bits = -1;
 
 	if (*val == '!')
@@ -293,11 +294,12 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 		while (isspace(*++val));
 	}
 
-	s = strdup(val);
-
-	if (!s)
+	/* the longest valid value is a range of two IPv6 addresses */
+	if (strlen(val) >= sizeof(s))
 		return false;
 
+	strcpy(s, val);
+
 	if ((m = strchr(s, '/')) != NULL)
 		*m++ = 0;
 	else if ((p = strchr(s, '-')) != NULL)
@@ -315,7 +317,7 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 				bits = strtol(m, &e, 10);
 
 				if ((*e != 0) || !fw3_bitlen2netmask(addr.family, bits, &v6))
-					goto fail;
+					return false;
 			}
 
 			addr.mask.v6 = v6;
@@ -323,7 +325,7 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 		else if (p)
 		{
 			if (!inet_pton(AF_INET6, p, &addr.mask.v6))
-				goto fail;
+				return false;
 
 			addr.range = true;
 		}
@@ -344,7 +346,7 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 				bits = strtol(m, &e, 10);
 
 				if ((*e != 0) || !fw3_bitlen2netmask(addr.family, bits, &v4))
-					goto fail;
+					return false;
 			}
 
 			addr.mask.v4 = v4;
@@ -352,7 +354,7 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 		else if (p)
 		{
 			if (!inet_pton(AF_INET, p, &addr.mask.v4))
-				goto fail;
+				return false;
 
 			addr.range = true;
 		}
@@ -363,17 +365,12 @@ fw3_parse_address(void *ptr, const char *val, bool is_list)
 	}
 	else
 	{
-		goto fail;
+		return false;
 	}
 
-	free(s);
 	addr.set = true;
 	put_value(ptr, &addr, sizeof(addr), is_list);
 	return true;
-
-fail:
-	free(s);
-	return false;
 }
 
 bool
@@ -401,7 +398,9 @@ fw3_parse_network(void *ptr, const char *val, bool is_list)
 		 * to signal resolving failure to callers */
 		if (n_addrs == 0)
 		{
-			tmp = fw3_alloc(sizeof(*tmp));
+			if (!(tmp = fw3_slab_alloc(sizeof(*tmp))))
+				return false;
+
 			tmp->resolved = true;
 
 			list_add_tail(&tmp->list, &addr_list);
@@ -417,7 +416,7 @@ fw3_parse_network(void *ptr, const char *val, bool is_list)
 			       sizeof(*addr));
 
 			list_for_each_entry_safe(addr, tmp, &addr_list, list)
-				free(addr);
+				fw3_slab_release(addr);
 		}
 	}
 
@@ -428,7 +427,7 @@ bool
 fw3_parse_mac(void *ptr, const char *val, bool is_list)
 {
 	struct fw3_mac addr = { };
-	struct ether_addr *mac;
+	struct ether_addr mac;
 
 	if (*val == '!')
 	{
@@ -436,9 +435,9 @@ fw3_parse_mac(void *ptr, const char *val, bool is_list)
 		while (isspace(*++val));
 	}
 
-	if ((mac = ether_aton(val)) != NULL)
+	if (ether_aton_r(val, &mac) != NULL)
 	{
-		addr.mac = *mac;
+		addr.mac = mac;
 		addr.set = true;
 
 		put_value(ptr, &addr, sizeof(addr), is_list);
@@ -582,6 +581,8 @@ fw3_parse_icmptype(void *ptr, const char *val, bool is_list)
 	return true;
 }
 
+static pthread_mutex_t protocol_lock = PTHREAD_MUTEX_INITIALIZER;
+
 bool
 fw3_parse_protocol(void *ptr, const char *val, bool is_list)
 {
@@ -617,15 +618,21 @@ fw3_parse_protocol(void *ptr, const char *val, bool is_list)
 		return true;
 	}
 
+	/* the protocol database is not reentrant, sections may be parsed
+	 * on several threads at once */
+	pthread_mutex_lock(&protocol_lock);
 	ent = getprotobyname(val);
 
 	if (ent)
 	{
 		proto.protocol = ent->p_proto;
+		pthread_mutex_unlock(&protocol_lock);
 		put_value(ptr, &proto, sizeof(proto), is_list);
 		return true;
 	}
 
+	pthread_mutex_unlock(&protocol_lock);
+
 	proto.protocol = strtoul(val, &e, 10);
 
 	if ((e == val) || (*e != 0))
@@ -769,7 +776,7 @@ bool
 fw3_parse_weekdays(void *ptr, const char *val, bool is_list)
 {
 	unsigned int w = 0;
-	char *p, *s;
+	char *p, *s, *sp;
 
 	if (*val == '!')
 	{
@@ -780,7 +787,7 @@ fw3_parse_weekdays(void *ptr, const char *val, bool is_list)
 	if (!(s = strdup(val)))
 		return false;
 
-	for (p = strtok(s, " \t"); p; p = strtok(NULL, " \t"))
+	for (p = strtok_r(s, " \t", &sp); p; p = strtok_r(NULL, " \t", &sp))
 	{
 		if (!parse_enum(&w, p, weekdays, 1, 7))
 		{
@@ -804,7 +811,7 @@ bool
 fw3_parse_monthdays(void *ptr, const char *val, bool is_list)
 {
 	unsigned int d;
-	char *p, *s;
+	char *p, *s, *sp;
 
 	if (*val == '!')
 	{
@@ -815,7 +822,7 @@ fw3_parse_monthdays(void *ptr, const char *val, bool is_list)
 	if (!(s = strdup(val)))
 		return false;
 
-	for (p = strtok(s, " \t"); p; p = strtok(NULL, " \t"))
+	for (p = strtok_r(s, " \t", &sp); p; p = strtok_r(NULL, " \t", &sp))
 	{
 		d = strtoul(p, &p, 10);
 
@@ -850,7 +857,7 @@ bool
 fw3_parse_mark(void *ptr, const char *val, bool is_list)
 {
 	uint32_t n;
-	char *s, *e;
+	char *e;
 	struct fw3_mark *m = ptr;
 
 	if (*val == '!')
@@ -859,22 +866,20 @@ fw3_parse_mark(void *ptr, const char *val, bool is_list)
 		while (isspace(*++val));
 	}
 
-	if ((s = strchr(val, '/')) != NULL)
-		*s++ = 0;
-
 	n = strtoul(val, &e, 0);
 
-	if (e == val || *e)
+	if (e == val || (*e && *e != '/'))
 		return false;
 
 	m->mark = n;
 	m->mask = 0xFFFFFFFF;
 
-	if (s)
+	if (*e == '/')
 	{
-		n = strtoul(s, &e, 0);
+		val = e + 1;
+		n = strtoul(val, &e, 0);
 
-		if (e == s || *e)
+		if (e == val || *e)
 			return false;
 
 		m->mask = n;
@@ -921,7 +926,7 @@ bool
 fw3_parse_setmatch(void *ptr, const char *val, bool is_list)
 {
 	struct fw3_setmatch *m = ptr;
-	char *p, *s;
+	char *p, *s, *sp;
 	int i;
 
 	if (*val == '!')
@@ -933,7 +938,7 @@ fw3_parse_setmatch(void *ptr, const char *val, bool is_list)
 	if (!(s = strdup(val)))
 		return false;
 
-	if (!(p = strtok(s, " \t")))
+	if (!(p = strtok_r(s, " \t", &sp)))
 	{
 		free(s);
 		return false;
@@ -941,9 +946,9 @@ fw3_parse_setmatch(void *ptr, const char *val, bool is_list)
 
 	strncpy(m->name, p, sizeof(m->name) - 1);
 
-	for (i = 0, p = strtok(NULL, " \t,");
+	for (i = 0, p = strtok_r(NULL, " \t,", &sp);
 	     i < 3 && p != NULL;
-	     i++, p = strtok(NULL, " \t,"))
+	     i++, p = strtok_r(NULL, " \t,", &sp))
 	{
 		if (!strncmp(p, "dest", 4) || !strncmp(p, "dst", 3))
 			m->dir[i] = "dst";
@@ -1007,123 +1012,254 @@ fw3_parse_setentry(void *ptr, const char *val, bool is_list)
 }
 
 
+/*
+ * Option names are looked up through a sorted copy of each table, built
+ * the first time the table is used. Where a table names an option twice,
+ * the entry appearing first takes precedence as with a linear scan.
+ */
+struct option_index {
+	const struct fw3_option *opts;
+	const struct fw3_option **sorted;
+	int n;
+};
+
+static struct option_index option_indexes[16];
+static pthread_mutex_t option_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+option_cmp(const void *a, const void *b)
+{
+	const struct fw3_option *oa = *(const struct fw3_option **)a;
+	const struct fw3_option *ob = *(const struct fw3_option **)b;
+	int rv = strcmp(oa->name, ob->name);
+
+	if (rv)
+		return rv;
+
+	return (oa > ob) - (oa < ob);
+}
+
+static int
+option_key_cmp(const void *k, const void *b)
+{
+	return strcmp(k, (*(const struct fw3_option **)b)->name);
+}
+
+/* returns the slot of the given table or the first unused one */
+static struct option_index *
+option_index_find(const struct fw3_option *opts, bool *found)
+{
+	struct option_index *idx;
+	const struct fw3_option *o;
+
+	for (idx = option_indexes; idx < option_indexes + ARRAY_SIZE(option_indexes); idx++)
+	{
+		o = __atomic_load_n(&idx->opts, __ATOMIC_ACQUIRE);
+		*found = (o == opts);
+
+		if (*found || !o)
+			return idx;
+	}
+
+	return NULL;
+}
+
+/*
+ * Indexes are looked up without locking, a slot only becomes visible once
+ * its opts pointer is published after the sorted table was filled in.
+ */
+static struct option_index *
+option_index_get(const struct fw3_option *opts)
+{
+	struct option_index *idx;
+	const struct fw3_option *opt;
+	bool found;
+	int i, n = 0;
+
+	if ((idx = option_index_find(opts, &found)) != NULL && found)
+		return idx;
+
+	pthread_mutex_lock(&option_index_lock);
+
+	if (!(idx = option_index_find(opts, &found)) || found)
+		goto out;
+
+	for (opt = opts; opt->name; opt++)
+		n++;
+
+	if (!(idx->sorted = calloc(n + 1, sizeof(*idx->sorted))))
+	{
+		idx = NULL;
+		goto out;
+	}
+
+	for (opt = opts; opt->name; opt++)
+		if (opt->parse)
+			idx->sorted[idx->n++] = opt;
+
+	qsort(idx->sorted, idx->n, sizeof(*idx->sorted), option_cmp);
+
+	/* drop later duplicates, which a linear scan would never reach */
+	for (i = 1, n = 1; i < idx->n; i++)
+		if (strcmp(idx->sorted[i]->name, idx->sorted[n - 1]->name))
+			idx->sorted[n++] = idx->sorted[i];
+
+	idx->n = idx->n ? n : 0;
+	__atomic_store_n(&idx->opts, opts, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&option_index_lock);
+	return idx;
+}
+
+static const struct fw3_option *
+lookup_option(const struct fw3_option *opts, const char *name)
+{
+	struct option_index *idx = option_index_get(opts);
+	const struct fw3_option *opt, **match;
+
+	if (!idx)
+	{
+		for (opt = opts; opt->name; opt++)
+			if (opt->parse && !strcmp(opt->name, name))
+				return opt;
+
+		return NULL;
+	}
+
+	match = bsearch(name, idx->sorted, idx->n, sizeof(*idx->sorted),
+	                option_key_cmp);
+
+	return match ? *match : NULL;
+}
+
+/* parses a single value, letting the snapshot record its outcome */
+static bool
+parse_value(const struct fw3_option *opts, const struct fw3_option *opt,
+            struct uci_section *section, void *dest, const char *val,
+            bool is_list)
+{
+	struct list_head *tail = is_list ? ((struct list_head *)dest)->prev : NULL;
+
+	if (!opt->parse(dest, val, is_list))
+		return false;
+
+	fw3_snapshot_value(opts, opt, section, dest, tail, val, is_list);
+	return true;
+}
+
 bool
 fw3_parse_options(void *s, const struct fw3_option *opts,
                   struct uci_section *section)
 {
-	char *p, *v;
-	bool known, inv;
+	char *p, *v, *sp;
+	bool inv;
 	struct uci_element *e, *l;
 	struct uci_option *o;
 	const struct fw3_option *opt;
 	struct list_head *dest;
 	bool valid = true;
 
+	if (fw3_snapshot_replay(s, opts, section))
+		return true;
+
 	uci_foreach_element(&section->options, e)
 	{
 		o = uci_to_option(e);
-		known = false;
+		opt = lookup_option(opts, e->name);
 
-		for (opt = opts; opt->name; opt++)
+		if (!opt)
 		{
-			if (!opt->parse)
-				continue;
-
-			if (strcmp(opt->name, e->name))
-				continue;
+			warn_elem(e, "is unknown");
+			fw3_snapshot_taint();
+			continue;
+		}
 
-			if (o->type == UCI_TYPE_LIST)
+		if (o->type == UCI_TYPE_LIST)
+		{
+			if (!opt->elem_size)
 			{
-				if (!opt->elem_size)
-				{
-					warn_elem(e, "must not be a list");
-					valid = false;
-				}
-				else
+				warn_elem(e, "must not be a list");
+				valid = false;
+			}
+			else
+			{
+				dest = (struct list_head *)((char *)s + opt->offset);
+
+				uci_foreach_element(&o->v.list, l)
 				{
-					dest = (struct list_head *)((char *)s + opt->offset);
+					if (!l->name)
+						continue;
 
-					uci_foreach_element(&o->v.list, l)
+					if (!parse_value(opts, opt, section, dest, l->name, true))
 					{
-						if (!l->name)
-							continue;
-
-						if (!opt->parse(dest, l->name, true))
-						{
-							warn_elem(e, "has invalid value '%s'", l->name);
-							valid = false;
-							continue;
-						}
+						warn_elem(e, "has invalid value '%s'", l->name);
+						valid = false;
+						continue;
 					}
 				}
 			}
+		}
+		else if ((v = o->v.string) != NULL)
+		{
+			if (!opt->elem_size)
+			{
+				if (!parse_value(opts, opt, section, (char *)s + opt->offset,
+				                 o->v.string, false))
+				{
+					warn_elem(e, "has invalid value '%s'", o->v.string);
+					valid = false;
+				}
+			}
 			else
 			{
-				v = o->v.string;
-
-				if (!v)
-					continue;
+				inv = false;
+				dest = (struct list_head *)((char *)s + opt->offset);
 
-				if (!opt->elem_size)
+				for (p = strtok_r(v, " \t", &sp); p != NULL;
+				     p = strtok_r(NULL, " \t", &sp))
 				{
-					if (!opt->parse((char *)s + opt->offset, o->v.string, false))
+					/* If we encounter a sole "!" token, assume that it
+					 * is meant to be part of the next token, so silently
+					 * skip it and remember the state... */
+					if (!strcmp(p, "!"))
 					{
-						warn_elem(e, "has invalid value '%s'", o->v.string);
-						valid = false;
+						inv = true;
+						continue;
 					}
-				}
-				else
-				{
-					inv = false;
-					dest = (struct list_head *)((char *)s + opt->offset);
 
-					for (p = strtok(v, " \t"); p != NULL; p = strtok(NULL, " \t"))
+					/* The previous token was a sole "!", rewind pointer
+					 * back by one byte to precede the value with an
+					 * exclamation mark which effectively turns
+					 * ("!", "foo") into ("!foo") */
+					if (inv)
 					{
-						/* If we encounter a sole "!" token, assume that it
-						 * is meant to be part of the next token, so silently
-						 * skip it and remember the state... */
-						if (!strcmp(p, "!"))
-						{
-							inv = true;
-							continue;
-						}
-
-						/* The previous token was a sole "!", rewind pointer
-						 * back by one byte to precede the value with an
-						 * exclamation mark which effectively turns
-						 * ("!", "foo") into ("!foo") */
-						if (inv)
-						{
-							*--p = '!';
-							inv = false;
-						}
-
-						if (!opt->parse(dest, p, true))
-						{
-							warn_elem(e, "has invalid value '%s'", p);
-							valid = false;
-							continue;
-						}
+						*--p = '!';
+						inv = false;
 					}
 
-					/* The last token was a sole "!" without any subsequent
-					 * text, so pass it to the option parser as-is. */
-					if (inv && !opt->parse(dest, "!", true))
+					if (!parse_value(opts, opt, section, dest, p, true))
 					{
 						warn_elem(e, "has invalid value '%s'", p);
 						valid = false;
+						continue;
 					}
 				}
-			}
 
-			known = true;
-			break;
+				/* The last token was a sole "!" without any subsequent
+				 * text, so pass it to the option parser as-is. */
+				if (inv && !parse_value(opts, opt, section, dest, "!", true))
+				{
+					warn_elem(e, "has invalid value '%s'", p);
+					valid = false;
+				}
+			}
 		}
-
-		if (!known)
-			warn_elem(e, "is unknown");
 	}
 
+	if (!valid)
+		fw3_snapshot_taint();
+
 	return valid;
 }
 
@@ -1132,8 +1268,7 @@ bool
 fw3_parse_blob_options(void *s, const struct fw3_option *opts,
                        struct blob_attr *a, const char *name)
 {
-	char *p, *v, buf[16];
-	bool known;
+	char *p, *v, *sp, buf[16];
 	unsigned rem, erem;
 	struct blob_attr *o, *e;
 	const struct fw3_option *opt;
@@ -1142,98 +1277,132 @@ fw3_parse_blob_options(void *s, const struct fw3_option *opts,
 
 	blobmsg_for_each_attr(o, a, rem)
 	{
-		known = false;
+		opt = lookup_option(opts, blobmsg_name(o));
 
-		for (opt = opts; opt->name; opt++)
+		if (!opt)
 		{
-			if (!opt->parse)
-				continue;
+			if (strcmp(blobmsg_name(o), "type"))
+				fprintf(stderr, "%s: '%s' is unknown\n", name, blobmsg_name(o));
 
-			if (strcmp(opt->name, blobmsg_name(o)))
-				continue;
+			continue;
+		}
 
-			if (blobmsg_type(o) == BLOBMSG_TYPE_ARRAY)
+		if (blobmsg_type(o) == BLOBMSG_TYPE_ARRAY)
+		{
+			if (!opt->elem_size)
 			{
-				if (!opt->elem_size)
-				{
-					fprintf(stderr, "%s: '%s' must not be a list\n",
-					        name, opt->name);
+				fprintf(stderr, "%s: '%s' must not be a list\n",
+				        name, opt->name);
 
-					valid = false;
-				}
-				else
-				{
-					dest = (struct list_head *)((char *)s + opt->offset);
-
-					blobmsg_for_each_attr(e, o, erem)
-					{
-						if (blobmsg_type(e) == BLOBMSG_TYPE_INT32) {
-							snprintf(buf, sizeof(buf), "%d", blobmsg_get_u32(e));
-							v = buf;
-						} else {
-							v = blobmsg_get_string(e);
-						}
-
-						if (!opt->parse(dest, v, true))
-						{
-							fprintf(stderr, "%s: '%s' has invalid value '%s'\n",
-							        name, opt->name, v);
-							valid = false;
-							continue;
-						}
-					}
-				}
+				valid = false;
 			}
 			else
 			{
-				if (blobmsg_type(o) == BLOBMSG_TYPE_INT32) {
-					snprintf(buf, sizeof(buf), "%d", blobmsg_get_u32(o));
-					v = buf;
-				} else {
-					v = blobmsg_get_string(o);
-				}
+				dest = (struct list_head *)((char *)s + opt->offset);
 
-				if (!v)
-					continue;
-
-				if (!opt->elem_size)
+				blobmsg_for_each_attr(e, o, erem)
 				{
-					if (!opt->parse((char *)s + opt->offset, v, false))
+					if (blobmsg_type(e) == BLOBMSG_TYPE_INT32) {
+						snprintf(buf, sizeof(buf), "%d", blobmsg_get_u32(e));
+						v = buf;
+					} else {
+						v = blobmsg_get_string(e);
+					}
+
+					if (!opt->parse(dest, v, true))
 					{
 						fprintf(stderr, "%s: '%s' has invalid value '%s'\n",
 						        name, opt->name, v);
 						valid = false;
+						continue;
 					}
 				}
-				else
+			}
+		}
+		else
+		{
+			if (blobmsg_type(o) == BLOBMSG_TYPE_INT32) {
+				snprintf(buf, sizeof(buf), "%d", blobmsg_get_u32(o));
+				v = buf;
+			} else {
+				v = blobmsg_get_string(o);
+			}
+
+			if (!v)
+				continue;
+
+			if (!opt->elem_size)
+			{
+				if (!opt->parse((char *)s + opt->offset, v, false))
 				{
-					dest = (struct list_head *)((char *)s + opt->offset);
+					fprintf(stderr, "%s: '%s' has invalid value '%s'\n",
+					        name, opt->name, v);
+					valid = false;
+				}
+			}
+			else
+			{
+				dest = (struct list_head *)((char *)s + opt->offset);
 
-					for (p = strtok(v, " \t"); p != NULL; p = strtok(NULL, " \t"))
+				for (p = strtok_r(v, " \t", &sp); p != NULL;
+				     p = strtok_r(NULL, " \t", &sp))
+				{
+					if (!opt->parse(dest, p, true))
 					{
-						if (!opt->parse(dest, p, true))
-						{
-							fprintf(stderr, "%s: '%s' has invalid value '%s'\n",
-							        name, opt->name, p);
-							valid = false;
-							continue;
-						}
+						fprintf(stderr, "%s: '%s' has invalid value '%s'\n",
+						        name, opt->name, p);
+						valid = false;
+						continue;
 					}
 				}
 			}
-
-			known = true;
-			break;
 		}
-
-		if (!known && strcmp(blobmsg_name(o), "type"))
-			fprintf(stderr, "%s: '%s' is unknown\n", name, blobmsg_name(o));
 	}
 
 	return valid;
 }
 
 
+/*
+ * Moves the elements of an option list into one block of the state slab,
+ * in list order, and describes the block in the given array. The list is
+ * linked through the moved elements, so it stays usable as before.
+ */
+void
+fw3_pack_list(struct list_head *head, size_t size, struct fw3_array *array)
+{
+	struct list_head *cur, *tmp;
+	unsigned int i, n = 0;
+	char *elems;
+
+	list_for_each(cur, head)
+		n++;
+
+	array->elems = NULL;
+	array->count = 0;
+
+	if (!n)
+		return;
+
+	if (!(elems = fw3_slab_alloc(n * size)))
+		error("Out of memory while allocating %d bytes", (int)(n * size));
+
+	i = 0;
+
+	list_for_each_safe(cur, tmp, head)
+	{
+		memcpy(elems + i++ * size, cur, size);
+		list_del(cur);
+		fw3_slab_release(cur);
+	}
+
+	for (i = 0; i < n; i++)
+		list_add_tail((struct list_head *)(elems + i * size), head);
+
+	array->elems = elems;
+	array->count = n;
+}
+
 const char *
 fw3_address_to_string(struct fw3_address *address, bool allow_invert, bool as_cidr)
 {
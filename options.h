@@ -42,6 +42,8 @@
 #include <uci.h>
 
 #include <libubox/list.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
 #include <libubox/utils.h>
 #include <libubox/blobmsg.h>
 
@@ -313,12 +315,18 @@ struct fw3_defaults
 
 	bool disable_ipv6;
 
+	int hotplug_workers;
+	int hotplug_timeout;
+
+	bool probe_cache;
+
 	uint32_t flags[2];
 };
 
 struct fw3_zone
 {
 	struct list_head list;
+	struct avl_node node;
 
 	bool enabled;
 	const char *name;
@@ -354,8 +362,22 @@ struct fw3_zone
 	uint32_t flags[2];
 
 	struct list_head old_addrs;
+	struct list_head old_networks;
+};
+
+/* option list packed into one block, see fw3_pack_list() */
+struct fw3_array
+{
+	void *elems;
+	unsigned int count;
 };
 
+#define fw3_foreach_array(p, a)                                            \
+	for (p = (a)->count ? (a)->elems : NULL;                               \
+	     (a)->count ? (p < (typeof(p))(a)->elems + (a)->count)             \
+	                : (p == NULL);                                         \
+	     p = (a)->count ? (void *)(p + 1) : (void *)(a))
+
 struct fw3_rule
 {
 	struct list_head list;
@@ -387,6 +409,16 @@ struct fw3_rule
 
 	struct list_head icmp_type;
 
+	struct {
+		struct fw3_array proto;
+		struct fw3_array ip_src;
+		struct fw3_array mac_src;
+		struct fw3_array port_src;
+		struct fw3_array ip_dest;
+		struct fw3_array port_dest;
+		struct fw3_array icmp_type;
+	} packed;
+
 	struct fw3_limit limit;
 	struct fw3_time time;
 	struct fw3_mark mark;
@@ -430,6 +462,11 @@ struct fw3_redirect
 	struct fw3_address ip_redir;
 	struct fw3_port port_redir;
 
+	struct {
+		struct fw3_array proto;
+		struct fw3_array mac_src;
+	} packed;
+
 	struct fw3_limit limit;
 	struct fw3_time time;
 	struct fw3_mark mark;
@@ -470,6 +507,10 @@ struct fw3_snat
 	struct fw3_address ip_snat;
 	struct fw3_port port_snat;
 
+	struct {
+		struct fw3_array proto;
+	} packed;
+
 	struct fw3_limit limit;
 	struct fw3_time time;
 	struct fw3_mark mark;
@@ -499,6 +540,7 @@ struct fw3_forward
 struct fw3_ipset
 {
 	struct list_head list;
+	struct avl_node node;
 
 	bool enabled;
 	const char *name;
@@ -536,11 +578,30 @@ struct fw3_include
 	enum fw3_include_type type;
 
 	bool reload;
+	bool independent;
+	bool idempotent;
+
+	/* pre-parsed restore commands, see includes.c */
+	bool loaded;
+	bool parsed;
+	struct list_head records;
+
+	/* content fingerprint as recorded in the state file */
+	const char *old_hash;
+	int old_mtime;
+	int old_size;
+
+	/* current content fingerprint */
+	char hash[33];
+	time_t mtime;
+	off_t size;
+	bool unchanged;
 };
 
 struct fw3_cthelper
 {
 	struct list_head list;
+	struct avl_node node;
 
 	bool enabled;
 	const char *name;
@@ -570,6 +631,26 @@ struct fw3_state
 	struct list_head includes;
 	struct list_head cthelpers;
 
+	/* name indexes of the zones, ipsets and helpers, first one wins */
+	struct avl_tree zone_index;
+	struct avl_tree ipset_index;
+	struct avl_tree cthelper_index;
+
+	struct blob_buf ubus_rules;
+
+	/* list elements parsed while loading */
+	struct fw3_slab slab;
+
+	void *snapshot;
+	size_t snapshot_size;
+
+	void *state_map;
+	size_t state_map_size;
+
+	/* configuration and the kinds of objects loaded from it so far */
+	struct uci_package *package;
+	unsigned int loaded;
+
 	bool disable_ipsets;
 	bool statefile;
 };
@@ -637,4 +718,6 @@ bool fw3_parse_blob_options(void *s, const struct fw3_option *opts,
 const char * fw3_address_to_string(struct fw3_address *address,
                                    bool allow_invert, bool as_cidr);
 
+void fw3_pack_list(struct list_head *head, size_t size, struct fw3_array *array);
+
 #endif
@@ -0,0 +1,246 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "pool.h"
+
+
+/*
+ * Sections of one type are parsed on a few worker threads when there are
+ * enough of them, each worker taking a contiguous run of sections. Only
+ * the option parsing runs in parallel, the results are then handed to
+ * the finish callback one by one in configuration order on the calling
+ * thread, along with the warnings collected while parsing the section.
+ * This keeps the resulting lists, the zone references resolved by the
+ * checks and the printed messages exactly as with a sequential load.
+ */
+
+#define FW3_POOL_MAX_THREADS	8
+#define FW3_POOL_MIN_SECTIONS	32
+
+struct pool_item {
+	struct uci_element *e;
+	void *obj;
+	bool valid;
+	size_t log_end;
+};
+
+struct pool_worker {
+	pthread_t thread;
+	bool started;
+
+	const struct fw3_option *opts;
+	fw3_pool_alloc_t alloc;
+
+	struct pool_item *items;
+	unsigned int n_items;
+
+	struct fw3_slab slab;
+	FILE *log;
+	char *log_buf;
+	size_t log_len;
+};
+
+
+static void
+parse_items(struct pool_worker *w)
+{
+	struct pool_item *it;
+
+	for (it = w->items; it < w->items + w->n_items; it++)
+	{
+		if ((it->obj = w->alloc()) != NULL)
+			it->valid = fw3_parse_options(it->obj, w->opts,
+			                              uci_to_section(it->e));
+
+		fflush(w->log);
+		it->log_end = w->log_len;
+	}
+}
+
+static void *
+run_worker(void *arg)
+{
+	struct pool_worker *w = arg;
+
+	fw3_slab_use(&w->slab);
+	fw3_log_capture(w->log);
+
+	parse_items(w);
+
+	fw3_log_capture(NULL);
+	fw3_slab_use(NULL);
+
+	return NULL;
+}
+
+static unsigned int
+pool_threads(unsigned int n_items)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int n = n_items / FW3_POOL_MIN_SECTIONS;
+
+	if (cpus < 1)
+		cpus = 1;
+
+	if (n > (unsigned int)cpus)
+		n = cpus;
+
+	if (n > FW3_POOL_MAX_THREADS)
+		n = FW3_POOL_MAX_THREADS;
+
+	return n;
+}
+
+static void
+load_sequential(struct fw3_state *state, struct pool_item *items,
+                unsigned int n_items, const struct fw3_option *opts,
+                fw3_pool_alloc_t alloc, fw3_pool_finish_t finish)
+{
+	struct pool_item *it;
+
+	for (it = items; it < items + n_items; it++)
+	{
+		if (!(it->obj = alloc()))
+			continue;
+
+		it->valid = fw3_parse_options(it->obj, opts, uci_to_section(it->e));
+		finish(state, it->obj, it->e, it->valid);
+	}
+}
+
+static bool
+load_parallel(struct fw3_state *state, struct pool_item *items,
+              unsigned int n_items, unsigned int n_workers,
+              const struct fw3_option *opts,
+              fw3_pool_alloc_t alloc, fw3_pool_finish_t finish)
+{
+	struct pool_worker *workers, *w;
+	struct fw3_slab *prev_slab;
+	struct pool_item *it;
+	unsigned int i, off = 0;
+	size_t log_off;
+
+	if (!(workers = calloc(n_workers, sizeof(*workers))))
+		return false;
+
+	for (i = 0; i < n_workers; i++)
+	{
+		w = &workers[i];
+		w->opts = opts;
+		w->alloc = alloc;
+		w->items = items + off;
+		w->n_items = n_items / n_workers + (i < n_items % n_workers);
+		off += w->n_items;
+
+		if (!(w->log = open_memstream(&w->log_buf, &w->log_len)))
+			goto fail;
+	}
+
+	/* a worker which could not be started is parsed here afterwards */
+	for (i = 0; i < n_workers; i++)
+		workers[i].started =
+			!pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+
+	for (i = 0; i < n_workers; i++)
+	{
+		w = &workers[i];
+
+		if (w->started)
+		{
+			pthread_join(w->thread, NULL);
+			continue;
+		}
+
+		prev_slab = fw3_slab_use(&w->slab);
+		fw3_log_capture(w->log);
+
+		parse_items(w);
+
+		fw3_log_capture(NULL);
+		fw3_slab_use(prev_slab);
+	}
+
+	for (i = 0; i < n_workers; i++)
+	{
+		w = &workers[i];
+		fw3_slab_merge(&state->slab, &w->slab);
+		fclose(w->log);
+		w->log = NULL;
+
+		for (it = w->items, log_off = 0; it < w->items + w->n_items; it++)
+		{
+			fwrite(w->log_buf + log_off, 1, it->log_end - log_off, stderr);
+			log_off = it->log_end;
+
+			if (it->obj)
+				finish(state, it->obj, it->e, it->valid);
+		}
+
+		free(w->log_buf);
+	}
+
+	free(workers);
+	return true;
+
+fail:
+	for (i = 0; i < n_workers; i++)
+	{
+		if (!workers[i].log)
+			continue;
+
+		fclose(workers[i].log);
+		free(workers[i].log_buf);
+	}
+
+	free(workers);
+	return false;
+}
+
+void
+fw3_pool_load(struct fw3_state *state, struct uci_package *p,
+              const char *type, const struct fw3_option *opts,
+              fw3_pool_alloc_t alloc, fw3_pool_finish_t finish)
+{
+	struct uci_element *e;
+	struct pool_item *items;
+	unsigned int n = 0, n_workers;
+
+	uci_foreach_element(&p->sections, e)
+		if (!strcmp(uci_to_section(e)->type, type))
+			n++;
+
+	if (!n)
+		return;
+
+	if (!(items = calloc(n, sizeof(*items))))
+		error("Out of memory while loading %u %s sections", n, type);
+
+	n = 0;
+
+	uci_foreach_element(&p->sections, e)
+		if (!strcmp(uci_to_section(e)->type, type))
+			items[n++].e = e;
+
+	n_workers = pool_threads(n);
+
+	if (n_workers < 2 ||
+	    !load_parallel(state, items, n, n_workers, opts, alloc, finish))
+		load_sequential(state, items, n, opts, alloc, finish);
+
+	free(items);
+}
@@ -0,0 +1,34 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FW3_POOL_H
+#define __FW3_POOL_H
+
+#include "options.h"
+#include "utils.h"
+
+
+typedef void * (*fw3_pool_alloc_t)(void);
+typedef void (*fw3_pool_finish_t)(struct fw3_state *state, void *obj,
+                                  struct uci_element *e, bool valid);
+
+void fw3_pool_load(struct fw3_state *state, struct uci_package *p,
+                   const char *type, const struct fw3_option *opts,
+                   fw3_pool_alloc_t alloc, fw3_pool_finish_t finish);
+
+#endif
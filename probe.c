@@ -0,0 +1,477 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <net/if.h>
+
+#include <libubox/md5.h>
+
+#include "probe.h"
+
+
+static struct fw3_probe probe;
+static char probe_done_key[80];
+
+static const char *probe_tools[] = {
+	"ipset",
+	"iptables-restore",
+	"ip6tables-restore",
+	NULL
+};
+
+
+static int
+cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static bool
+add_str(char ***set, int *n, const char *s)
+{
+	char **tmp = realloc(*set, (*n + 1) * sizeof(**set));
+
+	if (!tmp)
+		return false;
+
+	*set = tmp;
+	(*set)[*n] = fw3_strdup(s);
+	(*n)++;
+
+	return true;
+}
+
+static bool
+has_str(char **set, int n, const char *s)
+{
+	return (n > 0 && bsearch(&s, set, n, sizeof(*set), cmp_str) != NULL);
+}
+
+static void
+free_strs(char **set, int n)
+{
+	while (n > 0)
+		free(set[--n]);
+
+	free(set);
+}
+
+static const char *
+find_command(const char *cmd)
+{
+	struct stat s;
+	int plen = 0, clen = strlen(cmd) + 1;
+	char *search, *p;
+	static char path[PATH_MAX];
+
+	if (!stat(cmd, &s) && S_ISREG(s.st_mode))
+		return cmd;
+
+	search = getenv("PATH");
+
+	if (!search)
+		search = "/bin:/usr/bin:/sbin:/usr/sbin";
+
+	p = search;
+
+	do
+	{
+		if (*p != ':' && *p != '\0')
+			continue;
+
+		plen = p - search;
+
+		if ((plen + clen) >= sizeof(path))
+			continue;
+
+		strncpy(path, search, plen);
+		sprintf(path + plen, "/%s", cmd);
+
+		if (!stat(path, &s) && S_ISREG(s.st_mode))
+			return path;
+
+		search = p + 1;
+	}
+	while (*p++);
+
+	return NULL;
+}
+
+static void
+add_command(const char *name, const char *path)
+{
+	struct fw3_probe_cmd *tmp;
+
+	tmp = realloc(probe.commands, (probe.n_commands + 1) * sizeof(*tmp));
+
+	if (!tmp)
+		return;
+
+	probe.commands = tmp;
+	probe.commands[probe.n_commands].name = fw3_strdup(name);
+	probe.commands[probe.n_commands].path = path ? fw3_strdup(path) : NULL;
+	probe.n_commands++;
+}
+
+static void
+probe_tables(bool ipv6)
+{
+	FILE *f;
+	char line[32];
+	enum fw3_table table;
+
+	const char *path = ipv6
+		? "/proc/net/ip6_tables_names" : "/proc/net/ip_tables_names";
+
+	if (!(f = fopen(path, "r")))
+		return;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\n")] = 0;
+
+		for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
+			if (!strcmp(line, fw3_flag_names[table]))
+				probe.tables[ipv6] |= (1 << table);
+	}
+
+	fclose(f);
+}
+
+static void
+probe_modules(void)
+{
+	DIR *d;
+	struct dirent *e;
+
+	if (!(d = opendir("/sys/module")))
+		return;
+
+	while ((e = readdir(d)) != NULL)
+		if (e->d_name[0] != '.')
+			add_str(&probe.modules, &probe.n_modules, e->d_name);
+
+	closedir(d);
+}
+
+static void
+probe_loopback(void)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	if (getifaddrs(&ifaddr))
+		return;
+
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+	{
+		if (!(ifa->ifa_flags & IFF_LOOPBACK))
+			continue;
+
+		if (!has_str(probe.loopback, probe.n_loopback, ifa->ifa_name) &&
+		    add_str(&probe.loopback, &probe.n_loopback, ifa->ifa_name))
+			qsort(probe.loopback, probe.n_loopback,
+			      sizeof(*probe.loopback), cmp_str);
+	}
+
+	freeifaddrs(ifaddr);
+}
+
+/*
+ * The cache is only valid for the current boot and the current set of
+ * loaded kernel modules, identified by the boot id and a digest over the
+ * module names listed in /proc/modules.
+ */
+static bool
+probe_key(char *key, size_t len)
+{
+	int i;
+	FILE *f;
+	md5_ctx_t ctx;
+	uint8_t digest[16];
+	char boot_id[40], line[256];
+
+	if (!(f = fopen("/proc/sys/kernel/random/boot_id", "r")))
+		return false;
+
+	if (!fgets(boot_id, sizeof(boot_id), f))
+	{
+		fclose(f);
+		return false;
+	}
+
+	fclose(f);
+	boot_id[strcspn(boot_id, "\n")] = 0;
+
+	md5_begin(&ctx);
+
+	if ((f = fopen("/proc/modules", "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), f))
+			md5_hash(line, strcspn(line, " \n"), &ctx);
+
+		fclose(f);
+	}
+
+	md5_end(digest, &ctx);
+
+	i = snprintf(key, len, "%s/", boot_id);
+
+	for (len -= i, key += i, i = 0; i < 16 && len > 2; i++, len -= 2)
+		key += sprintf(key, "%02x", digest[i]);
+
+	return true;
+}
+
+static bool
+probe_load(const char *key)
+{
+	FILE *f;
+	bool valid = false;
+	char line[PATH_MAX + 64], *type, *name, *val;
+
+	if (!(f = fopen(FW3_PROBEFILE, "r")))
+		return false;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		type = strtok(line, " \n");
+		name = strtok(NULL, " \n");
+		val  = strtok(NULL, " \n");
+
+		if (!type || !name)
+			continue;
+
+		if (!strcmp(type, "key"))
+		{
+			if (!(valid = !strcmp(name, key)))
+				break;
+		}
+		else if (!valid)
+		{
+			break;
+		}
+		else if (!strcmp(type, "table"))
+		{
+			if (val && (*name == '4' || *name == '6') &&
+			    atoi(val) >= FW3_TABLE_FILTER && atoi(val) <= FW3_TABLE_RAW)
+				probe.tables[*name == '6'] |= (1 << atoi(val));
+		}
+		else if (!strcmp(type, "module"))
+		{
+			add_str(&probe.modules, &probe.n_modules, name);
+		}
+		else if (!strcmp(type, "loopback"))
+		{
+			add_str(&probe.loopback, &probe.n_loopback, name);
+		}
+		else if (!strcmp(type, "command"))
+		{
+			add_command(name, val);
+		}
+	}
+
+	fclose(f);
+
+	if (!valid)
+	{
+		fw3_probe_reset();
+		return false;
+	}
+
+	qsort(probe.modules, probe.n_modules, sizeof(*probe.modules), cmp_str);
+	qsort(probe.loopback, probe.n_loopback, sizeof(*probe.loopback), cmp_str);
+
+	return true;
+}
+
+static void
+probe_save(const char *key)
+{
+	int i, t;
+	FILE *f;
+	char tmp[sizeof(FW3_PROBEFILE) + 4];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", FW3_PROBEFILE);
+
+	if (!(f = fopen(tmp, "w")))
+		return;
+
+	fprintf(f, "key %s\n", key);
+
+	for (i = 0; i < 2; i++)
+		for (t = FW3_TABLE_FILTER; t <= FW3_TABLE_RAW; t++)
+			if (probe.tables[i] & (1 << t))
+				fprintf(f, "table %c %d\n", i ? '6' : '4', t);
+
+	for (i = 0; i < probe.n_modules; i++)
+		fprintf(f, "module %s\n", probe.modules[i]);
+
+	for (i = 0; i < probe.n_loopback; i++)
+		fprintf(f, "loopback %s\n", probe.loopback[i]);
+
+	for (i = 0; i < probe.n_commands; i++)
+		fprintf(f, "command %s %s\n", probe.commands[i].name,
+		        probe.commands[i].path ? probe.commands[i].path : "");
+
+	if (fclose(f) || rename(tmp, FW3_PROBEFILE))
+		unlink(tmp);
+}
+
+struct fw3_probe *
+fw3_probe(void)
+{
+	const char **tool;
+	char key[80];
+
+	if (probe.done)
+		return &probe;
+
+	if (!probe_key(key, sizeof(key)))
+		*key = 0;
+
+	if (*key && probe_load(key))
+	{
+		probe.cached = true;
+	}
+	else
+	{
+		probe_tables(false);
+		probe_tables(true);
+		probe_modules();
+		probe_loopback();
+
+		qsort(probe.modules, probe.n_modules, sizeof(*probe.modules), cmp_str);
+
+		for (tool = probe_tools; *tool; tool++)
+			add_command(*tool, find_command(*tool));
+
+		probe.dirty = true;
+	}
+
+	probe.done = true;
+	strcpy(probe_done_key, key);
+
+	return &probe;
+}
+
+bool
+fw3_probe_table(bool ipv6, const char *table)
+{
+	enum fw3_table t;
+
+	for (t = FW3_TABLE_FILTER; t <= FW3_TABLE_RAW; t++)
+		if (!strcmp(table, fw3_flag_names[t]))
+			return (fw3_probe()->tables[ipv6] & (1 << t));
+
+	return false;
+}
+
+bool
+fw3_probe_module(const char *name)
+{
+	struct fw3_probe *p = fw3_probe();
+
+	return has_str(p->modules, p->n_modules, name);
+}
+
+bool
+fw3_probe_loopback(const char *name)
+{
+	struct fw3_probe *p = fw3_probe();
+
+	return has_str(p->loopback, p->n_loopback, name);
+}
+
+const char *
+fw3_probe_command(const char *cmd)
+{
+	int i;
+	struct fw3_probe *p = fw3_probe();
+
+	/* explicit paths are not cached */
+	if (strchr(cmd, '/'))
+		return find_command(cmd);
+
+	for (i = 0; i < p->n_commands; i++)
+		if (!strcmp(p->commands[i].name, cmd))
+			return p->commands[i].path;
+
+	add_command(cmd, find_command(cmd));
+	p->dirty = true;
+
+	if (i == p->n_commands)
+		return find_command(cmd);
+
+	return p->commands[i].path;
+}
+
+/* store the probe results for subsequent runs or drop the cache */
+void
+fw3_probe_persist(bool enable)
+{
+	char key[80];
+
+	if (!enable)
+	{
+		unlink(FW3_PROBEFILE);
+		return;
+	}
+
+	if (!fw3_probe()->dirty || !probe_key(key, sizeof(key)))
+		return;
+
+	probe_save(key);
+	probe.dirty = false;
+}
+
+/*
+ * Keeps the results of a resident process for as long as the same kernel
+ * modules are loaded, and drops them to be probed again otherwise.
+ */
+void
+fw3_probe_refresh(void)
+{
+	char key[80];
+
+	if (!probe.done)
+		return;
+
+	if (!*probe_done_key || !probe_key(key, sizeof(key)) ||
+	    strcmp(key, probe_done_key))
+		fw3_probe_reset();
+}
+
+void
+fw3_probe_reset(void)
+{
+	int i;
+
+	free_strs(probe.modules, probe.n_modules);
+	free_strs(probe.loopback, probe.n_loopback);
+
+	for (i = 0; i < probe.n_commands; i++)
+	{
+		free(probe.commands[i].name);
+		free(probe.commands[i].path);
+	}
+
+	free(probe.commands);
+
+	memset(&probe, 0, sizeof(probe));
+	*probe_done_key = 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FW3_PROBE_H
+#define __FW3_PROBE_H
+
+#include "options.h"
+#include "utils.h"
+
+#define FW3_PROBEFILE	"/var/run/fw3.probe"
+
+
+struct fw3_probe_cmd
+{
+	char *name;
+	char *path;
+};
+
+struct fw3_probe
+{
+	bool done;
+	bool cached;
+	bool dirty;
+
+	uint8_t tables[2];
+
+	int n_modules;
+	char **modules;
+
+	int n_loopback;
+	char **loopback;
+
+	int n_commands;
+	struct fw3_probe_cmd *commands;
+};
+
+struct fw3_probe * fw3_probe(void);
+
+bool fw3_probe_table(bool ipv6, const char *table);
+bool fw3_probe_module(const char *name);
+bool fw3_probe_loopback(const char *name);
+const char * fw3_probe_command(const char *cmd);
+
+void fw3_probe_persist(bool enable);
+void fw3_probe_refresh(void);
+void fw3_probe_reset(void);
+
+#endif
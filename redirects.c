@@ -17,6 +17,7 @@
  */
 
 #include "redirects.h"
+#include "pool.h"
 
 
 const struct fw3_option fw3_redirect_opts[] = {
@@ -356,12 +357,12 @@ check_redirect(struct fw3_state *state, struct fw3_redirect *redir, struct uci_e
 	return true;
 }
 
-static struct fw3_redirect *
-fw3_alloc_redirect(struct fw3_state *state)
+static void *
+fw3_alloc_redirect(void)
 {
 	struct fw3_redirect *redir;
 
-	redir = calloc(1, sizeof(*redir));
+	redir = fw3_slab_alloc(sizeof(*redir));
 	if (!redir)
 		return NULL;
 
@@ -371,17 +372,46 @@ fw3_alloc_redirect(struct fw3_state *state)
 	redir->enabled = true;
 	redir->reflection = true;
 
-	list_add_tail(&redir->list, &state->redirects);
+	INIT_LIST_HEAD(&redir->list);
 
 	return redir;
 }
 
+/* lay out the lists iterated by expand_redirect() contiguously */
+static void
+pack_redirect(struct fw3_redirect *redir)
+{
+	fw3_pack_list(&redir->proto, sizeof(struct fw3_protocol), &redir->packed.proto);
+	fw3_pack_list(&redir->mac_src, sizeof(struct fw3_mac), &redir->packed.mac_src);
+}
+
+static void
+finish_redirect(struct fw3_state *state, void *obj, struct uci_element *e,
+                bool valid)
+{
+	struct fw3_redirect *redir = obj;
+
+	if (!valid)
+	{
+		warn_elem(e, "skipped due to invalid options");
+		fw3_free_redirect(redir);
+		return;
+	}
+
+	if (!check_redirect(state, redir, e)) {
+		fw3_free_redirect(redir);
+		return;
+	}
+
+	select_helper(state, redir);
+	pack_redirect(redir);
+	list_add_tail(&redir->list, &state->redirects);
+}
+
 void
 fw3_load_redirects(struct fw3_state *state, struct uci_package *p,
 		struct blob_attr *a)
 {
-	struct uci_section *s;
-	struct uci_element *e;
 	struct fw3_redirect *redir;
 	struct blob_attr *entry;
 	unsigned rem;
@@ -399,7 +429,7 @@ fw3_load_redirects(struct fw3_state *state, struct uci_package *p,
 		if (strcmp(type, "redirect"))
 			continue;
 
-		redir = fw3_alloc_redirect(state);
+		redir = fw3_alloc_redirect();
 		if (!redir)
 			continue;
 
@@ -416,33 +446,12 @@ fw3_load_redirects(struct fw3_state *state, struct uci_package *p,
 		}
 
 		select_helper(state, redir);
+		pack_redirect(redir);
+		list_add_tail(&redir->list, &state->redirects);
 	}
 
-	uci_foreach_element(&p->sections, e)
-	{
-		s = uci_to_section(e);
-
-		if (strcmp(s->type, "redirect"))
-			continue;
-
-		redir = fw3_alloc_redirect(state);
-		if (!redir)
-			continue;
-
-		if (!fw3_parse_options(redir, fw3_redirect_opts, s))
-		{
-			warn_elem(e, "skipped due to invalid options");
-			fw3_free_redirect(redir);
-			continue;
-		}
-
-		if (!check_redirect(state, redir, e)) {
-			fw3_free_redirect(redir);
-			continue;
-		}
-
-		select_helper(state, redir);
-	}
+	fw3_pool_load(state, p, "redirect", fw3_redirect_opts,
+	              fw3_alloc_redirect, finish_redirect);
 }
 
 static void
@@ -643,7 +652,7 @@ print_reflection(struct fw3_ipt_handle *h, struct fw3_state *state,
 
 static void
 expand_redirect(struct fw3_ipt_handle *handle, struct fw3_state *state,
-                struct fw3_redirect *redir, int num)
+                struct fw3_redirect *redir, int num, struct fw3_zone *zone)
 {
 	struct list_head *ext_addrs, *int_addrs;
 	struct fw3_address *ext_addr, *int_addr, ref_addr;
@@ -693,9 +702,13 @@ expand_redirect(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		set(redir->ipset.ptr->flags, handle->family, handle->family);
 	}
 
-	fw3_foreach(proto, &redir->proto)
-	fw3_foreach(mac, &redir->mac_src)
-		print_redirect(handle, state, redir, num, proto, mac);
+	if (!zone || zone == ((redir->target == FW3_FLAG_DNAT) ? redir->_src
+	                                                      : redir->_dest))
+	{
+		fw3_foreach_array(proto, &redir->packed.proto)
+		fw3_foreach_array(mac, &redir->packed.mac_src)
+			print_redirect(handle, state, redir, num, proto, mac);
+	}
 
 	/* reflection rules */
 	if (redir->target != FW3_FLAG_DNAT || !redir->reflection || redir->local)
@@ -704,6 +717,9 @@ expand_redirect(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	if (!redir->_dest || !redir->_src->masq)
 		return;
 
+	if (zone && zone != redir->_dest)
+		return;
+
 	ext_addrs = fw3_resolve_zone_addresses(redir->_src, &redir->ip_dest);
 	int_addrs = fw3_resolve_zone_addresses(redir->_dest, NULL);
 
@@ -720,7 +736,7 @@ expand_redirect(struct fw3_ipt_handle *handle, struct fw3_state *state,
 			if (!fw3_is_family(int_addr, handle->family))
 				continue;
 
-			fw3_foreach(proto, &redir->proto)
+			fw3_foreach_array(proto, &redir->packed.proto)
 			{
 				if (!proto)
 					continue;
@@ -763,6 +779,29 @@ fw3_print_redirects(struct fw3_ipt_handle *handle, struct fw3_state *state)
 		if (handle->table == FW3_TABLE_RAW && !redir->helper.ptr)
 			continue;
 
-		expand_redirect(handle, state, redir, num++);
+		expand_redirect(handle, state, redir, num++, NULL);
+	}
+}
+
+/*
+ * Emit only the nat rules ending up in the chains of the given zone, that
+ * are the redirects of the zone and the reflection rules pointing into it.
+ */
+void
+fw3_print_zone_redirects(struct fw3_ipt_handle *handle, struct fw3_state *state,
+                         struct fw3_zone *zone)
+{
+	int num = 0;
+	struct fw3_redirect *redir;
+
+	if (handle->family == FW3_FAMILY_V6 || handle->table != FW3_TABLE_NAT)
+		return;
+
+	list_for_each_entry(redir, &state->redirects, list)
+	{
+		if (zone == redir->_src || zone == redir->_dest)
+			expand_redirect(handle, state, redir, num, zone);
+
+		num++;
 	}
 }
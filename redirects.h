@@ -32,6 +32,8 @@ void fw3_load_redirects(struct fw3_state *state, struct uci_package *p,
 			struct blob_attr *a);
 void fw3_print_redirects(struct fw3_ipt_handle *handle,
                          struct fw3_state *state);
+void fw3_print_zone_redirects(struct fw3_ipt_handle *handle,
+                              struct fw3_state *state, struct fw3_zone *zone);
 
 static inline void fw3_free_redirect(struct fw3_redirect *redir)
 {
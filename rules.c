@@ -17,6 +17,7 @@
  */
 
 #include "rules.h"
+#include "pool.h"
 
 
 const struct fw3_option fw3_rule_opts[] = {
@@ -77,10 +78,10 @@ need_src_action_chain(struct fw3_rule *r)
 	return (r->_src && r->_src->log && (r->target > FW3_FLAG_ACCEPT));
 }
 
-static struct fw3_rule*
-alloc_rule(struct fw3_state *state)
+static void *
+alloc_rule(void)
 {
-	struct fw3_rule *rule = calloc(1, sizeof(*rule));
+	struct fw3_rule *rule = fw3_slab_alloc(sizeof(*rule));
 
 	if (rule) {
 		INIT_LIST_HEAD(&rule->proto);
@@ -94,7 +95,7 @@ alloc_rule(struct fw3_state *state)
 
 		INIT_LIST_HEAD(&rule->icmp_type);
 
-		list_add_tail(&rule->list, &state->rules);
+		INIT_LIST_HEAD(&rule->list);
 		rule->enabled = true;
 	}
 
@@ -235,12 +236,46 @@ check_rule(struct fw3_state *state, struct fw3_rule *r, struct uci_element *e)
 	return true;
 }
 
+/* lay out the lists iterated by expand_rule() contiguously */
+static void
+pack_rule(struct fw3_rule *rule)
+{
+	fw3_pack_list(&rule->proto, sizeof(struct fw3_protocol), &rule->packed.proto);
+	fw3_pack_list(&rule->ip_src, sizeof(struct fw3_address), &rule->packed.ip_src);
+	fw3_pack_list(&rule->mac_src, sizeof(struct fw3_mac), &rule->packed.mac_src);
+	fw3_pack_list(&rule->port_src, sizeof(struct fw3_port), &rule->packed.port_src);
+	fw3_pack_list(&rule->ip_dest, sizeof(struct fw3_address), &rule->packed.ip_dest);
+	fw3_pack_list(&rule->port_dest, sizeof(struct fw3_port), &rule->packed.port_dest);
+	fw3_pack_list(&rule->icmp_type, sizeof(struct fw3_icmptype), &rule->packed.icmp_type);
+}
+
+static void
+finish_rule(struct fw3_state *state, void *obj, struct uci_element *e,
+            bool valid)
+{
+	struct fw3_rule *rule = obj;
+
+	if (!valid)
+	{
+		warn_elem(e, "skipped due to invalid options");
+		fw3_free_rule(rule);
+		return;
+	}
+
+	if (!check_rule(state, rule, e))
+	{
+		fw3_free_rule(rule);
+		return;
+	}
+
+	pack_rule(rule);
+	list_add_tail(&rule->list, &state->rules);
+}
+
 void
 fw3_load_rules(struct fw3_state *state, struct uci_package *p,
 		struct blob_attr *a)
 {
-	struct uci_section *s;
-	struct uci_element *e;
 	struct fw3_rule *rule;
 	struct blob_attr *entry;
 	unsigned rem;
@@ -257,7 +292,7 @@ fw3_load_rules(struct fw3_state *state, struct uci_package *p,
 		if (strcmp(type, "rule"))
 			continue;
 
-		if (!(rule = alloc_rule(state)))
+		if (!(rule = alloc_rule()))
 			continue;
 
 		if (!fw3_parse_blob_options(rule, fw3_rule_opts, entry, name))
@@ -268,29 +303,16 @@ fw3_load_rules(struct fw3_state *state, struct uci_package *p,
 		}
 
 		if (!check_rule(state, rule, NULL))
-			fw3_free_rule(rule);
-	}
-
-	uci_foreach_element(&p->sections, e)
-	{
-		s = uci_to_section(e);
-
-		if (strcmp(s->type, "rule"))
-			continue;
-
-		if (!(rule = alloc_rule(state)))
-			continue;
-
-		if (!fw3_parse_options(rule, fw3_rule_opts, s))
 		{
-			warn_elem(e, "skipped due to invalid options");
 			fw3_free_rule(rule);
 			continue;
 		}
 
-		if (!check_rule(state, rule, e))
-			fw3_free_rule(rule);
+		pack_rule(rule);
+		list_add_tail(&rule->list, &state->rules);
 	}
+
+	fw3_pool_load(state, p, "rule", fw3_rule_opts, alloc_rule, finish_rule);
 }
 
 
@@ -500,12 +522,12 @@ expand_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	struct fw3_mac *mac;
 	struct fw3_icmptype *icmptype;
 
-	struct list_head *sports = NULL;
-	struct list_head *dports = NULL;
-	struct list_head *icmptypes = NULL;
+	struct fw3_array *sports = NULL;
+	struct fw3_array *dports = NULL;
+	struct fw3_array *icmptypes = NULL;
 
-	struct list_head empty;
-	INIT_LIST_HEAD(&empty);
+	struct fw3_array empty = { };
+	unsigned int i;
 
 	if (!fw3_is_family(rule, handle->family))
 		return;
@@ -560,28 +582,30 @@ expand_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		return;
 	}
 
-	list_for_each_entry(proto, &rule->proto, list)
+	for (i = 0, proto = rule->packed.proto.elems;
+	     i < rule->packed.proto.count;
+	     i++, proto++)
 	{
 		/* icmp / ipv6-icmp */
 		if (proto->protocol == 1 || proto->protocol == 58)
 		{
 			sports = &empty;
 			dports = &empty;
-			icmptypes = &rule->icmp_type;
+			icmptypes = &rule->packed.icmp_type;
 		}
 		else
 		{
-			sports = &rule->port_src;
-			dports = &rule->port_dest;
+			sports = &rule->packed.port_src;
+			dports = &rule->packed.port_dest;
 			icmptypes = &empty;
 		}
 
-		fw3_foreach(sip, &rule->ip_src)
-		fw3_foreach(dip, &rule->ip_dest)
-		fw3_foreach(sport, sports)
-		fw3_foreach(dport, dports)
-		fw3_foreach(mac, &rule->mac_src)
-		fw3_foreach(icmptype, icmptypes)
+		fw3_foreach_array(sip, &rule->packed.ip_src)
+		fw3_foreach_array(dip, &rule->packed.ip_dest)
+		fw3_foreach_array(sport, sports)
+		fw3_foreach_array(dport, dports)
+		fw3_foreach_array(mac, &rule->packed.mac_src)
+		fw3_foreach_array(icmptype, icmptypes)
 			print_rule(handle, state, rule, num, proto, sip, dip,
 			           sport, dport, mac, icmptype);
 	}
@@ -0,0 +1,865 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+
+#include <libubox/md5.h>
+
+#include "snapshot.h"
+#include "defaults.h"
+#include "zones.h"
+#include "forwards.h"
+#include "rules.h"
+#include "redirects.h"
+#include "snats.h"
+#include "ipsets.h"
+#include "includes.h"
+#include "helpers.h"
+
+/*
+ * The snapshot holds the outcome of every option parsed from the firewall
+ * configuration and the helper definitions, recorded while a regular load
+ * runs. A later run finding the snapshot key unchanged creates the sections
+ * without any options and fw3_parse_options() then copies the recorded
+ * values into the objects instead of parsing the option strings.
+ *
+ * Values holding pointers, or depending on runtime data such as networks
+ * resolved to their addresses through ubus, are recorded as raw strings and
+ * passed to their parser again.
+ */
+
+#define FW3_SNAPSHOT_VERSION	1
+
+struct snap_header {
+	char magic[4];
+	uint32_t version;
+	uint8_t key[16];
+	uint32_t size;
+	uint32_t packages;
+	uint32_t n_sections;
+	uint32_t data;
+};
+
+struct snap_section {
+	uint32_t package;
+	uint32_t type;
+	uint32_t name;
+	uint32_t title;
+	uint32_t n_values;
+};
+
+struct snap_value {
+	uint16_t table;
+	uint16_t option;
+	uint8_t raw;
+	uint8_t is_list;
+	uint16_t count;
+	uint32_t data;
+	uint32_t len;
+};
+
+struct snap_record {
+	struct list_head list;
+	struct uci_section *section;
+	struct snap_value v;
+	char data[];
+};
+
+struct snap_ref {
+	struct uci_section *section;
+	const struct snap_section *rec;
+};
+
+struct snap_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+static struct {
+	bool recording;
+	bool tainted;
+	uint8_t key[16];
+	struct list_head records;
+
+	const struct fw3_state *state;
+
+	const char *data;
+	int n_refs;
+	struct snap_ref *refs;
+} snap = { .records = LIST_HEAD_INIT(snap.records) };
+
+/* values may be recorded by several parsing threads at once */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *snap_packages[] = {
+	"firewall",
+	"fw3_ct_helpers",
+	NULL
+};
+
+static const struct fw3_option *snap_tables[] = {
+	fw3_flag_opts,
+	fw3_zone_opts,
+	fw3_forward_opts,
+	fw3_rule_opts,
+	fw3_redirect_opts,
+	fw3_snat_opts,
+	fw3_ipset_opts,
+	fw3_include_opts,
+	fw3_cthelper_opts,
+	NULL
+};
+
+/* parsers whose result is plain data, along with the size of that result */
+static const struct {
+	bool (*parse)(void *, const char *, bool);
+	size_t size;
+} snap_images[] = {
+	{ fw3_parse_bool,              sizeof(bool) },
+	{ fw3_parse_int,               sizeof(int) },
+	{ fw3_parse_target,            sizeof(int) },
+	{ fw3_parse_reject_code,       sizeof(int) },
+	{ fw3_parse_limit,             sizeof(struct fw3_limit) },
+	{ fw3_parse_device,            sizeof(struct fw3_device) },
+	{ fw3_parse_address,           sizeof(struct fw3_address) },
+	{ fw3_parse_network,           sizeof(struct fw3_address) },
+	{ fw3_parse_mac,               sizeof(struct fw3_mac) },
+	{ fw3_parse_port,              sizeof(struct fw3_port) },
+	{ fw3_parse_family,            sizeof(int) },
+	{ fw3_parse_icmptype,          sizeof(struct fw3_icmptype) },
+	{ fw3_parse_protocol,          sizeof(struct fw3_protocol) },
+	{ fw3_parse_ipset_method,      sizeof(int) },
+	{ fw3_parse_include_type,      sizeof(int) },
+	{ fw3_parse_reflection_source, sizeof(int) },
+	{ fw3_parse_time,              sizeof(int) },
+	{ fw3_parse_weekdays,          sizeof(uint8_t) },
+	{ fw3_parse_monthdays,         sizeof(uint32_t) },
+	{ fw3_parse_mark,              sizeof(struct fw3_mark) },
+	{ fw3_parse_dscp,              sizeof(struct fw3_dscp) },
+	{ fw3_parse_direction,         sizeof(bool) },
+	{ fw3_parse_cthelper,          sizeof(struct fw3_cthelpermatch) },
+	{ }
+};
+
+
+static int
+table_index(const struct fw3_option *opts)
+{
+	int i;
+
+	for (i = 0; snap_tables[i]; i++)
+		if (snap_tables[i] == opts)
+			return i;
+
+	return -1;
+}
+
+static int
+table_size(int table)
+{
+	const struct fw3_option *opt;
+
+	for (opt = snap_tables[table]; opt->name; opt++);
+
+	return opt - snap_tables[table];
+}
+
+static size_t
+image_size(bool (*parse)(void *, const char *, bool))
+{
+	int i;
+
+	for (i = 0; snap_images[i].parse; i++)
+		if (snap_images[i].parse == parse)
+			return snap_images[i].size;
+
+	return 0;
+}
+
+static void
+hash_file(md5_ctx_t *ctx, const char *path)
+{
+	FILE *f;
+	char buf[4096];
+	size_t len;
+	long total = -1;
+
+	if ((f = fopen(path, "r")) != NULL)
+	{
+		for (total = 0; (len = fread(buf, 1, sizeof(buf), f)) > 0; total += len)
+			md5_hash(buf, len, ctx);
+
+		fclose(f);
+	}
+
+	/* separates the files and tells a missing one from an empty one */
+	md5_hash(&total, sizeof(total), ctx);
+}
+
+/*
+ * The key covers the configuration including uncommitted changes, the
+ * helper definitions and the layout of everything stored as plain data, so
+ * a snapshot written by a different build is never used.
+ */
+static bool
+snapshot_key(uint8_t *key)
+{
+	md5_ctx_t ctx;
+	const struct fw3_option **t, *opt;
+	int i;
+
+	if (access(FW3_CONFIG, R_OK))
+		return false;
+
+	md5_begin(&ctx);
+
+	for (i = 0; snap_images[i].parse; i++)
+		md5_hash(&snap_images[i].size, sizeof(snap_images[i].size), &ctx);
+
+	for (t = snap_tables; *t; t++)
+	{
+		for (opt = *t; opt->name; opt++)
+		{
+			md5_hash(opt->name, strlen(opt->name) + 1, &ctx);
+			md5_hash(&opt->offset, sizeof(opt->offset), &ctx);
+			md5_hash(&opt->elem_size, sizeof(opt->elem_size), &ctx);
+		}
+	}
+
+	hash_file(&ctx, FW3_CONFIG);
+	hash_file(&ctx, FW3_CONFIGDELTA);
+	hash_file(&ctx, FW3_HELPERCONF);
+
+	md5_end(key, &ctx);
+
+	return true;
+}
+
+static void
+snapshot_discard(void)
+{
+	struct snap_record *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &snap.records, list)
+	{
+		list_del(&r->list);
+		free(r);
+	}
+
+	snap.recording = false;
+}
+
+static void
+snapshot_reset(void)
+{
+	snapshot_discard();
+
+	free(snap.refs);
+
+	snap.refs = NULL;
+	snap.n_refs = 0;
+	snap.data = NULL;
+	snap.state = NULL;
+	snap.tainted = false;
+}
+
+static int
+cmp_ref(const void *a, const void *b)
+{
+	const struct snap_ref *x = a, *y = b;
+
+	return (x->section > y->section) - (x->section < y->section);
+}
+
+static struct uci_package *
+empty_package(struct uci_context *ctx, const char *name)
+{
+	struct uci_package *p = NULL;
+	FILE *f;
+
+	if ((f = fopen("/dev/null", "r")) != NULL)
+	{
+		uci_import(ctx, f, name, &p, true);
+		fclose(f);
+	}
+
+	return p;
+}
+
+static bool
+check_section(const char *map, const struct snap_header *hdr, size_t off)
+{
+	const struct snap_section *sec = (const void *)(map + off);
+	const struct snap_value *v = (const void *)(sec + 1);
+	size_t datalen = hdr->size - hdr->data;
+	uint32_t i;
+
+	if (off + sizeof(*sec) > hdr->data ||
+	    off + sizeof(*sec) + sec->n_values * sizeof(*v) > hdr->data)
+		return false;
+
+	if (sec->package >= ARRAY_SIZE(snap_packages) - 1 ||
+	    !(hdr->packages & (1 << sec->package)) ||
+	    !sec->type || sec->type >= datalen || sec->name >= datalen ||
+	    sec->title >= datalen)
+		return false;
+
+	for (i = 0; i < sec->n_values; i++, v++)
+	{
+		if (v->table >= ARRAY_SIZE(snap_tables) - 1 ||
+		    v->option >= table_size(v->table))
+			return false;
+
+		if (v->data + (size_t)v->len > datalen)
+			return false;
+
+		if (!v->raw && v->is_list && v->count && v->len % v->count)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+snapshot_import(struct uci_context *ctx, const char *map)
+{
+	const struct snap_header *hdr = (const void *)map;
+	const struct snap_section *sec;
+	const char *data = map + hdr->data;
+	struct uci_package *pkgs[ARRAY_SIZE(snap_packages)] = { };
+	struct uci_section *s;
+	struct uci_ptr ptr;
+	size_t off = sizeof(*hdr);
+	uint32_t i;
+
+	/* the data area ends with a zero byte, so every string is terminated */
+	if (hdr->data < sizeof(*hdr) || hdr->data >= hdr->size ||
+	    map[hdr->size - 1] != 0)
+		return false;
+
+	snap.refs = calloc(hdr->n_sections ? hdr->n_sections : 1,
+	                   sizeof(*snap.refs));
+
+	if (!snap.refs)
+		return false;
+
+	for (i = 0; snap_packages[i]; i++)
+		if ((hdr->packages & (1 << i)) &&
+		    !(pkgs[i] = empty_package(ctx, snap_packages[i])))
+			goto fail;
+
+	for (i = 0; i < hdr->n_sections; i++)
+	{
+		if (!check_section(map, hdr, off))
+			goto fail;
+
+		sec = (const void *)(map + off);
+		off += sizeof(*sec) + sec->n_values * sizeof(struct snap_value);
+
+		if (sec->name)
+		{
+			memset(&ptr, 0, sizeof(ptr));
+			ptr.p = pkgs[sec->package];
+			ptr.section = data + sec->name;
+			ptr.value = data + sec->type;
+
+			if (uci_set(ctx, &ptr))
+				goto fail;
+
+			s = ptr.s;
+		}
+		else if (uci_add_section(ctx, pkgs[sec->package], data + sec->type, &s))
+		{
+			goto fail;
+		}
+
+		if (sec->title)
+		{
+			memset(&ptr, 0, sizeof(ptr));
+			ptr.p = pkgs[sec->package];
+			ptr.s = s;
+			ptr.option = "name";
+			ptr.value = data + sec->title;
+
+			if (uci_set(ctx, &ptr))
+				goto fail;
+		}
+
+		snap.refs[i].section = s;
+		snap.refs[i].rec = sec;
+	}
+
+	snap.n_refs = hdr->n_sections;
+	qsort(snap.refs, snap.n_refs, sizeof(*snap.refs), cmp_ref);
+
+	return true;
+
+fail:
+	for (i = 0; snap_packages[i]; i++)
+		if (pkgs[i])
+			uci_unload(ctx, pkgs[i]);
+
+	free(snap.refs);
+	snap.refs = NULL;
+
+	return false;
+}
+
+/*
+ * Returns true and the section skeleton of the configuration if an up to
+ * date snapshot exists. Otherwise the caller is expected to load the
+ * configuration, which is then recorded for fw3_snapshot_finish().
+ */
+bool
+fw3_snapshot_load(struct fw3_state *state, struct uci_package **p)
+{
+	const struct snap_header *hdr;
+	struct stat s;
+	char *map;
+	int fd;
+
+	snapshot_reset();
+
+	snap.state = state;
+
+	if (!snapshot_key(snap.key))
+		return false;
+
+	snap.recording = true;
+
+	if ((fd = open(FW3_SNAPSHOT, O_RDONLY)) < 0)
+		return false;
+
+	if (fstat(fd, &s) || s.st_size < (off_t)sizeof(*hdr))
+	{
+		close(fd);
+		return false;
+	}
+
+	/* private and writable, as parsers may take their strings as is */
+	map = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = (const void *)map;
+
+	if (memcmp(hdr->magic, "fw3s", 4) ||
+	    hdr->version != FW3_SNAPSHOT_VERSION ||
+	    memcmp(hdr->key, snap.key, sizeof(snap.key)) ||
+	    hdr->size != s.st_size ||
+	    !snapshot_import(state->uci, map))
+	{
+		munmap(map, s.st_size);
+		return false;
+	}
+
+	state->snapshot = map;
+	state->snapshot_size = s.st_size;
+
+	snap.recording = false;
+	snap.data = map + hdr->data;
+
+	*p = uci_lookup_package(state->uci, snap_packages[0]);
+
+	return true;
+}
+
+struct uci_package *
+fw3_snapshot_package(struct uci_context *ctx, const char *name)
+{
+	return snap.data ? uci_lookup_package(ctx, name) : NULL;
+}
+
+bool
+fw3_snapshot_replay(void *obj, const struct fw3_option *opts,
+                    struct uci_section *section)
+{
+	struct snap_ref key = { .section = section }, *ref;
+	const struct snap_value *v;
+	const struct fw3_option *opt;
+	const char *data;
+	void *dest, *elem;
+	size_t size;
+	uint32_t i, n;
+	int table;
+
+	if (!snap.data || (table = table_index(opts)) < 0)
+		return false;
+
+	ref = bsearch(&key, snap.refs, snap.n_refs, sizeof(*snap.refs), cmp_ref);
+
+	if (!ref)
+		return false;
+
+	v = (const void *)(ref->rec + 1);
+
+	for (i = 0; i < ref->rec->n_values; i++, v++)
+	{
+		if (v->table != table)
+			continue;
+
+		opt = &opts[v->option];
+		dest = (char *)obj + opt->offset;
+		data = snap.data + v->data;
+
+		if (v->raw)
+		{
+			opt->parse(dest, data, v->is_list);
+		}
+		else if (!v->is_list)
+		{
+			memcpy(dest, data, v->len);
+		}
+		else if (v->count)
+		{
+			size = v->len / v->count;
+
+			for (n = 0; n < v->count; n++)
+			{
+				if (!(elem = fw3_slab_alloc(size)))
+					error("Out of memory while allocating %d bytes", size);
+
+				memcpy(elem, data + n * size, size);
+				list_add_tail((struct list_head *)elem, (struct list_head *)dest);
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool
+network_resolved(void *dest, struct list_head *tail, bool is_list)
+{
+	struct list_head *cur;
+
+	if (!is_list)
+		return ((struct fw3_address *)dest)->resolved;
+
+	for (cur = tail->next; cur != dest; cur = cur->next)
+		if (((struct fw3_address *)cur)->resolved)
+			return true;
+
+	return false;
+}
+
+void
+fw3_snapshot_value(const struct fw3_option *opts, const struct fw3_option *opt,
+                   struct uci_section *section, void *dest,
+                   struct list_head *tail, const char *val, bool is_list)
+{
+	struct snap_record *r;
+	struct list_head *cur;
+	size_t size, len;
+	int table, n = 0;
+	bool raw;
+	char *p;
+
+	if (!snap.recording || snap.tainted)
+		return;
+
+	if ((table = table_index(opts)) < 0)
+	{
+		fw3_snapshot_taint();
+		return;
+	}
+
+	size = image_size(opt->parse);
+	raw = !size || (opt->parse == fw3_parse_network &&
+	                network_resolved(dest, tail, is_list));
+
+	if (raw)
+	{
+		len = strlen(val) + 1;
+	}
+	else if (is_list)
+	{
+		for (cur = tail->next; cur != dest; cur = cur->next)
+			n++;
+
+		len = n * size;
+	}
+	else
+	{
+		len = size;
+	}
+
+	if (n > UINT16_MAX || !(r = calloc(1, sizeof(*r) + len)))
+	{
+		fw3_snapshot_taint();
+		return;
+	}
+
+	r->section = section;
+	r->v.table = table;
+	r->v.option = opt - opts;
+	r->v.raw = raw;
+	r->v.is_list = is_list;
+	r->v.count = n;
+	r->v.len = len;
+
+	if (raw)
+		memcpy(r->data, val, len);
+	else if (!is_list)
+		memcpy(r->data, dest, len);
+	else
+		for (cur = tail->next, p = r->data; cur != dest; cur = cur->next, p += size)
+			memcpy(p, cur, size);
+
+	pthread_mutex_lock(&snap_lock);
+	list_add_tail(&r->list, &snap.records);
+	pthread_mutex_unlock(&snap_lock);
+}
+
+/* anything the option parsing complained about is left to a regular load */
+void
+fw3_snapshot_taint(void)
+{
+	__atomic_store_n(&snap.tainted, true, __ATOMIC_RELAXED);
+}
+
+static uint32_t
+buf_add(struct snap_buf *b, const void *data, size_t len)
+{
+	size_t off = b->len;
+	char *tmp;
+
+	if (b->failed)
+		return 0;
+
+	if (b->len + len > b->size)
+	{
+		while (b->len + len > b->size)
+			b->size = b->size ? b->size * 2 : 4096;
+
+		if (!(tmp = realloc(b->data, b->size)))
+		{
+			b->failed = true;
+			return 0;
+		}
+
+		b->data = tmp;
+	}
+
+	memcpy(b->data + off, data, len);
+	b->len += len;
+
+	return off;
+}
+
+static uint32_t
+buf_str(struct snap_buf *b, const char *s)
+{
+	return buf_add(b, s, strlen(s) + 1);
+}
+
+struct snap_sorted {
+	struct snap_record *r;
+	unsigned int idx;
+};
+
+/* orders by section, then by the order the values got recorded in */
+static int
+cmp_sorted(const void *a, const void *b)
+{
+	const struct snap_sorted *x = a, *y = b;
+
+	if (x->r->section != y->r->section)
+		return (x->r->section > y->r->section) -
+		       (x->r->section < y->r->section);
+
+	return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+static struct snap_sorted *
+sort_records(unsigned int *n)
+{
+	struct snap_record *r;
+	struct snap_sorted *sorted;
+	unsigned int i = 0;
+
+	*n = 0;
+
+	list_for_each_entry(r, &snap.records, list)
+		(*n)++;
+
+	if (!(sorted = calloc(*n + 1, sizeof(*sorted))))
+		return NULL;
+
+	list_for_each_entry(r, &snap.records, list)
+	{
+		sorted[i].r = r;
+		sorted[i].idx = i;
+		i++;
+	}
+
+	qsort(sorted, *n, sizeof(*sorted), cmp_sorted);
+
+	return sorted;
+}
+
+/* the first of the sorted records of section s, n if there is none */
+static unsigned int
+find_records(struct snap_sorted *sorted, unsigned int n, struct uci_section *s)
+{
+	unsigned int lo = 0, hi = n, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+
+		if (sorted[mid].r->section < s)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+snapshot_save(struct uci_context *ctx)
+{
+	struct snap_header hdr = { .magic = "fw3s" };
+	struct snap_section sec;
+	struct snap_value v;
+	struct snap_record *r;
+	struct snap_sorted *sorted;
+	struct snap_buf recs = { }, data = { };
+	struct uci_package *p;
+	struct uci_section *s;
+	struct uci_element *e;
+	const char *title;
+	char tmp[sizeof(FW3_SNAPSHOT) + 4];
+	uint32_t off;
+	bool written;
+	FILE *f;
+	int i;
+	unsigned int j, n;
+
+	if (!(sorted = sort_records(&n)))
+		return;
+
+	hdr.version = FW3_SNAPSHOT_VERSION;
+	memcpy(hdr.key, snap.key, sizeof(hdr.key));
+
+	/* offset zero of the data area stands for an unset string */
+	buf_add(&data, "", 1);
+	buf_add(&recs, &hdr, sizeof(hdr));
+
+	for (i = 0; snap_packages[i]; i++)
+	{
+		if (!(p = uci_lookup_package(ctx, snap_packages[i])))
+			continue;
+
+		hdr.packages |= (1 << i);
+
+		uci_foreach_element(&p->sections, e)
+		{
+			s = uci_to_section(e);
+
+			memset(&sec, 0, sizeof(sec));
+			sec.package = i;
+			sec.type = buf_str(&data, s->type);
+
+			if (!s->anonymous)
+				sec.name = buf_str(&data, e->name);
+			else if ((title = uci_lookup_option_string(ctx, s, "name")) != NULL)
+				sec.title = buf_str(&data, title);
+
+			off = buf_add(&recs, &sec, sizeof(sec));
+
+			for (j = find_records(sorted, n, s);
+			     j < n && (r = sorted[j].r)->section == s; j++)
+			{
+				v = r->v;
+				v.data = buf_add(&data, r->data, r->v.len);
+				buf_add(&recs, &v, sizeof(v));
+				sec.n_values++;
+			}
+
+			if (!recs.failed)
+				memcpy(recs.data + off, &sec, sizeof(sec));
+
+			hdr.n_sections++;
+		}
+	}
+
+	buf_add(&data, "", 1);
+
+	if (recs.failed || data.failed)
+		goto out;
+
+	hdr.data = recs.len;
+	hdr.size = recs.len + data.len;
+	memcpy(recs.data, &hdr, sizeof(hdr));
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", FW3_SNAPSHOT);
+
+	if (!(f = fopen(tmp, "w")))
+		goto out;
+
+	written = (fwrite(recs.data, 1, recs.len, f) == recs.len &&
+	           fwrite(data.data, 1, data.len, f) == data.len);
+
+	if (fclose(f) || !written || rename(tmp, FW3_SNAPSHOT))
+		unlink(tmp);
+
+out:
+	free(sorted);
+	free(recs.data);
+	free(data.data);
+}
+
+/* stores the recorded configuration after a load completed */
+void
+fw3_snapshot_finish(struct fw3_state *state)
+{
+	if (snap.recording && !snap.tainted)
+		snapshot_save(state->uci);
+
+	snapshot_reset();
+}
+
+/*
+ * Stops recording for a state which is not going to load all of the
+ * configuration. A snapshot it was loaded from stays in use.
+ */
+void
+fw3_snapshot_abort(void)
+{
+	snapshot_discard();
+}
+
+void
+fw3_snapshot_free(struct fw3_state *state)
+{
+	/* records and references point into this state */
+	if (snap.state == state)
+		snapshot_reset();
+
+	if (state->snapshot)
+		munmap(state->snapshot, state->snapshot_size);
+
+	state->snapshot = NULL;
+	state->snapshot_size = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FW3_SNAPSHOT_H
+#define __FW3_SNAPSHOT_H
+
+#include "options.h"
+#include "utils.h"
+
+#define FW3_SNAPSHOT	"/var/run/fw3.snapshot"
+
+
+bool fw3_snapshot_load(struct fw3_state *state, struct uci_package **p);
+void fw3_snapshot_finish(struct fw3_state *state);
+void fw3_snapshot_abort(void);
+void fw3_snapshot_free(struct fw3_state *state);
+
+struct uci_package * fw3_snapshot_package(struct uci_context *ctx,
+                                          const char *name);
+
+bool fw3_snapshot_replay(void *obj, const struct fw3_option *opts,
+                         struct uci_section *section);
+
+void fw3_snapshot_value(const struct fw3_option *opts,
+                        const struct fw3_option *opt,
+                        struct uci_section *section, void *dest,
+                        struct list_head *tail, const char *val, bool is_list);
+
+void fw3_snapshot_taint(void);
+
+#endif
@@ -17,6 +17,7 @@
  */
 
 #include "snats.h"
+#include "pool.h"
 
 
 const struct fw3_option fw3_snat_opts[] = {
@@ -105,14 +106,14 @@ check_families(struct uci_element *e, struct fw3_snat *r)
 }
 
 
-static struct fw3_snat*
-alloc_snat(struct fw3_state *state)
+static void *
+alloc_snat(void)
 {
-	struct fw3_snat *snat = calloc(1, sizeof(*snat));
+	struct fw3_snat *snat = fw3_slab_alloc(sizeof(*snat));
 
 	if (snat) {
 		INIT_LIST_HEAD(&snat->proto);
-		list_add_tail(&snat->list, &state->snats);
+		INIT_LIST_HEAD(&snat->list);
 		snat->enabled = true;
 	}
 
@@ -193,11 +194,33 @@ check_snat(struct fw3_state *state, struct fw3_snat *snat, struct uci_element *e
 }
 
 
+static void
+finish_snat(struct fw3_state *state, void *obj, struct uci_element *e,
+            bool valid)
+{
+	struct fw3_snat *snat = obj;
+
+	if (!valid)
+	{
+		warn_elem(e, "skipped due to invalid options");
+		fw3_free_snat(snat);
+		return;
+	}
+
+	if (!check_snat(state, snat, e))
+	{
+		fw3_free_snat(snat);
+		return;
+	}
+
+	fw3_pack_list(&snat->proto, sizeof(struct fw3_protocol),
+	              &snat->packed.proto);
+	list_add_tail(&snat->list, &state->snats);
+}
+
 void
 fw3_load_snats(struct fw3_state *state, struct uci_package *p, struct blob_attr *a)
 {
-	struct uci_section *s;
-	struct uci_element *e;
 	struct fw3_snat *snat;
 	struct blob_attr *entry;
 	unsigned rem;
@@ -214,7 +237,7 @@ fw3_load_snats(struct fw3_state *state, struct uci_package *p, struct blob_attr
 		if (strcmp(type, "nat"))
 			continue;
 
-		snat = alloc_snat(state);
+		snat = alloc_snat();
 		if (!snat)
 			continue;
 
@@ -226,30 +249,17 @@ fw3_load_snats(struct fw3_state *state, struct uci_package *p, struct blob_attr
 		}
 
 		if (!check_snat(state, snat, NULL))
-			fw3_free_snat(snat);
-	}
-
-	uci_foreach_element(&p->sections, e)
-	{
-		s = uci_to_section(e);
-
-		if (strcmp(s->type, "nat"))
-			continue;
-
-		snat = alloc_snat(state);
-		if (!snat)
-			continue;
-
-		if (!fw3_parse_options(snat, fw3_snat_opts, s))
 		{
-			warn_elem(e, "skipped due to invalid options");
 			fw3_free_snat(snat);
 			continue;
 		}
 
-		if (!check_snat(state, snat, e))
-			fw3_free_snat(snat);
+		fw3_pack_list(&snat->proto, sizeof(struct fw3_protocol),
+		              &snat->packed.proto);
+		list_add_tail(&snat->list, &state->snats);
 	}
+
+	fw3_pool_load(state, p, "nat", fw3_snat_opts, alloc_snat, finish_snat);
 }
 
 static void
@@ -400,7 +410,7 @@ expand_snat(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		set(snat->ipset.ptr->flags, handle->family, handle->family);
 	}
 
-	fw3_foreach(proto, &snat->proto)
+	fw3_foreach_array(proto, &snat->packed.proto)
 		print_snat(handle, state, snat, num, proto);
 }
 
@@ -419,3 +429,22 @@ fw3_print_snats(struct fw3_ipt_handle *handle, struct fw3_state *state)
 	list_for_each_entry(snat, &state->snats, list)
 		expand_snat(handle, state, snat, num++);
 }
+
+void
+fw3_print_zone_snats(struct fw3_ipt_handle *handle, struct fw3_state *state,
+                     struct fw3_zone *zone)
+{
+	int num = 0;
+	struct fw3_snat *snat;
+
+	if (handle->family == FW3_FAMILY_V6 || handle->table != FW3_TABLE_NAT)
+		return;
+
+	list_for_each_entry(snat, &state->snats, list)
+	{
+		if (snat->_src == zone)
+			expand_snat(handle, state, snat, num);
+
+		num++;
+	}
+}
@@ -29,6 +29,8 @@ extern const struct fw3_option fw3_snat_opts[];
 
 void fw3_load_snats(struct fw3_state *state, struct uci_package *p, struct blob_attr *a);
 void fw3_print_snats(struct fw3_ipt_handle *handle, struct fw3_state *state);
+void fw3_print_zone_snats(struct fw3_ipt_handle *handle, struct fw3_state *state,
+                          struct fw3_zone *zone);
 
 static inline void fw3_free_snat(struct fw3_snat *snat)
 {
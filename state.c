@@ -0,0 +1,769 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+
+#include "state.h"
+#include "zones.h"
+#include "ipsets.h"
+#include "includes.h"
+
+/*
+ * The state file is a header followed by a sequence of records, each one
+ * a fixed part optionally followed by the strings it refers to. Strings
+ * are referenced by their offset from the start of the record payload.
+ *
+ * Zone and ipset records are followed by the records describing their
+ * devices, networks, subnets, addresses and datatypes, which belong to
+ * the last zone or ipset read. Records are read through a private mapping
+ * of the file and strings are used in place, so the mapping is kept until
+ * the state is freed.
+ */
+
+#define FW3_STATE_VERSION	1
+
+enum state_type {
+	STATE_DEFAULTS     = 1,
+	STATE_ZONE         = 2,
+	STATE_ZONE_DEVICE  = 3,
+	STATE_ZONE_NETWORK = 4,
+	STATE_ZONE_SUBNET  = 5,
+	STATE_ZONE_ADDR    = 6,
+	STATE_IPSET        = 7,
+	STATE_IPSET_TYPE   = 8,
+	STATE_INCLUDE      = 9,
+};
+
+struct state_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t size;
+	/* layout of the structures stored as is */
+	uint16_t sizes[4];
+};
+
+struct state_record {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct state_zone {
+	uint32_t name;
+	uint32_t family;
+	uint32_t policy[3];
+	uint32_t flags[2];
+	uint8_t masq;
+	uint8_t mtu_fix;
+	uint8_t custom_chains;
+	uint8_t auto_helper;
+};
+
+struct state_ipset {
+	uint32_t name;
+	uint32_t family;
+	uint32_t method;
+	struct fw3_address iprange;
+	struct fw3_port portrange;
+};
+
+struct state_ipset_type {
+	uint32_t type;
+	uint32_t dst;
+};
+
+struct state_include {
+	uint32_t path;
+	uint32_t type;
+	int32_t mtime;
+	int32_t size;
+	char hash[33];
+};
+
+struct state_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+static const uint16_t state_sizes[4] = {
+	sizeof(struct fw3_defaults),
+	sizeof(struct fw3_device),
+	sizeof(struct fw3_address),
+	sizeof(struct fw3_port),
+};
+
+
+static void
+buf_add(struct state_buf *b, const void *data, size_t len)
+{
+	char *tmp;
+	size_t size;
+
+	if (b->failed)
+		return;
+
+	if (b->len + len > b->size)
+	{
+		size = b->size ? b->size : 1024;
+
+		while (size < b->len + len)
+			size *= 2;
+
+		if (!(tmp = realloc(b->data, size)))
+		{
+			b->failed = true;
+			return;
+		}
+
+		b->data = tmp;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+/*
+ * Appends a record of the given type. The fixed part is followed by pairs
+ * of an offset member within it and the string to store for it, the list
+ * is terminated by NULL.
+ */
+static void
+put_record(struct state_buf *b, uint32_t type, void *fixed, size_t len, ...)
+{
+	va_list ap;
+	uint32_t *off;
+	const char *str;
+	struct state_record rec = { .type = type, .len = len };
+
+	va_start(ap, len);
+
+	while ((off = va_arg(ap, uint32_t *)) != NULL)
+	{
+		str = va_arg(ap, const char *);
+		*off = rec.len;
+		rec.len += strlen(str ? str : "") + 1;
+	}
+
+	va_end(ap);
+
+	buf_add(b, &rec, sizeof(rec));
+	buf_add(b, fixed, len);
+
+	va_start(ap, len);
+
+	while ((off = va_arg(ap, uint32_t *)) != NULL)
+	{
+		str = va_arg(ap, const char *);
+		str = str ? str : "";
+		buf_add(b, str, strlen(str) + 1);
+	}
+
+	va_end(ap);
+}
+
+static void
+put_zone_addrs(struct state_buf *b, struct fw3_zone *z, struct ifaddrs *ifaddr)
+{
+	struct fw3_device *dev;
+	struct fw3_address addr;
+	struct ifaddrs *ifa;
+
+	list_for_each_entry(dev, &z->devices, list)
+	{
+		for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+		{
+			if (!ifa->ifa_addr || strcmp(dev->name, ifa->ifa_name))
+				continue;
+
+			memset(&addr, 0, sizeof(addr));
+			addr.set = true;
+
+			if (ifa->ifa_addr->sa_family == AF_INET)
+			{
+				addr.family = FW3_FAMILY_V4;
+				addr.address.v4 =
+					((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+			}
+			else if (ifa->ifa_addr->sa_family == AF_INET6)
+			{
+				addr.family = FW3_FAMILY_V6;
+				addr.address.v6 =
+					((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+			}
+			else
+			{
+				continue;
+			}
+
+			put_record(b, STATE_ZONE_ADDR, &addr, sizeof(addr), NULL);
+		}
+	}
+}
+
+static void
+put_zone(struct state_buf *b, struct fw3_zone *z, struct ifaddrs *ifaddr)
+{
+	struct fw3_device *dev, d;
+	struct fw3_address *sub, a;
+	struct state_zone rec = { .family = FW3_FAMILY_ANY };
+
+	if (!z->enabled)
+		return;
+
+	if (fw3_no_table(z->flags[0]) && !fw3_no_table(z->flags[1]))
+		rec.family = FW3_FAMILY_V6;
+	else if (!fw3_no_table(z->flags[0]) && fw3_no_table(z->flags[1]))
+		rec.family = FW3_FAMILY_V4;
+	else if (fw3_no_table(z->flags[0]) && fw3_no_table(z->flags[1]))
+		return;
+
+	rec.policy[0]     = z->policy_input;
+	rec.policy[1]     = z->policy_output;
+	rec.policy[2]     = z->policy_forward;
+	rec.flags[0]      = z->flags[0];
+	rec.flags[1]      = z->flags[1];
+	rec.masq          = z->masq;
+	rec.mtu_fix       = z->mtu_fix;
+	rec.custom_chains = z->custom_chains;
+	rec.auto_helper   = z->auto_helper;
+
+	put_record(b, STATE_ZONE, &rec, sizeof(rec), &rec.name, z->name, NULL);
+
+	list_for_each_entry(dev, &z->devices, list)
+	{
+		d = *dev;
+		memset(&d.list, 0, sizeof(d.list));
+		put_record(b, STATE_ZONE_DEVICE, &d, sizeof(d), NULL);
+	}
+
+	list_for_each_entry(dev, &z->networks, list)
+	{
+		d = *dev;
+		memset(&d.list, 0, sizeof(d.list));
+		put_record(b, STATE_ZONE_NETWORK, &d, sizeof(d), NULL);
+	}
+
+	list_for_each_entry(sub, &z->subnets, list)
+	{
+		a = *sub;
+		memset(&a.list, 0, sizeof(a.list));
+		put_record(b, STATE_ZONE_SUBNET, &a, sizeof(a), NULL);
+	}
+
+	put_zone_addrs(b, z, ifaddr);
+}
+
+static void
+put_ipset(struct state_buf *b, struct fw3_ipset *s)
+{
+	struct fw3_ipset_datatype *type;
+	struct state_ipset rec = { };
+	struct state_ipset_type t;
+
+	if (!s->enabled || s->external)
+		return;
+
+	rec.family    = s->family;
+	rec.method    = s->method;
+	rec.iprange   = s->iprange;
+	rec.portrange = s->portrange;
+
+	memset(&rec.iprange.list, 0, sizeof(rec.iprange.list));
+	memset(&rec.portrange.list, 0, sizeof(rec.portrange.list));
+
+	put_record(b, STATE_IPSET, &rec, sizeof(rec), &rec.name, s->name, NULL);
+
+	list_for_each_entry(type, &s->datatypes, list)
+	{
+		t.type = type->type;
+		t.dst  = !strcmp(type->dir, "dst");
+		put_record(b, STATE_IPSET_TYPE, &t, sizeof(t), NULL);
+	}
+}
+
+static void
+put_include(struct state_buf *b, struct fw3_include *inc)
+{
+	struct state_include rec = { };
+
+	/* only fingerprinted includes are of interest on reload */
+	if (!inc->hash[0])
+		return;
+
+	rec.type  = inc->type;
+	rec.mtime = inc->mtime;
+	rec.size  = inc->size;
+	memcpy(rec.hash, inc->hash, sizeof(rec.hash));
+
+	put_record(b, STATE_INCLUDE, &rec, sizeof(rec), &rec.path, inc->path, NULL);
+}
+
+void
+fw3_write_statefile(struct fw3_state *state)
+{
+	struct state_header hdr = { .magic = "fw3b" };
+	struct state_buf b = { };
+	struct fw3_defaults defs;
+	struct fw3_zone *z;
+	struct fw3_ipset *i;
+	struct fw3_include *inc;
+	struct ifaddrs *ifaddr;
+	char tmp[sizeof(FW3_STATEFILE) + 4];
+	bool written;
+	FILE *f;
+
+	if (fw3_no_family(state->defaults.flags[0]) &&
+	    fw3_no_family(state->defaults.flags[1]))
+	{
+		unlink(FW3_STATEFILE);
+		return;
+	}
+
+	if (getifaddrs(&ifaddr))
+	{
+		warn("Cannot get interface addresses: %s", strerror(errno));
+		ifaddr = NULL;
+	}
+
+	hdr.version = FW3_STATE_VERSION;
+	memcpy(hdr.sizes, state_sizes, sizeof(hdr.sizes));
+	buf_add(&b, &hdr, sizeof(hdr));
+
+	defs = state->defaults;
+	put_record(&b, STATE_DEFAULTS, &defs, sizeof(defs), NULL);
+
+	list_for_each_entry(z, &state->zones, list)
+		put_zone(&b, z, ifaddr);
+
+	list_for_each_entry(i, &state->ipsets, list)
+		put_ipset(&b, i);
+
+	list_for_each_entry(inc, &state->includes, list)
+		put_include(&b, inc);
+
+	if (ifaddr)
+		freeifaddrs(ifaddr);
+
+	if (b.failed)
+	{
+		warn("Cannot create state %s: %s", FW3_STATEFILE, strerror(ENOMEM));
+		goto out;
+	}
+
+	hdr.size = b.len;
+	memcpy(b.data, &hdr, sizeof(hdr));
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", FW3_STATEFILE);
+
+	if (!(f = fopen(tmp, "w")))
+	{
+		warn("Cannot create state %s: %s", tmp, strerror(errno));
+		goto out;
+	}
+
+	written = (fwrite(b.data, 1, b.len, f) == b.len &&
+	           !fflush(f) && !fsync(fileno(f)));
+
+	if (fclose(f) || !written || rename(tmp, FW3_STATEFILE))
+	{
+		warn("Cannot create state %s: %s", FW3_STATEFILE, strerror(errno));
+		unlink(tmp);
+	}
+
+out:
+	free(b.data);
+}
+
+
+/* returns the string at the given offset if it lies within the payload */
+static const char *
+get_string(const char *payload, uint32_t len, size_t fixed, uint32_t off)
+{
+	if (off < fixed || off >= len || !memchr(payload + off, 0, len - off))
+		return NULL;
+
+	return payload + off;
+}
+
+static bool
+read_records(struct fw3_state *state, const char *map, size_t size)
+{
+	struct state_record rec;
+	struct state_zone zr;
+	struct state_ipset ir;
+	struct state_ipset_type tr;
+	struct state_include nr;
+	struct fw3_zone *zone = NULL;
+	struct fw3_ipset *ipset = NULL;
+	struct fw3_include *inc;
+	struct fw3_ipset_datatype *type;
+	struct fw3_device *dev;
+	struct fw3_address *addr;
+	struct list_head *list;
+	const char *payload;
+	size_t off, elem;
+
+	for (off = sizeof(struct state_header); off < size; off += rec.len)
+	{
+		if (size - off < sizeof(rec))
+			return false;
+
+		memcpy(&rec, map + off, sizeof(rec));
+		off += sizeof(rec);
+
+		if (rec.len > size - off)
+			return false;
+
+		payload = map + off;
+
+		switch (rec.type)
+		{
+		case STATE_DEFAULTS:
+			if (rec.len != sizeof(state->defaults))
+				return false;
+
+			memcpy(&state->defaults, payload, rec.len);
+			break;
+
+		case STATE_ZONE:
+			if (rec.len < sizeof(zr))
+				return false;
+
+			memcpy(&zr, payload, sizeof(zr));
+
+			if (!(zone = fw3_alloc_zone()))
+				return false;
+
+			list_add_tail(&zone->list, &state->zones);
+
+			zone->name = get_string(payload, rec.len, sizeof(zr), zr.name);
+
+			if (!zone->name)
+				return false;
+
+			zone->node.key = zone->name;
+			avl_insert(&state->zone_index, &zone->node);
+
+			zone->family         = zr.family;
+			zone->policy_input   = zr.policy[0];
+			zone->policy_output  = zr.policy[1];
+			zone->policy_forward = zr.policy[2];
+			zone->flags[0]       = zr.flags[0];
+			zone->flags[1]       = zr.flags[1];
+			zone->masq           = zr.masq;
+			zone->mtu_fix        = zr.mtu_fix;
+			zone->custom_chains  = zr.custom_chains;
+			zone->auto_helper    = zr.auto_helper;
+			break;
+
+		case STATE_ZONE_DEVICE:
+		case STATE_ZONE_NETWORK:
+		case STATE_ZONE_SUBNET:
+		case STATE_ZONE_ADDR:
+			if (!zone)
+				return false;
+
+			if (rec.type == STATE_ZONE_DEVICE)
+				list = &zone->devices, elem = sizeof(*dev);
+			else if (rec.type == STATE_ZONE_NETWORK)
+				list = &zone->old_networks, elem = sizeof(*dev);
+			else if (rec.type == STATE_ZONE_SUBNET)
+				list = &zone->subnets, elem = sizeof(*addr);
+			else
+				list = &zone->old_addrs, elem = sizeof(*addr);
+
+			if (rec.len != elem || !(dev = fw3_slab_alloc(elem)))
+				return false;
+
+			/* device and address both begin with their list head */
+			memcpy(dev, payload, elem);
+			list_add_tail(&dev->list, list);
+			break;
+
+		case STATE_IPSET:
+			if (rec.len < sizeof(ir))
+				return false;
+
+			memcpy(&ir, payload, sizeof(ir));
+
+			if (!(ipset = fw3_alloc_ipset(state)))
+				return false;
+
+			ipset->name = get_string(payload, rec.len, sizeof(ir), ir.name);
+
+			if (!ipset->name)
+				return false;
+
+			ipset->node.key = ipset->name;
+			avl_insert(&state->ipset_index, &ipset->node);
+
+			ipset->family    = ir.family;
+			ipset->method    = ir.method;
+			ipset->iprange   = ir.iprange;
+			ipset->portrange = ir.portrange;
+			break;
+
+		case STATE_IPSET_TYPE:
+			if (!ipset || rec.len != sizeof(tr) ||
+			    !(type = fw3_slab_alloc(sizeof(*type))))
+				return false;
+
+			memcpy(&tr, payload, sizeof(tr));
+
+			type->type = tr.type;
+			type->dir  = tr.dst ? "dst" : "src";
+			list_add_tail(&type->list, &ipset->datatypes);
+			break;
+
+		case STATE_INCLUDE:
+			if (rec.len < sizeof(nr))
+				return false;
+
+			memcpy(&nr, payload, sizeof(nr));
+
+			if (!(inc = fw3_alloc_include(state)))
+				return false;
+
+			inc->path = get_string(payload, rec.len, sizeof(nr), nr.path);
+			inc->old_hash = get_string(payload, rec.len,
+			                           offsetof(struct state_include, hash),
+			                           offsetof(struct state_include, hash));
+
+			if (!inc->path || !inc->old_hash)
+				return false;
+
+			inc->type      = nr.type;
+			inc->old_mtime = nr.mtime;
+			inc->old_size  = nr.size;
+			break;
+
+		default:
+			/* records of later versions are skipped */
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void
+init_state(struct fw3_state *state)
+{
+	INIT_LIST_HEAD(&state->zones);
+	INIT_LIST_HEAD(&state->rules);
+	INIT_LIST_HEAD(&state->redirects);
+	INIT_LIST_HEAD(&state->snats);
+	INIT_LIST_HEAD(&state->forwards);
+	INIT_LIST_HEAD(&state->ipsets);
+	INIT_LIST_HEAD(&state->includes);
+	INIT_LIST_HEAD(&state->cthelpers);
+
+	avl_init(&state->zone_index, avl_strcmp, false, NULL);
+	avl_init(&state->ipset_index, avl_strcmp, false, NULL);
+	avl_init(&state->cthelper_index, avl_strcmp, false, NULL);
+}
+
+bool
+fw3_read_statefile(struct fw3_state *state)
+{
+	struct state_header hdr;
+	struct stat s;
+	char *map;
+	bool valid;
+	int fd;
+
+	init_state(state);
+
+	if ((fd = open(FW3_STATEFILE, O_RDONLY)) < 0)
+		return false;
+
+	if (fstat(fd, &s) || s.st_size < (off_t)sizeof(hdr))
+	{
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	memcpy(&hdr, map, sizeof(hdr));
+
+	/* the objects read belong to the state slab like loaded ones */
+	fw3_slab_use(&state->slab);
+
+	valid = (!memcmp(hdr.magic, "fw3b", 4) &&
+	         hdr.version == FW3_STATE_VERSION &&
+	         hdr.size == s.st_size &&
+	         !memcmp(hdr.sizes, state_sizes, sizeof(hdr.sizes)) &&
+	         read_records(state, map, s.st_size));
+
+	fw3_slab_use(NULL);
+
+	if (!valid)
+	{
+		warn("Ignoring unreadable state %s", FW3_STATEFILE);
+		fw3_slab_free(&state->slab);
+		memset(&state->defaults, 0, sizeof(state->defaults));
+		init_state(state);
+		munmap(map, s.st_size);
+		return false;
+	}
+
+	state->state_map = map;
+	state->state_map_size = s.st_size;
+	state->statefile = true;
+
+	return true;
+}
+
+void
+fw3_free_statefile(struct fw3_state *state)
+{
+	if (state->state_map)
+		munmap(state->state_map, state->state_map_size);
+
+	state->state_map = NULL;
+	state->state_map_size = 0;
+}
+
+
+static void
+dump_flags(uint32_t *flags)
+{
+	printf("\toption __flags_v4 '0x%x'\n", flags[0]);
+	printf("\toption __flags_v6 '0x%x'\n", flags[1]);
+}
+
+static void
+dump_zone(struct fw3_zone *z)
+{
+	struct fw3_device *dev;
+	struct fw3_address *addr;
+
+	printf("\nconfig zone\n");
+	printf("\toption name '%s'\n", z->name);
+	printf("\toption input '%s'\n", fw3_flag_names[z->policy_input]);
+	printf("\toption output '%s'\n", fw3_flag_names[z->policy_output]);
+	printf("\toption forward '%s'\n", fw3_flag_names[z->policy_forward]);
+	printf("\toption masq '%d'\n", z->masq);
+	printf("\toption mtu_fix '%d'\n", z->mtu_fix);
+	printf("\toption custom_chains '%d'\n", z->custom_chains);
+
+	if (z->family != FW3_FAMILY_ANY)
+		printf("\toption family '%s'\n", fw3_flag_names[z->family]);
+
+	list_for_each_entry(dev, &z->devices, list)
+	{
+		if (*dev->network)
+			printf("\tlist device '%s%s@%s'\n",
+			       dev->invert ? "!" : "", dev->name, dev->network);
+		else
+			printf("\tlist device '%s%s'\n",
+			       dev->invert ? "!" : "", dev->any ? "*" : dev->name);
+	}
+
+	list_for_each_entry(addr, &z->subnets, list)
+		printf("\tlist subnet '%s'\n", fw3_address_to_string(addr, true, false));
+
+	list_for_each_entry(dev, &z->old_networks, list)
+		printf("\tlist __networks '%s%s'\n", dev->invert ? "!" : "", dev->name);
+
+	list_for_each_entry(addr, &z->old_addrs, list)
+		printf("\tlist __addrs '%s'\n", fw3_address_to_string(addr, false, false));
+
+	dump_flags(z->flags);
+}
+
+static void
+dump_ipset(struct fw3_ipset *s)
+{
+	struct fw3_ipset_datatype *type;
+
+	printf("\nconfig ipset\n");
+	printf("\toption name '%s'\n", s->name);
+	printf("\toption family '%s'\n", fw3_flag_names[s->family]);
+	printf("\toption storage '%s'\n", fw3_ipset_method_names[s->method]);
+
+	list_for_each_entry(type, &s->datatypes, list)
+		printf("\tlist match '%s_%s'\n",
+		       type->dir, fw3_ipset_type_names[type->type]);
+
+	if (s->iprange.set)
+		printf("\toption iprange '%s'\n",
+		       fw3_address_to_string(&s->iprange, false, false));
+
+	if (s->portrange.set)
+		printf("\toption portrange '%u-%u'\n",
+		       s->portrange.port_min, s->portrange.port_max);
+}
+
+/* prints the state file in the format of the former text state */
+int
+fw3_dump_statefile(void)
+{
+	struct fw3_state state = { };
+	struct fw3_defaults *d = &state.defaults;
+	struct fw3_zone *z;
+	struct fw3_ipset *i;
+	struct fw3_include *inc;
+
+	if (!fw3_read_statefile(&state))
+		return 1;
+
+	printf("\nconfig defaults\n");
+	printf("\toption input '%s'\n", fw3_flag_names[d->policy_input]);
+	printf("\toption output '%s'\n", fw3_flag_names[d->policy_output]);
+	printf("\toption forward '%s'\n", fw3_flag_names[d->policy_forward]);
+
+	if (d->hotplug_workers)
+		printf("\toption hotplug_workers '%d'\n", d->hotplug_workers);
+
+	if (d->hotplug_timeout)
+		printf("\toption hotplug_timeout '%d'\n", d->hotplug_timeout);
+
+	dump_flags(d->flags);
+
+	list_for_each_entry(z, &state.zones, list)
+		dump_zone(z);
+
+	list_for_each_entry(i, &state.ipsets, list)
+		dump_ipset(i);
+
+	list_for_each_entry(inc, &state.includes, list)
+	{
+		printf("\nconfig include\n");
+		printf("\toption path '%s'\n", inc->path);
+		printf("\toption type '%s'\n",
+		       (inc->type == FW3_INC_TYPE_RESTORE) ? "restore" : "script");
+		printf("\toption __hash '%s'\n", inc->old_hash);
+		printf("\toption __mtime '%d'\n", inc->old_mtime);
+		printf("\toption __size '%d'\n", inc->old_size);
+	}
+
+	printf("\n");
+
+	fw3_slab_free(&state.slab);
+	fw3_free_statefile(&state);
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * firewall3 - 3rd OpenWrt UCI firewall implementation
+ *
+ *   Copyright (C) 2013 Jo-Philipp Wich <jo@mein.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <inttypes.h>
+
+#include "stats.h"
+#include "iptables.h"
+
+
+/*
+ * The counters of the rules fw3 generated are summed up per comment, which
+ * names the rule, redirect or nat section the rule originates from, or a
+ * builtin purpose like "Zone lan MTU fixing". Rules without a comment are
+ * the jumps between fw3's own chains and not reported.
+ */
+struct stats_counter {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct stats_entry {
+	struct avl_node node;
+	unsigned int rules;
+	struct stats_counter family[2];
+	char name[];
+};
+
+static const char *stats_families[2] = { "ipv4", "ipv6" };
+
+
+static void
+count_rule(struct fw3_ipt_handle *h, const struct fw3_ipt_tagged *t,
+           void *priv)
+{
+	struct avl_tree *tree = priv;
+	struct stats_entry *e;
+	int f = (h->family == FW3_FAMILY_V6);
+
+	if (!*t->comment)
+		return;
+
+	e = avl_find_element(tree, t->comment, e, node);
+
+	if (!e)
+	{
+		e = calloc(1, sizeof(*e) + strlen(t->comment) + 1);
+
+		if (!e)
+			return;
+
+		strcpy(e->name, t->comment);
+		e->node.key = e->name;
+		avl_insert(tree, &e->node);
+	}
+
+	e->rules++;
+	e->family[f].packets += t->packets;
+	e->family[f].bytes += t->bytes;
+}
+
+static void
+print_json_string(const char *s)
+{
+	putchar('"');
+
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+
+	putchar('"');
+}
+
+static void
+print_json(struct avl_tree *tree)
+{
+	struct stats_entry *e;
+	bool first = true;
+	int f;
+
+	printf("{\n\t\"sections\": [");
+
+	avl_for_each_element(tree, e, node)
+	{
+		printf("%s\n\t\t{ \"name\": ", first ? "" : ",");
+		print_json_string(e->name);
+		printf(", \"rules\": %u, \"packets\": %" PRIu64 ", \"bytes\": %" PRIu64,
+		       e->rules,
+		       e->family[0].packets + e->family[1].packets,
+		       e->family[0].bytes + e->family[1].bytes);
+
+		for (f = 0; f < 2; f++)
+			printf(", \"%s\": { \"packets\": %" PRIu64 ", \"bytes\": %" PRIu64 " }",
+			       stats_families[f], e->family[f].packets, e->family[f].bytes);
+
+		printf(" }");
+		first = false;
+	}
+
+	printf("%s]\n}\n", first ? "" : "\n\t");
+}
+
+static void
+print_label(const char *s)
+{
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if (*s == '\n')
+			printf("\\n");
+		else
+			putchar(*s);
+	}
+}
+
+static void
+print_prometheus_counter(struct avl_tree *tree, const char *metric,
+                         const char *help, bool bytes)
+{
+	struct stats_entry *e;
+	int f;
+
+	printf("# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+
+	avl_for_each_element(tree, e, node)
+	{
+		for (f = 0; f < 2; f++)
+		{
+			printf("%s{section=\"", metric);
+			print_label(e->name);
+			printf("\",family=\"%s\"} %" PRIu64 "\n", stats_families[f],
+			       bytes ? e->family[f].bytes : e->family[f].packets);
+		}
+	}
+}
+
+static void
+print_prometheus(struct avl_tree *tree)
+{
+	struct stats_entry *e;
+
+	print_prometheus_counter(tree, "fw3_section_packets_total",
+		"Packets matched by the rules generated from a section.", false);
+	print_prometheus_counter(tree, "fw3_section_bytes_total",
+		"Bytes matched by the rules generated from a section.", true);
+
+	printf("# HELP fw3_section_rules Rules generated from a section.\n"
+	       "# TYPE fw3_section_rules gauge\n");
+
+	avl_for_each_element(tree, e, node)
+	{
+		printf("fw3_section_rules{section=\"");
+		print_label(e->name);
+		printf("\"} %u\n", e->rules);
+	}
+}
+
+/*
+ * Prints the counters of the rules currently loaded, as JSON by default or
+ * in the Prometheus text format. Only reads the tables, so it neither takes
+ * the lock nor needs the configuration.
+ */
+int
+fw3_stats(const char *format)
+{
+	enum fw3_family family;
+	enum fw3_table table;
+	struct fw3_ipt_handle *handle;
+	struct stats_entry *e, *tmp;
+	struct avl_tree tree;
+	bool prometheus;
+
+	if (!format || !strcmp(format, "json"))
+		prometheus = false;
+	else if (!strcmp(format, "prometheus"))
+		prometheus = true;
+	else
+		return 1;
+
+	avl_init(&tree, avl_strcmp, false, NULL);
+
+	for (family = FW3_FAMILY_V4; family <= FW3_FAMILY_V6; family++)
+	{
+		for (table = FW3_TABLE_FILTER; table <= FW3_TABLE_RAW; table++)
+		{
+			if (!fw3_has_table(family == FW3_FAMILY_V6, fw3_flag_names[table]))
+				continue;
+
+			if (!(handle = fw3_ipt_open(family, table)))
+				continue;
+
+			fw3_ipt_foreach_tagged(handle, count_rule, &tree);
+			fw3_ipt_close(handle);
+		}
+	}
+
+	if (prometheus)
+		print_prometheus(&tree);
+	else
+		print_json(&tree);
+
+	avl_remove_all_elements(&tree, e, node, tmp)
+		free(e);
+
+	return 0;
+}
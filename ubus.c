@@ -18,8 +18,40 @@
 
 #include "ubus.h"
 
+static struct ubus_context *ctx = NULL;
 static struct blob_attr *interfaces = NULL;
-static struct blob_attr *procd_data;
+static struct blob_attr *procd_data = NULL;
+
+static struct ubus_request dump_req, data_req;
+static bool dump_pending = false;
+static bool data_pending = false;
+static struct timespec req_start;
+
+/*
+ * The interface dump is parsed once after it got fetched; the lookups below
+ * then only walk a hash chain instead of parsing every dump entry again for
+ * each network of each zone.
+ */
+struct iface_node {
+	struct iface_node *next;
+	struct iface_node *zone_next;
+	const char *name;
+	const char *device;
+	const char *zone;
+	struct blob_attr *addrs[3];
+};
+
+static struct {
+	unsigned int mask;
+	struct iface_node **buckets;
+	struct iface_node **zone_buckets;
+	struct iface_node *nodes;
+} iface_index;
+
+static struct ubus_context *event_ctx = NULL;
+static struct ubus_event_handler event_handler;
+static void (*event_cb)(const char *net) = NULL;
+static bool event_lost = false;
 
 
 static void dump_cb(struct ubus_request *req, int type, struct blob_attr *msg)
@@ -37,47 +69,342 @@ static void procd_data_cb(struct ubus_request *req, int type, struct blob_attr *
 	procd_data = blob_memdup(msg);
 }
 
+static unsigned int
+iface_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)name; *p; p++)
+		h = (h ^ *p) * 16777619u;
+
+	return h;
+}
+
+static void
+iface_index_free(void)
+{
+	free(iface_index.buckets);
+	free(iface_index.zone_buckets);
+	free(iface_index.nodes);
+	memset(&iface_index, 0, sizeof(iface_index));
+}
+
+static void
+iface_index_build(void)
+{
+	enum {
+		IFACE_INTERFACE,
+		IFACE_DEVICE,
+		IFACE_L3_DEVICE,
+		IFACE_IPV4,
+		IFACE_IPV6,
+		IFACE_IPV6_PREFIX,
+		IFACE_DATA,
+		__IFACE_MAX
+	};
+	static const struct blobmsg_policy policy[__IFACE_MAX] = {
+		[IFACE_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
+		[IFACE_DEVICE] = { "device", BLOBMSG_TYPE_STRING },
+		[IFACE_L3_DEVICE] = { "l3_device", BLOBMSG_TYPE_STRING },
+		[IFACE_IPV4] = { "ipv4-address", BLOBMSG_TYPE_ARRAY },
+		[IFACE_IPV6] = { "ipv6-address", BLOBMSG_TYPE_ARRAY },
+		[IFACE_IPV6_PREFIX] = { "ipv6-prefix-assignment", BLOBMSG_TYPE_ARRAY },
+		[IFACE_DATA] = { "data", BLOBMSG_TYPE_TABLE },
+	};
+	static const struct blobmsg_policy zone_policy =
+		{ "zone", BLOBMSG_TYPE_STRING };
+	struct blob_attr *tb[__IFACE_MAX];
+	struct blob_attr *cur, *zone;
+	struct iface_node *node;
+	unsigned int n = 0, size = 16, h;
+	int rem;
+
+	if (!interfaces)
+		return;
+
+	blobmsg_for_each_attr(cur, interfaces, rem)
+		n++;
+
+	while (size < n * 2)
+		size <<= 1;
+
+	iface_index.mask = size - 1;
+	iface_index.buckets = calloc(size, sizeof(*iface_index.buckets));
+	iface_index.zone_buckets = calloc(size, sizeof(*iface_index.zone_buckets));
+	iface_index.nodes = calloc(n ? n : 1, sizeof(*iface_index.nodes));
+
+	if (!iface_index.buckets || !iface_index.zone_buckets || !iface_index.nodes)
+	{
+		iface_index_free();
+		return;
+	}
+
+	node = iface_index.nodes;
+
+	blobmsg_for_each_attr(cur, interfaces, rem) {
+		blobmsg_parse(policy, __IFACE_MAX, tb, blobmsg_data(cur), blobmsg_len(cur));
+
+		if (!tb[IFACE_INTERFACE])
+			continue;
+
+		node->name = blobmsg_data(tb[IFACE_INTERFACE]);
+
+		if (tb[IFACE_L3_DEVICE])
+			node->device = blobmsg_data(tb[IFACE_L3_DEVICE]);
+		else if (tb[IFACE_DEVICE])
+			node->device = blobmsg_data(tb[IFACE_DEVICE]);
+
+		node->addrs[0] = tb[IFACE_IPV4];
+		node->addrs[1] = tb[IFACE_IPV6];
+		node->addrs[2] = tb[IFACE_IPV6_PREFIX];
+
+		if (tb[IFACE_DATA])
+		{
+			blobmsg_parse(&zone_policy, 1, &zone,
+			              blobmsg_data(tb[IFACE_DATA]),
+			              blobmsg_len(tb[IFACE_DATA]));
+
+			if (zone)
+				node->zone = blobmsg_data(zone);
+		}
+
+		node++;
+	}
+
+	n = node - iface_index.nodes;
+
+	/* link back to front, so that the chains keep the order of the dump */
+	while (n-- > 0)
+	{
+		node = &iface_index.nodes[n];
+		h = iface_hash(node->name) & iface_index.mask;
+		node->next = iface_index.buckets[h];
+		iface_index.buckets[h] = node;
+
+		if (!node->zone)
+			continue;
+
+		h = iface_hash(node->zone) & iface_index.mask;
+		node->zone_next = iface_index.zone_buckets[h];
+		iface_index.zone_buckets[h] = node;
+	}
+}
+
+static struct iface_node *
+iface_lookup(const char *net)
+{
+	struct iface_node *node;
+
+	if (!iface_index.buckets)
+		return NULL;
+
+	for (node = iface_index.buckets[iface_hash(net) & iface_index.mask];
+	     node; node = node->next)
+		if (!strcmp(node->name, net))
+			return node;
+
+	return NULL;
+}
+
+/*
+ * The connection is kept open after the data has been fetched, so that a
+ * long running instance does not pay for the connection setup again on
+ * every command. A kept connection may have gone stale if ubusd restarted
+ * in the meanwhile, in that case reconnect once.
+ *
+ * Both requests are only sent here, fw3_ubus_complete() waits for their
+ * replies. This lets the caller parse the configuration while netifd and
+ * procd are answering and bounds the wait by the slower of the two.
+ */
 bool
-fw3_ubus_connect(void)
+fw3_ubus_request(void)
 {
 	bool status = false;
+	bool reused;
 	uint32_t id;
-	struct ubus_context *ctx = ubus_connect(NULL);
 	struct blob_buf b = { };
 
+	fw3_ubus_disconnect();
 	blob_buf_init(&b, 0);
+	clock_gettime(CLOCK_MONOTONIC, &req_start);
 
-	if (!ctx)
-		goto out;
+again:
+	reused = !!ctx;
 
-	if (ubus_lookup_id(ctx, "network.interface", &id))
+	if (!ctx && !(ctx = ubus_connect(NULL)))
 		goto out;
 
-	if (ubus_invoke(ctx, id, "dump", b.head, dump_cb, NULL, 2000))
+	if (ubus_lookup_id(ctx, "network.interface", &id) ||
+	    ubus_invoke_async(ctx, id, "dump", b.head, &dump_req))
+	{
+		fw3_ubus_close();
+
+		if (reused)
+			goto again;
+
 		goto out;
+	}
 
+	dump_req.data_cb = dump_cb;
+	dump_pending = true;
 	status = true;
 
 	if (ubus_lookup_id(ctx, "service", &id))
 		goto out;
 
 	blobmsg_add_string(&b, "type", "firewall");
-	ubus_invoke(ctx, id, "get_data", b.head, procd_data_cb, NULL, 2000);
+
+	if (ubus_invoke_async(ctx, id, "get_data", b.head, &data_req))
+		goto out;
+
+	data_req.data_cb = procd_data_cb;
+	data_pending = true;
 
 out:
 	blob_buf_free(&b);
 
-	if (ctx)
-		ubus_free(ctx);
+	return status;
+}
+
+static int
+complete_request(struct ubus_request *req, bool *pending)
+{
+	struct timespec now;
+	int rv, timeout;
+
+	if (!*pending)
+		return UBUS_STATUS_NO_DATA;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	timeout = FW3_UBUS_TIMEOUT -
+	          ((now.tv_sec - req_start.tv_sec) * 1000 +
+	           (now.tv_nsec - req_start.tv_nsec) / 1000000);
+
+	/* a reply which already arrived is processed without waiting */
+	rv = ubus_complete_request(ctx, req, (timeout > 0) ? timeout : 1);
+	*pending = false;
+
+	return rv;
+}
+
+bool
+fw3_ubus_complete(void)
+{
+	bool status;
+
+	if (!ctx || !dump_pending)
+		return false;
+
+	status = !complete_request(&dump_req, &dump_pending);
+	complete_request(&data_req, &data_pending);
+
+	if (status)
+		iface_index_build();
 
 	return status;
 }
 
+bool
+fw3_ubus_connect(void)
+{
+	return fw3_ubus_request() && fw3_ubus_complete();
+}
+
 void
 fw3_ubus_disconnect(void)
 {
+	if (dump_pending)
+		ubus_abort_request(ctx, &dump_req);
+
+	if (data_pending)
+		ubus_abort_request(ctx, &data_req);
+
+	dump_pending = data_pending = false;
+
+	iface_index_free();
+
 	free(interfaces);
 	interfaces = NULL;
+
+	free(procd_data);
+	procd_data = NULL;
+}
+
+void
+fw3_ubus_close(void)
+{
+	fw3_ubus_disconnect();
+
+	if (ctx)
+		ubus_free(ctx);
+
+	ctx = NULL;
+}
+
+static void
+interface_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                   const char *type, struct blob_attr *msg)
+{
+	static const struct blobmsg_policy policy = { "interface", BLOBMSG_TYPE_STRING };
+	struct blob_attr *cur;
+
+	blobmsg_parse(&policy, 1, &cur, blob_data(msg), blob_len(msg));
+
+	if (cur && event_cb)
+		event_cb(blobmsg_get_string(cur));
+}
+
+static void
+event_connection_lost(struct ubus_context *ctx)
+{
+	event_lost = true;
+}
+
+/*
+ * Subscribe to the network.interface events of netifd on a connection of
+ * its own, so events never arrive in the middle of a synchronous request.
+ * Returns the descriptor to poll, reconnecting if the connection got lost,
+ * or -1 if ubus is not available.
+ */
+int
+fw3_ubus_subscribe(void (*cb)(const char *net))
+{
+	if (event_ctx && !event_lost)
+		return event_ctx->sock.fd;
+
+	if (event_ctx)
+		ubus_free(event_ctx);
+
+	event_cb = cb;
+	event_lost = false;
+	event_ctx = ubus_connect(NULL);
+
+	if (!event_ctx)
+		return -1;
+
+	event_ctx->connection_lost = event_connection_lost;
+
+	memset(&event_handler, 0, sizeof(event_handler));
+	event_handler.cb = interface_event_cb;
+
+	if (ubus_register_event_handler(event_ctx, &event_handler,
+	                                "network.interface"))
+	{
+		ubus_free(event_ctx);
+		event_ctx = NULL;
+		return -1;
+	}
+
+	return event_ctx->sock.fd;
+}
+
+void
+fw3_ubus_handle_events(void)
+{
+	if (event_ctx && !event_lost)
+		ubus_handle_event(event_ctx);
 }
 
 static struct fw3_address *
@@ -86,7 +413,7 @@ parse_subnet(enum fw3_family family, struct blob_attr *dict, int rem)
 	struct blob_attr *cur;
 	struct fw3_address *addr;
 
-	addr = calloc(1, sizeof(*addr));
+	addr = fw3_slab_alloc(sizeof(*addr));
 	if (!addr)
 		return NULL;
 
@@ -136,51 +463,25 @@ parse_subnets(struct list_head *head, enum fw3_family family,
 struct fw3_device *
 fw3_ubus_device(const char *net)
 {
-	enum {
-		DEV_INTERFACE,
-		DEV_DEVICE,
-		DEV_L3_DEVICE,
-		__DEV_MAX
-	};
-	static const struct blobmsg_policy policy[__DEV_MAX] = {
-		[DEV_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
-		[DEV_DEVICE] = { "device", BLOBMSG_TYPE_STRING },
-		[DEV_L3_DEVICE] = { "l3_device", BLOBMSG_TYPE_STRING },
-	};
 	struct fw3_device *dev = NULL;
-	struct blob_attr *tb[__DEV_MAX];
-	struct blob_attr *cur;
-	char *name = NULL;
-	int rem;
+	struct iface_node *node;
 
-	if (!net || !interfaces)
+	if (!net)
 		return NULL;
 
-	blobmsg_for_each_attr(cur, interfaces, rem) {
-		blobmsg_parse(policy, __DEV_MAX, tb, blobmsg_data(cur), blobmsg_len(cur));
-		if (!tb[DEV_INTERFACE] ||
-		    strcmp(blobmsg_data(tb[DEV_INTERFACE]), net) != 0)
-			continue;
+	for (node = iface_lookup(net); node; node = node->next)
+		if (node->device && !strcmp(node->name, net))
+			break;
 
-		if (tb[DEV_L3_DEVICE])
-			name = blobmsg_data(tb[DEV_L3_DEVICE]);
-		else if (tb[DEV_DEVICE])
-			name = blobmsg_data(tb[DEV_DEVICE]);
-		else
-			continue;
-
-		break;
-	}
-
-	if (!name)
+	if (!node)
 		return NULL;
 
-	dev = calloc(1, sizeof(*dev));
+	dev = fw3_slab_alloc(sizeof(*dev));
 
 	if (!dev)
 		return NULL;
 
-	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	snprintf(dev->name, sizeof(dev->name), "%s", node->device);
 	dev->set = true;
 
 	return dev;
@@ -189,36 +490,20 @@ fw3_ubus_device(const char *net)
 int
 fw3_ubus_address(struct list_head *list, const char *net)
 {
-	enum {
-		ADDR_INTERFACE,
-		ADDR_IPV4,
-		ADDR_IPV6,
-		ADDR_IPV6_PREFIX,
-		__ADDR_MAX
-	};
-	static const struct blobmsg_policy policy[__ADDR_MAX] = {
-		[ADDR_INTERFACE] = { "interface", BLOBMSG_TYPE_STRING },
-		[ADDR_IPV4] = { "ipv4-address", BLOBMSG_TYPE_ARRAY },
-		[ADDR_IPV6] = { "ipv6-address", BLOBMSG_TYPE_ARRAY },
-		[ADDR_IPV6_PREFIX] = { "ipv6-prefix-assignment", BLOBMSG_TYPE_ARRAY },
-	};
-	struct blob_attr *tb[__ADDR_MAX];
-	struct blob_attr *cur;
-	int rem, n = 0;
+	struct iface_node *node;
+	int n = 0;
 
-	if (!net || !interfaces)
+	if (!net)
 		return 0;
 
-	blobmsg_for_each_attr(cur, interfaces, rem) {
-		blobmsg_parse(policy, __ADDR_MAX, tb, blobmsg_data(cur), blobmsg_len(cur));
-
-		if (!tb[ADDR_INTERFACE] ||
-		    strcmp(blobmsg_data(tb[ADDR_INTERFACE]), net) != 0)
+	for (node = iface_lookup(net); node; node = node->next)
+	{
+		if (strcmp(node->name, net))
 			continue;
 
-		n += parse_subnets(list, FW3_FAMILY_V4, tb[ADDR_IPV4]);
-		n += parse_subnets(list, FW3_FAMILY_V6, tb[ADDR_IPV6]);
-		n += parse_subnets(list, FW3_FAMILY_V6, tb[ADDR_IPV6_PREFIX]);
+		n += parse_subnets(list, FW3_FAMILY_V4, node->addrs[0]);
+		n += parse_subnets(list, FW3_FAMILY_V6, node->addrs[1]);
+		n += parse_subnets(list, FW3_FAMILY_V6, node->addrs[2]);
 	}
 
 	return n;
@@ -227,27 +512,15 @@ fw3_ubus_address(struct list_head *list, const char *net)
 void
 fw3_ubus_zone_devices(struct fw3_zone *zone)
 {
-	struct blob_attr *c, *cur, *dcur;
-	unsigned r, rem, drem;
-	const char *name;
-	bool matches;
-
-	blobmsg_for_each_attr(c, interfaces, r) {
-		name = NULL;
-		matches = false;
+	struct iface_node *node;
 
-		blobmsg_for_each_attr(cur, c, rem) {
-			if (!strcmp(blobmsg_name(cur), "interface"))
-				name = blobmsg_get_string(cur);
-			else if (!strcmp(blobmsg_name(cur), "data"))
-				blobmsg_for_each_attr(dcur, cur, drem)
-					if (!strcmp(blobmsg_name(dcur), "zone"))
-						matches = !strcmp(blobmsg_get_string(dcur), zone->name);
-		}
+	if (!iface_index.zone_buckets)
+		return;
 
-		if (name && matches)
-			fw3_parse_device(&zone->networks, name, true);
-	}
+	for (node = iface_index.zone_buckets[iface_hash(zone->name) & iface_index.mask];
+	     node; node = node->zone_next)
+		if (!strcmp(node->zone, zone->name))
+			fw3_parse_device(&zone->networks, node->name, true);
 }
 
 static void fw3_ubus_rules_add(struct blob_buf *b, const char *service,
@@ -24,9 +24,18 @@
 
 #include "options.h"
 
+/* upper bound for awaiting the replies of netifd and procd */
+#define FW3_UBUS_TIMEOUT 2000
 
+
+bool fw3_ubus_request(void);
+bool fw3_ubus_complete(void);
 bool fw3_ubus_connect(void);
 void fw3_ubus_disconnect(void);
+void fw3_ubus_close(void);
+
+int fw3_ubus_subscribe(void (*cb)(const char *net));
+void fw3_ubus_handle_events(void);
 
 struct fw3_device * fw3_ubus_device(const char *net);
 
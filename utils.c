@@ -18,22 +18,41 @@
 
 #define _GNU_SOURCE
 
-#include <net/if.h>
-#include <sys/ioctl.h>
-
 #include "utils.h"
 #include "options.h"
 
 #include "zones.h"
 #include "ipsets.h"
+#include "conntrack.h"
+#include "probe.h"
+#include "daemon.h"
 
 
 static int lock_fd = -1;
 static pid_t pipe_pid = -1;
 static FILE *pipe_fd = NULL;
+static void (*pipe_sigpipe)(int) = SIG_DFL;
 
 bool fw3_pr_debug = false;
 
+/* messages of sections parsed off the main thread are collected per thread */
+static __thread FILE *log_capture = NULL;
+
+static FILE *
+log_stream(void)
+{
+	return log_capture ? log_capture : stderr;
+}
+
+FILE *
+fw3_log_capture(FILE *stream)
+{
+	FILE *prev = log_capture;
+
+	log_capture = stream;
+	return prev;
+}
+
 
 static void
 warn_elem_section_name(struct uci_section *s, bool find_name)
@@ -55,7 +74,7 @@ warn_elem_section_name(struct uci_section *s, bool find_name)
 			i++;
 		}
 
-		fprintf(stderr, "@%s[%d]", s->type, i);
+		fprintf(log_stream(), "@%s[%d]", s->type, i);
 
 		if (find_name)
 		{
@@ -65,7 +84,7 @@ warn_elem_section_name(struct uci_section *s, bool find_name)
 
 				if (!strcmp(tmp->name, "name") && (o->type == UCI_TYPE_STRING))
 				{
-					fprintf(stderr, " (%s)", o->v.string);
+					fprintf(log_stream(), " (%s)", o->v.string);
 					break;
 				}
 			}
@@ -73,11 +92,11 @@ warn_elem_section_name(struct uci_section *s, bool find_name)
 	}
 	else
 	{
-		fprintf(stderr, "'%s'", s->e.name);
+		fprintf(log_stream(), "'%s'", s->e.name);
 	}
 
 	if (find_name)
-		fprintf(stderr, " ");
+		fprintf(log_stream(), " ");
 }
 
 void
@@ -85,33 +104,33 @@ warn_elem(struct uci_element *e, const char *format, ...)
 {
 	if (e->type == UCI_TYPE_SECTION)
 	{
-		fprintf(stderr, "Warning: Section ");
+		fprintf(log_stream(), "Warning: Section ");
 		warn_elem_section_name(uci_to_section(e), true);
 	}
 	else if (e->type == UCI_TYPE_OPTION)
 	{
-		fprintf(stderr, "Warning: Option ");
+		fprintf(log_stream(), "Warning: Option ");
 		warn_elem_section_name(uci_to_option(e)->section, false);
-		fprintf(stderr, ".%s ", e->name);
+		fprintf(log_stream(), ".%s ", e->name);
 	}
 
     va_list argptr;
     va_start(argptr, format);
-    vfprintf(stderr, format, argptr);
+    vfprintf(log_stream(), format, argptr);
     va_end(argptr);
 
-	fprintf(stderr, "\n");
+	fprintf(log_stream(), "\n");
 }
 
 void
 warn(const char* format, ...)
 {
-	fprintf(stderr, "Warning: ");
+	fprintf(log_stream(), "Warning: ");
     va_list argptr;
     va_start(argptr, format);
-    vfprintf(stderr, format, argptr);
+    vfprintf(log_stream(), format, argptr);
     va_end(argptr);
-	fprintf(stderr, "\n");
+	fprintf(log_stream(), "\n");
 }
 
 void
@@ -132,9 +151,9 @@ info(const char* format, ...)
 {
 	va_list argptr;
     va_start(argptr, format);
-    vfprintf(stderr, format, argptr);
+    vfprintf(log_stream(), format, argptr);
     va_end(argptr);
-	fprintf(stderr, "\n");
+	fprintf(log_stream(), "\n");
 }
 
 void *
@@ -163,45 +182,148 @@ fw3_strdup(const char *s)
 	return ns;
 }
 
-const char *
-fw3_find_command(const char *cmd)
+/*
+ * List elements created while loading a state are carved from chunks of
+ * the state's slab, which are only given back when the state is freed.
+ * Each allocation is preceded by a header telling heap memory, taken while
+ * no slab is in use, from slab memory when single elements are released.
+ * The slab in use is chosen per thread, workers parsing sections carve
+ * from their own and merge it afterwards.
+ */
+struct slab_hdr {
+	bool heap;
+} __attribute__((aligned(16)));
+
+struct slab_chunk {
+	struct list_head list;
+	struct fw3_slab *slab;
+	size_t size;
+	char data[] __attribute__((aligned(16)));
+};
+
+static LIST_HEAD(slab_chunks);
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct fw3_slab *slab_current = NULL;
+
+#define FW3_SLAB_MIN	(16 * 1024)
+#define FW3_SLAB_MAX	(1024 * 1024)
+
+struct fw3_slab *
+fw3_slab_use(struct fw3_slab *slab)
 {
-	struct stat s;
-	int plen = 0, clen = strlen(cmd) + 1;
-	char *search, *p;
-	static char path[PATH_MAX];
+	struct fw3_slab *prev = slab_current;
 
-	if (!stat(cmd, &s) && S_ISREG(s.st_mode))
-		return cmd;
+	slab_current = slab;
+	return prev;
+}
 
-	search = getenv("PATH");
+void *
+fw3_slab_alloc(size_t size)
+{
+	struct fw3_slab *slab = slab_current;
+	struct slab_chunk *chunk;
+	struct slab_hdr *hdr;
+	size_t csize;
 
-	if (!search)
-		search = "/bin:/usr/bin:/sbin:/usr/sbin";
+	if (!slab)
+	{
+		if (!(hdr = calloc(1, sizeof(*hdr) + size)))
+			return NULL;
+
+		hdr->heap = true;
+		return hdr + 1;
+	}
 
-	p = search;
+	size = sizeof(*hdr) + ((size + 15) & ~(size_t)15);
 
-	do
+	if (size > slab->left)
 	{
-		if (*p != ':' && *p != '\0')
-			continue;
+		csize = slab->next ? slab->next : FW3_SLAB_MIN;
 
-		plen = p - search;
+		while (csize < size)
+			csize *= 2;
 
-		if ((plen + clen) >= sizeof(path))
-			continue;
+		if (!(chunk = calloc(1, sizeof(*chunk) + csize)))
+			return NULL;
 
-		strncpy(path, search, plen);
-		sprintf(path + plen, "/%s", cmd);
+		chunk->slab = slab;
+		chunk->size = csize;
 
-		if (!stat(path, &s) && S_ISREG(s.st_mode))
-			return path;
+		pthread_mutex_lock(&slab_lock);
+		list_add(&chunk->list, &slab_chunks);
+		pthread_mutex_unlock(&slab_lock);
 
-		search = p + 1;
+		slab->cur = chunk->data;
+		slab->left = csize;
+		slab->next = (csize < FW3_SLAB_MAX) ? csize * 2 : csize;
 	}
-	while (*p++);
 
-	return NULL;
+	/* chunks are zeroed, so the header marks slab memory already */
+	hdr = (struct slab_hdr *)slab->cur;
+	slab->cur += size;
+	slab->left -= size;
+
+	return hdr + 1;
+}
+
+/* gives back memory of fw3_slab_alloc(), slab memory goes with its slab */
+void
+fw3_slab_release(void *ptr)
+{
+	struct slab_hdr *hdr = (struct slab_hdr *)ptr - 1;
+
+	if (ptr && hdr->heap)
+		free(hdr);
+}
+
+/* hands the chunks of src over to dst, they are freed along with dst */
+void
+fw3_slab_merge(struct fw3_slab *dst, struct fw3_slab *src)
+{
+	struct slab_chunk *chunk;
+
+	pthread_mutex_lock(&slab_lock);
+
+	list_for_each_entry(chunk, &slab_chunks, list)
+		if (chunk->slab == src)
+			chunk->slab = dst;
+
+	pthread_mutex_unlock(&slab_lock);
+
+	if (slab_current == src)
+		slab_current = dst;
+
+	memset(src, 0, sizeof(*src));
+}
+
+void
+fw3_slab_free(struct fw3_slab *slab)
+{
+	struct slab_chunk *chunk, *tmp;
+
+	pthread_mutex_lock(&slab_lock);
+
+	list_for_each_entry_safe(chunk, tmp, &slab_chunks, list)
+	{
+		if (chunk->slab != slab)
+			continue;
+
+		list_del(&chunk->list);
+		free(chunk);
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+
+	if (slab_current == slab)
+		slab_current = NULL;
+
+	memset(slab, 0, sizeof(*slab));
+}
+
+const char *
+fw3_find_command(const char *cmd)
+{
+	return fw3_probe_command(cmd);
 }
 
 bool
@@ -273,7 +395,7 @@ __fw3_command_pipe(bool silent, const char *command, ...)
 		execv(command, args);
 
 	default:
-		signal(SIGPIPE, SIG_IGN);
+		pipe_sigpipe = signal(SIGPIPE, SIG_IGN);
 		pipe_pid = pid;
 		close(pfds[0]);
 		fcntl(pfds[1], F_SETFD, fcntl(pfds[1], F_GETFD) | FD_CLOEXEC);
@@ -301,47 +423,32 @@ fw3_pr(const char *fmt, ...)
 	va_end(args);
 }
 
-void
+bool
 fw3_command_close(void)
 {
+	int status = 0;
+
 	if (pipe_fd && pipe_fd != stdout)
 		fclose(pipe_fd);
 
 	if (pipe_pid > -1)
-		waitpid(pipe_pid, NULL, 0);
+	{
+		if (waitpid(pipe_pid, &status, 0) < 0)
+			status = -1;
 
-	signal(SIGPIPE, SIG_DFL);
+		signal(SIGPIPE, pipe_sigpipe);
+	}
 
 	pipe_fd = NULL;
 	pipe_pid = -1;
+
+	return (WIFEXITED(status) && !WEXITSTATUS(status));
 }
 
 bool
 fw3_has_table(bool ipv6, const char *table)
 {
-	FILE *f;
-
-	char line[12];
-	bool seen = false;
-
-	const char *path = ipv6
-		? "/proc/net/ip6_tables_names" : "/proc/net/ip_tables_names";
-
-	if (!(f = fopen(path, "r")))
-		return false;
-
-	while (fgets(line, sizeof(line), f))
-	{
-		if (!strncmp(line, table, strlen(table)))
-		{
-			seen = true;
-			break;
-		}
-	}
-
-	fclose(f);
-
-	return seen;
+	return fw3_probe_table(ipv6, table);
 }
 
 
@@ -381,302 +488,6 @@ fw3_unlock(void)
 }
 
 
-static void
-write_defaults_uci(struct uci_context *ctx, struct fw3_defaults *d,
-                   struct uci_package *dest)
-{
-	char buf[sizeof("0xffffffff\0")];
-	struct uci_ptr ptr = { .p = dest };
-
-	uci_add_section(ctx, dest, "defaults", &ptr.s);
-
-	ptr.o      = NULL;
-	ptr.option = "input";
-	ptr.value  = fw3_flag_names[d->policy_input];
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "output";
-	ptr.value  = fw3_flag_names[d->policy_output];
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "forward";
-	ptr.value  = fw3_flag_names[d->policy_forward];
-	uci_set(ctx, &ptr);
-
-	sprintf(buf, "0x%x", d->flags[0]);
-	ptr.o      = NULL;
-	ptr.option = "__flags_v4";
-	ptr.value  = buf;
-	uci_set(ctx, &ptr);
-
-	sprintf(buf, "0x%x", d->flags[1]);
-	ptr.o      = NULL;
-	ptr.option = "__flags_v6";
-	ptr.value  = buf;
-	uci_set(ctx, &ptr);
-}
-
-static void
-write_zone_uci(struct uci_context *ctx, struct fw3_zone *z,
-               struct uci_package *dest, struct ifaddrs *ifaddr)
-{
-	struct fw3_device *dev;
-	struct fw3_address *sub;
-	struct ifaddrs *ifa;
-	enum fw3_family fam = FW3_FAMILY_ANY;
-
-	char *p, buf[INET6_ADDRSTRLEN];
-
-	struct uci_ptr ptr = { .p = dest };
-
-	if (!z->enabled)
-		return;
-
-	if (fw3_no_table(z->flags[0]) && !fw3_no_table(z->flags[1]))
-		fam = FW3_FAMILY_V6;
-	else if (!fw3_no_table(z->flags[0]) && fw3_no_table(z->flags[1]))
-		fam = FW3_FAMILY_V4;
-	else if (fw3_no_table(z->flags[0]) && fw3_no_table(z->flags[1]))
-		return;
-
-	uci_add_section(ctx, dest, "zone", &ptr.s);
-
-	ptr.o      = NULL;
-	ptr.option = "name";
-	ptr.value  = z->name;
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "input";
-	ptr.value  = fw3_flag_names[z->policy_input];
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "output";
-	ptr.value  = fw3_flag_names[z->policy_output];
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "forward";
-	ptr.value  = fw3_flag_names[z->policy_forward];
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "masq";
-	ptr.value  = z->masq ? "1" : "0";
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "mtu_fix";
-	ptr.value  = z->mtu_fix ? "1" : "0";
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "custom_chains";
-	ptr.value  = z->custom_chains ? "1" : "0";
-	uci_set(ctx, &ptr);
-
-	if (fam != FW3_FAMILY_ANY)
-	{
-		ptr.o      = NULL;
-		ptr.option = "family";
-		ptr.value  = fw3_flag_names[fam];
-		uci_set(ctx, &ptr);
-	}
-
-	ptr.o      = NULL;
-	ptr.option = "device";
-
-	fw3_foreach(dev, &z->devices)
-	{
-		char *ep;
-
-		if (!dev)
-			continue;
-
-		p = buf;
-		ep = buf + sizeof(buf);
-
-		if (dev->invert)
-			p += snprintf(p, ep - p, "!");
-
-		if (*dev->network)
-			p += snprintf(p, ep - p, "%s@%s", dev->name, dev->network);
-		else
-			p += snprintf(p, ep - p, "%s", dev->name);
-
-		ptr.value = buf;
-		uci_add_list(ctx, &ptr);
-	}
-
-	ptr.o      = NULL;
-	ptr.option = "subnet";
-
-	fw3_foreach(sub, &z->subnets)
-	{
-		if (!sub)
-			continue;
-
-		ptr.value = fw3_address_to_string(sub, true, false);
-		uci_add_list(ctx, &ptr);
-	}
-
-	ptr.o      = NULL;
-	ptr.option = "__addrs";
-
-	fw3_foreach(dev, &z->devices)
-	{
-		if (!dev)
-			continue;
-
-		for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
-		{
-			if (!ifa->ifa_addr || strcmp(dev->name, ifa->ifa_name))
-				continue;
-
-			if (ifa->ifa_addr->sa_family == AF_INET)
-				inet_ntop(AF_INET,
-				          &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr,
-				          buf, sizeof(buf));
-			else if (ifa->ifa_addr->sa_family == AF_INET6)
-				inet_ntop(AF_INET6,
-				          &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr,
-				          buf, sizeof(buf));
-			else
-				continue;
-
-			ptr.value = buf;
-			uci_add_list(ctx, &ptr);
-		}
-	}
-
-	sprintf(buf, "0x%x", z->flags[0]);
-	ptr.o      = NULL;
-	ptr.option = "__flags_v4";
-	ptr.value  = buf;
-	uci_set(ctx, &ptr);
-
-	sprintf(buf, "0x%x", z->flags[1]);
-	ptr.o      = NULL;
-	ptr.option = "__flags_v6";
-	ptr.value  = buf;
-	uci_set(ctx, &ptr);
-}
-
-static void
-write_ipset_uci(struct uci_context *ctx, struct fw3_ipset *s,
-                struct uci_package *dest)
-{
-	struct fw3_ipset_datatype *type;
-
-	char buf[sizeof("65535-65535\0")];
-
-	struct uci_ptr ptr = { .p = dest };
-
-	if (!s->enabled || s->external)
-		return;
-
-	uci_add_section(ctx, dest, "ipset", &ptr.s);
-
-	ptr.o      = NULL;
-	ptr.option = "name";
-	ptr.value  = s->name;
-	uci_set(ctx, &ptr);
-
-	ptr.o      = NULL;
-	ptr.option = "storage";
-	ptr.value  = fw3_ipset_method_names[s->method];
-	uci_set(ctx, &ptr);
-
-	list_for_each_entry(type, &s->datatypes, list)
-	{
-		sprintf(buf, "%s_%s", type->dir, fw3_ipset_type_names[type->type]);
-		ptr.o      = NULL;
-		ptr.option = "match";
-		ptr.value  = buf;
-		uci_add_list(ctx, &ptr);
-	}
-
-	if (s->iprange.set)
-	{
-		ptr.o      = NULL;
-		ptr.option = "iprange";
-		ptr.value  = fw3_address_to_string(&s->iprange, false, false);
-		uci_set(ctx, &ptr);
-	}
-
-	if (s->portrange.set)
-	{
-		sprintf(buf, "%u-%u", s->portrange.port_min, s->portrange.port_max);
-		ptr.o      = NULL;
-		ptr.option = "portrange";
-		ptr.value  = buf;
-		uci_set(ctx, &ptr);
-	}
-}
-
-void
-fw3_write_statefile(void *state)
-{
-	FILE *sf;
-	struct fw3_state *s = state;
-	struct fw3_zone *z;
-	struct fw3_ipset *i;
-	struct ifaddrs *ifaddr;
-
-	struct uci_package *p;
-
-	if (fw3_no_family(s->defaults.flags[0]) &&
-	    fw3_no_family(s->defaults.flags[1]))
-	{
-		unlink(FW3_STATEFILE);
-	}
-	else
-	{
-		sf = fopen(FW3_STATEFILE, "w+");
-
-		if (!sf)
-		{
-			warn("Cannot create state %s: %s", FW3_STATEFILE, strerror(errno));
-			return;
-		}
-
-		if (getifaddrs(&ifaddr))
-		{
-			warn("Cannot get interface addresses: %s", strerror(errno));
-			ifaddr = NULL;
-		}
-
-		if ((p = uci_lookup_package(s->uci, "fw3_state")) != NULL)
-			uci_unload(s->uci, p);
-
-		uci_import(s->uci, sf, "fw3_state", NULL, true);
-
-		if ((p = uci_lookup_package(s->uci, "fw3_state")) != NULL)
-		{
-			write_defaults_uci(s->uci, &s->defaults, p);
-
-			list_for_each_entry(z, &s->zones, list)
-				write_zone_uci(s->uci, z, p, ifaddr);
-
-			list_for_each_entry(i, &s->ipsets, list)
-				write_ipset_uci(s->uci, i, p);
-
-			uci_export(s->uci, sf, p, true);
-			uci_unload(s->uci, p);
-		}
-
-		fsync(fileno(sf));
-		fclose(sf);
-
-		if (ifaddr)
-			freeifaddrs(ifaddr);
-	}
-}
-
-
 void
 fw3_free_object(void *obj, const void *opts)
 {
@@ -692,11 +503,11 @@ fw3_free_object(void *obj, const void *opts)
 		list_for_each_safe(cur, tmp, list)
 		{
 			list_del(cur);
-			free(cur);
+			fw3_slab_release(cur);
 		}
 	}
 
-	free(obj);
+	fw3_slab_release(obj);
 }
 
 void
@@ -710,40 +521,55 @@ fw3_free_list(struct list_head *head)
 	list_for_each_safe(entry, tmp, head)
 	{
 		list_del(entry);
-		free(entry);
+		fw3_slab_release(entry);
 	}
 
 	free(head);
 }
 
-bool
+pid_t
 fw3_hotplug(bool add, void *zone, void *device)
 {
+	pid_t pid;
+	sigset_t chld;
+	bool direct;
 	struct fw3_zone *z = zone;
 	struct fw3_device *d = device;
 
 	if (!*d->network)
-		return false;
+		return 0;
 
-	switch (fork())
+	switch ((pid = fork()))
 	{
 	case -1:
 		warn("Unable to fork(): %s\n", strerror(errno));
-		return false;
+		return 0;
 
 	case 0:
 		break;
 
 	default:
-		return true;
+		return pid;
 	}
 
+	/* the caller may block SIGCHLD to wait for us, do not pass that on */
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &chld, NULL);
+
 	close(0);
 	close(1);
 	close(2);
 	if (chdir("/")) {};
 
+	/* keep a handler calling fw3 from waiting on the daemon running us */
+	direct = !!getenv(FW3_DIRECT_ENV);
+
 	clearenv();
+
+	if (direct)
+		setenv(FW3_DIRECT_ENV, "1", 1);
+
 	setenv("ACTION",    add ? "add" : "remove", 1);
 	setenv("ZONE",      z->name,                1);
 	setenv("INTERFACE", d->network,             1);
@@ -752,7 +578,83 @@ fw3_hotplug(bool add, void *zone, void *device)
 	execl(FW3_HOTPLUG, FW3_HOTPLUG, "firewall", NULL);
 
 	/* unreached */
-	return false;
+	return 0;
+}
+
+/*
+ * Reap up to "want" of the n child processes in pids, giving up after
+ * timeout milliseconds or waiting indefinitely if timeout is negative.
+ * Other children are left alone. Reaped pids are removed by moving the
+ * last ones into their place. The caller must have SIGCHLD blocked so that
+ * exits are queued rather than lost. Returns the number of reaped children.
+ */
+int
+fw3_wait_children(pid_t *pids, int n, int want, int timeout)
+{
+	int i, reaped = 0;
+	sigset_t chld;
+	struct timespec now, end, ts;
+
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec  += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000;
+
+	if (end.tv_nsec >= 1000000000)
+	{
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000;
+	}
+
+	if (want > n)
+		want = n;
+
+	while (reaped < want)
+	{
+		for (i = 0; i < n && reaped < want; )
+		{
+			/* also drop pids somebody else reaped already */
+			if (waitpid(pids[i], NULL, WNOHANG) != 0)
+			{
+				pids[i] = pids[--n];
+				reaped++;
+			}
+			else
+			{
+				i++;
+			}
+		}
+
+		if (reaped >= want)
+			break;
+
+		if (timeout < 0)
+		{
+			sigwaitinfo(&chld, NULL);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		ts.tv_sec  = end.tv_sec - now.tv_sec;
+		ts.tv_nsec = end.tv_nsec - now.tv_nsec;
+
+		if (ts.tv_nsec < 0)
+		{
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000;
+		}
+
+		if (ts.tv_sec < 0)
+			break;
+
+		if (sigtimedwait(&chld, NULL, &ts) < 0 && errno == EAGAIN)
+			break;
+	}
+
+	return reaped;
 }
 
 int
@@ -816,29 +718,161 @@ fw3_bitlen2netmask(int family, int bits, void *mask)
 	return true;
 }
 
+static void
+flush_conntrack_proc(const struct fw3_address **addrs, int n_addrs)
+{
+	int i;
+	FILE *ct;
+	char buf[INET6_ADDRSTRLEN];
+
+	if ((ct = fopen("/proc/net/nf_conntrack", "w")) == NULL)
+		return;
+
+	if (!addrs)
+		fwrite("f\n", 1, 2, ct);
+
+	for (i = 0; i < n_addrs; i++)
+	{
+		inet_ntop(addrs[i]->family == FW3_FAMILY_V4 ? AF_INET : AF_INET6,
+		          &addrs[i]->address.v4, buf, sizeof(buf));
+
+		fprintf(ct, "%s\n", buf);
+	}
+
+	fclose(ct);
+}
+
+struct ifaddr_node {
+	struct ifaddr_node *next;
+	const char *ifname;
+	enum fw3_family family;
+	const void *addr;
+};
+
+struct ifaddr_index {
+	unsigned int mask;
+	struct ifaddr_node **buckets;
+	struct ifaddr_node *nodes;
+};
+
+static unsigned int
+ifaddr_hash(const char *ifname, enum fw3_family family, const void *addr)
+{
+	unsigned int i, h = 2166136261u;
+	const unsigned char *p;
+	size_t len = (family == FW3_FAMILY_V4) ? 4 : 16;
+
+	for (p = (const unsigned char *)ifname; *p; p++)
+		h = (h ^ *p) * 16777619u;
+
+	h = (h ^ family) * 16777619u;
+
+	for (i = 0, p = addr; i < len; i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+static bool
+ifaddr_index_build(struct ifaddr_index *idx, struct ifaddrs *ifaddr)
+{
+	unsigned int n = 0, size = 16, h;
+	struct ifaddrs *ifa;
+	struct ifaddr_node *node;
+
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+		n++;
+
+	while (size < n * 2)
+		size <<= 1;
+
+	idx->mask = size - 1;
+	idx->buckets = calloc(size, sizeof(*idx->buckets));
+	idx->nodes = calloc(n ? n : 1, sizeof(*idx->nodes));
+
+	if (!idx->buckets || !idx->nodes)
+	{
+		free(idx->buckets);
+		free(idx->nodes);
+		return false;
+	}
+
+	for (ifa = ifaddr, node = idx->nodes; ifa; ifa = ifa->ifa_next)
+	{
+		if (!ifa->ifa_addr)
+			continue;
+
+		if (ifa->ifa_addr->sa_family == AF_INET)
+		{
+			node->family = FW3_FAMILY_V4;
+			node->addr = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+		}
+		else if (ifa->ifa_addr->sa_family == AF_INET6)
+		{
+			node->family = FW3_FAMILY_V6;
+			node->addr = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		}
+		else
+		{
+			continue;
+		}
+
+		node->ifname = ifa->ifa_name;
+
+		h = ifaddr_hash(node->ifname, node->family, node->addr) & idx->mask;
+		node->next = idx->buckets[h];
+		idx->buckets[h] = node;
+		node++;
+	}
+
+	return true;
+}
+
+static bool
+ifaddr_index_has(struct ifaddr_index *idx, const char *ifname,
+                 struct fw3_address *addr)
+{
+	struct ifaddr_node *node;
+	size_t len = (addr->family == FW3_FAMILY_V4) ? 4 : 16;
+	unsigned int h = ifaddr_hash(ifname, addr->family, &addr->address.v6);
+
+	for (node = idx->buckets[h & idx->mask]; node; node = node->next)
+		if (node->family == addr->family &&
+		    !memcmp(node->addr, &addr->address.v6, len) &&
+		    !strcmp(node->ifname, ifname))
+			return true;
+
+	return false;
+}
+
+static void
+ifaddr_index_free(struct ifaddr_index *idx)
+{
+	free(idx->buckets);
+	free(idx->nodes);
+}
+
 void
 fw3_flush_conntrack(void *state)
 {
 	bool found;
+	int n_addrs = 0, n_alloc = 0;
 	struct fw3_state *s = state;
 	struct fw3_address *addr;
+	const struct fw3_address **addrs = NULL, **tmp;
 	struct fw3_device *dev;
 	struct fw3_zone *zone;
-	struct ifaddrs *ifaddr, *ifa;
-	struct sockaddr_in *sin;
-	struct sockaddr_in6 *sin6;
+	struct ifaddrs *ifaddr;
+	struct ifaddr_index idx;
+	struct fw3_ct_filter filter = { };
 	char buf[INET6_ADDRSTRLEN];
-	FILE *ct;
 
 	if (!state)
 	{
-		if ((ct = fopen("/proc/net/nf_conntrack", "w")) != NULL)
-		{
-			info(" * Flushing conntrack table ...");
+		info(" * Flushing conntrack table ...");
 
-			fwrite("f\n", 1, 2, ct);
-			fclose(ct);
-		}
+		if (!fw3_ct_flush())
+			flush_conntrack_proc(NULL, 0);
 
 		return;
 	}
@@ -849,55 +883,63 @@ fw3_flush_conntrack(void *state)
 		return;
 	}
 
-	if ((ct = fopen("/proc/net/nf_conntrack", "w")) != NULL)
+	if (!ifaddr_index_build(&idx, ifaddr))
 	{
-		list_for_each_entry(zone, &s->zones, list)
-		list_for_each_entry(addr, &zone->old_addrs, list)
+		freeifaddrs(ifaddr);
+		return;
+	}
+
+	list_for_each_entry(zone, &s->zones, list)
+	list_for_each_entry(addr, &zone->old_addrs, list)
+	{
+		found = false;
+
+		if (addr->family != FW3_FAMILY_V4 && addr->family != FW3_FAMILY_V6)
+			continue;
+
+		list_for_each_entry(dev, &zone->devices, list)
 		{
-			found = false;
+			found = ifaddr_index_has(&idx, dev->name, addr);
 
-			list_for_each_entry(dev, &zone->devices, list)
-			{
-				for (ifa = ifaddr; ifa && !found; ifa = ifa->ifa_next)
-				{
-					if (!ifa->ifa_addr || strcmp(dev->name, ifa->ifa_name))
-						continue;
-
-					sin = (struct sockaddr_in *)ifa->ifa_addr;
-					sin6 = (struct sockaddr_in6 *)ifa->ifa_addr;
-
-					if (addr->family == FW3_FAMILY_V4 &&
-						sin->sin_family == AF_INET)
-					{
-						found = !memcmp(&addr->address.v4, &sin->sin_addr,
-										sizeof(sin->sin_addr));
-					}
-					else if (addr->family == FW3_FAMILY_V6 &&
-							 sin6->sin6_family == AF_INET6)
-					{
-						found = !memcmp(&addr->address.v6, &sin6->sin6_addr,
-										sizeof(sin6->sin6_addr));
-					}
-				}
+			if (found)
+				break;
+		}
 
-				if (found)
-					break;
-			}
+		if (found)
+			continue;
 
-			if (!found)
-			{
-				inet_ntop(addr->family == FW3_FAMILY_V4 ? AF_INET : AF_INET6,
-						  &addr->address.v4, buf, sizeof(buf));
+		if (n_addrs >= n_alloc)
+		{
+			tmp = realloc(addrs, (n_alloc + 16) * sizeof(*addrs));
 
-				info(" * Flushing conntrack: %s", buf);
-				fprintf(ct, "%s\n", buf);
-			}
+			if (!tmp)
+				break;
+
+			addrs = tmp;
+			n_alloc += 16;
 		}
 
-		fclose(ct);
+		inet_ntop(addr->family == FW3_FAMILY_V4 ? AF_INET : AF_INET6,
+				  &addr->address.v4, buf, sizeof(buf));
+
+		info(" * Flushing conntrack: %s", buf);
+		addrs[n_addrs++] = addr;
 	}
 
+	ifaddr_index_free(&idx);
 	freeifaddrs(ifaddr);
+
+	if (n_addrs > 0)
+	{
+		filter.addrs = addrs;
+		filter.n_addrs = n_addrs;
+
+		/* fall back to the legacy proc interface without ctnetlink */
+		if (fw3_ct_delete(&filter) < 0)
+			flush_conntrack_proc(addrs, n_addrs);
+	}
+
+	free(addrs);
 }
 
 bool fw3_attr_parse_name_type(struct blob_attr *entry, const char **name, const char **type)
@@ -943,26 +985,7 @@ fw3_protoname(void *proto)
 bool
 fw3_check_loopback_dev(const char *name)
 {
-	struct ifreq ifr;
-	int s;
-	bool rv = false;
-
-	s = socket(AF_LOCAL, SOCK_DGRAM, 0);
-
-	if (s < 0)
-		return false;
-
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
-
-	if (ioctl(s, SIOCGIFFLAGS, &ifr) >= 0) {
-		if (ifr.ifr_flags & IFF_LOOPBACK)
-			rv = true;
-	}
-
-	close(s);
-
-	return rv;
+	return fw3_probe_loopback(name);
 }
 
 bool
@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include <libubox/list.h>
 #include <libubox/blob.h>
@@ -41,6 +42,9 @@
 #define FW3_LOCKFILE	"/var/run/fw3.lock"
 #define FW3_HELPERCONF	"/usr/share/fw3/helpers.conf"
 #define FW3_HOTPLUG     "/sbin/hotplug-call"
+#define FW3_SOCKFILE	"/var/run/fw3.sock"
+#define FW3_CONFIG	"/etc/config/firewall"
+#define FW3_CONFIGDELTA	"/tmp/.uci/firewall"
 
 extern bool fw3_pr_debug;
 
@@ -51,6 +55,8 @@ void warn(const char *format, ...);
 void error(const char *format, ...);
 void info(const char *format, ...);
 
+FILE * fw3_log_capture(FILE *stream);
+
 
 #define warn_section(t, r, e, fmt, ...)					\
 	do {									\
@@ -89,13 +95,26 @@ void info(const char *format, ...);
 void * fw3_alloc(size_t size);
 char * fw3_strdup(const char *s);
 
+/* bump allocator for list elements, released as a whole */
+struct fw3_slab {
+	char *cur;
+	size_t left;
+	size_t next;
+};
+
+struct fw3_slab * fw3_slab_use(struct fw3_slab *slab);
+void * fw3_slab_alloc(size_t size);
+void fw3_slab_release(void *ptr);
+void fw3_slab_merge(struct fw3_slab *dst, struct fw3_slab *src);
+void fw3_slab_free(struct fw3_slab *slab);
+
 const char * fw3_find_command(const char *cmd);
 
 bool fw3_stdout_pipe(void);
 bool __fw3_command_pipe(bool silent, const char *command, ...);
 #define fw3_command_pipe(...) __fw3_command_pipe(__VA_ARGS__, NULL)
 
-void fw3_command_close(void);
+bool fw3_command_close(void);
 void fw3_pr(const char *fmt, ...);
 
 bool fw3_has_table(bool ipv6, const char *table);
@@ -104,13 +123,13 @@ bool fw3_lock(void);
 void fw3_unlock(void);
 
 
-void fw3_write_statefile(void *state);
-
 void fw3_free_object(void *obj, const void *opts);
 
 void fw3_free_list(struct list_head *head);
 
-bool fw3_hotplug(bool add, void *zone, void *device);
+pid_t fw3_hotplug(bool add, void *zone, void *device);
+
+int fw3_wait_children(pid_t *pids, int n, int want, int timeout);
 
 int fw3_netmask2bitlen(int family, void *mask);
 
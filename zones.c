@@ -94,6 +94,7 @@ const struct fw3_option fw3_zone_opts[] = {
 	FW3_OPT("__flags_v6",          int,      zone,     flags[1]),
 
 	FW3_LIST("__addrs",            address,  zone,     old_addrs),
+	FW3_LIST("__networks",         device,   zone,     old_networks),
 
 	{ }
 };
@@ -199,7 +200,7 @@ fw3_alloc_zone(void)
 {
 	struct fw3_zone *zone;
 
-	zone = calloc(1, sizeof(*zone));
+	zone = fw3_slab_alloc(sizeof(*zone));
 	if (!zone)
 		return NULL;
 
@@ -211,6 +212,7 @@ fw3_alloc_zone(void)
 	INIT_LIST_HEAD(&zone->cthelpers);
 
 	INIT_LIST_HEAD(&zone->old_addrs);
+	INIT_LIST_HEAD(&zone->old_networks);
 
 	zone->enabled = true;
 	zone->auto_helper = true;
@@ -220,120 +222,136 @@ fw3_alloc_zone(void)
 	return zone;
 }
 
-void
-fw3_load_zones(struct fw3_state *state, struct uci_package *p)
+static struct fw3_zone *
+load_zone(struct fw3_state *state, struct uci_element *e)
 {
-	struct uci_section *s;
-	struct uci_element *e;
+	struct uci_section *s = uci_to_section(e);
 	struct fw3_zone *zone;
 	struct fw3_defaults *defs = &state->defaults;
 
-	INIT_LIST_HEAD(&state->zones);
+	zone = fw3_alloc_zone();
 
-	uci_foreach_element(&p->sections, e)
+	if (!zone)
+		return NULL;
+
+	if (!fw3_parse_options(zone, fw3_zone_opts, s))
+		warn_elem(e, "has invalid options");
+
+	if (!zone->enabled)
 	{
-		s = uci_to_section(e);
+		fw3_free_zone(zone);
+		return NULL;
+	}
 
-		if (strcmp(s->type, "zone"))
-			continue;
+	if (!zone->extra_dest)
+		zone->extra_dest = zone->extra_src;
 
-		zone = fw3_alloc_zone();
+	if (!defs->custom_chains && zone->custom_chains)
+		zone->custom_chains = false;
 
-		if (!zone)
-			continue;
+	if (!defs->auto_helper && zone->auto_helper)
+		zone->auto_helper = false;
 
-		if (!fw3_parse_options(zone, fw3_zone_opts, s))
-			warn_elem(e, "has invalid options");
+	if (!zone->name || !*zone->name)
+	{
+		warn_elem(e, "has no name - ignoring");
+		fw3_free_zone(zone);
+		return NULL;
+	}
 
-		if (!zone->enabled)
-		{
-			fw3_free_zone(zone);
-			continue;
-		}
+	if (strlen(zone->name) > FW3_ZONE_MAXNAMELEN)
+	{
+		warn_elem(e, "must not have a name longer than %u characters",
+		             FW3_ZONE_MAXNAMELEN);
+		fw3_free_zone(zone);
+		return NULL;
+	}
 
-		if (!zone->extra_dest)
-			zone->extra_dest = zone->extra_src;
+	fw3_ubus_zone_devices(zone);
 
-		if (!defs->custom_chains && zone->custom_chains)
-			zone->custom_chains = false;
+	if (list_empty(&zone->networks) && list_empty(&zone->devices) &&
+	    list_empty(&zone->subnets) && !zone->extra_src)
+	{
+		warn_elem(e, "has no device, network, subnet or extra options");
+	}
 
-		if (!defs->auto_helper && zone->auto_helper)
-			zone->auto_helper = false;
+	if (!check_masq_addrs(&zone->masq_src))
+	{
+		warn_elem(e, "has unresolved masq_src, disabling masq");
+		zone->masq = false;
+	}
 
-		if (!zone->name || !*zone->name)
-		{
-			warn_elem(e, "has no name - ignoring");
-			fw3_free_zone(zone);
-			continue;
-		}
+	if (!check_masq_addrs(&zone->masq_dest))
+	{
+		warn_elem(e, "has unresolved masq_dest, disabling masq");
+		zone->masq = false;
+	}
 
-		if (strlen(zone->name) > FW3_ZONE_MAXNAMELEN)
-		{
-			warn_elem(e, "must not have a name longer than %u characters",
-			             FW3_ZONE_MAXNAMELEN);
-			fw3_free_zone(zone);
-			continue;
-		}
+	check_policy(e, &zone->policy_input, defs->policy_input, "input");
+	check_policy(e, &zone->policy_output, defs->policy_output, "output");
+	check_policy(e, &zone->policy_forward, defs->policy_forward, "forward");
 
-		fw3_ubus_zone_devices(zone);
+	resolve_networks(e, zone);
 
-		if (list_empty(&zone->networks) && list_empty(&zone->devices) &&
-		    list_empty(&zone->subnets) && !zone->extra_src)
-		{
-			warn_elem(e, "has no device, network, subnet or extra options");
-		}
+	if (zone->masq)
+	{
+		fw3_setbit(zone->flags[0], FW3_FLAG_SNAT);
+	}
 
-		if (!check_masq_addrs(&zone->masq_src))
-		{
-			warn_elem(e, "has unresolved masq_src, disabling masq");
-			zone->masq = false;
-		}
+	if (zone->custom_chains)
+	{
+		fw3_setbit(zone->flags[0], FW3_FLAG_SNAT);
+		fw3_setbit(zone->flags[0], FW3_FLAG_DNAT);
+	}
 
-		if (!check_masq_addrs(&zone->masq_dest))
-		{
-			warn_elem(e, "has unresolved masq_dest, disabling masq");
-			zone->masq = false;
-		}
+	resolve_cthelpers(state, e, zone);
 
-		check_policy(e, &zone->policy_input, defs->policy_input, "input");
-		check_policy(e, &zone->policy_output, defs->policy_output, "output");
-		check_policy(e, &zone->policy_forward, defs->policy_forward, "forward");
+	fw3_setbit(zone->flags[0], fw3_to_src_target(zone->policy_input));
+	fw3_setbit(zone->flags[0], zone->policy_forward);
+	fw3_setbit(zone->flags[0], zone->policy_output);
 
-		resolve_networks(e, zone);
+	fw3_setbit(zone->flags[1], fw3_to_src_target(zone->policy_input));
+	fw3_setbit(zone->flags[1], zone->policy_forward);
+	fw3_setbit(zone->flags[1], zone->policy_output);
 
-		if (zone->masq)
-		{
-			fw3_setbit(zone->flags[0], FW3_FLAG_SNAT);
-		}
+	return zone;
+}
 
-		if (zone->custom_chains)
-		{
-			fw3_setbit(zone->flags[0], FW3_FLAG_SNAT);
-			fw3_setbit(zone->flags[0], FW3_FLAG_DNAT);
-		}
+void
+fw3_load_zones(struct fw3_state *state, struct uci_package *p)
+{
+	struct uci_section *s;
+	struct uci_element *e;
+	struct fw3_zone *zone;
 
-		resolve_cthelpers(state, e, zone);
+	INIT_LIST_HEAD(&state->zones);
+	avl_init(&state->zone_index, avl_strcmp, false, NULL);
 
-		fw3_setbit(zone->flags[0], fw3_to_src_target(zone->policy_input));
-		fw3_setbit(zone->flags[0], zone->policy_forward);
-		fw3_setbit(zone->flags[0], zone->policy_output);
+	uci_foreach_element(&p->sections, e)
+	{
+		s = uci_to_section(e);
+
+		if (strcmp(s->type, "zone"))
+			continue;
 
-		fw3_setbit(zone->flags[1], fw3_to_src_target(zone->policy_input));
-		fw3_setbit(zone->flags[1], zone->policy_forward);
-		fw3_setbit(zone->flags[1], zone->policy_output);
+		zone = load_zone(state, e);
+
+		if (!zone)
+			continue;
 
 		list_add_tail(&zone->list, &state->zones);
+
+		zone->node.key = zone->name;
+		avl_insert(&state->zone_index, &zone->node);
 	}
 }
 
 
 static void
-print_zone_chain(struct fw3_ipt_handle *handle, struct fw3_state *state,
-                 bool reload, struct fw3_zone *zone)
+print_custom_jumps(struct fw3_ipt_handle *handle, struct fw3_zone *zone)
 {
 	int i;
 	struct fw3_ipt_rule *r;
-	const struct fw3_chain_spec *c;
 
 	const char *flt_chains[] = {
 		"input",   "input",
@@ -346,6 +364,37 @@ print_zone_chain(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		"postrouting", "postrouting",
 	};
 
+	if (zone->custom_chains)
+	{
+		if (handle->table == FW3_TABLE_FILTER)
+		{
+			for (i = 0; i < sizeof(flt_chains)/sizeof(flt_chains[0]); i += 2)
+			{
+				r = fw3_ipt_rule_new(handle);
+				fw3_ipt_rule_comment(r, "Custom %s %s rule chain", zone->name, flt_chains[i+1]);
+				fw3_ipt_rule_target(r, "%s_%s_rule", flt_chains[i+1], zone->name);
+				fw3_ipt_rule_append(r, "zone_%s_%s", zone->name, flt_chains[i]);
+			}
+		}
+		else if (handle->table == FW3_TABLE_NAT)
+		{
+			for (i = 0; i < sizeof(nat_chains)/sizeof(nat_chains[0]); i += 2)
+			{
+				r = fw3_ipt_rule_new(handle);
+				fw3_ipt_rule_comment(r, "Custom %s %s rule chain", zone->name, nat_chains[i+1]);
+				fw3_ipt_rule_target(r, "%s_%s_rule", nat_chains[i+1], zone->name);
+				fw3_ipt_rule_append(r, "zone_%s_%s", zone->name, nat_chains[i]);
+			}
+		}
+	}
+}
+
+static void
+print_zone_chain(struct fw3_ipt_handle *handle, struct fw3_state *state,
+                 bool reload, struct fw3_zone *zone)
+{
+	const struct fw3_chain_spec *c;
+
 	if (!fw3_is_family(zone, handle->family))
 		return;
 
@@ -373,29 +422,7 @@ print_zone_chain(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		fw3_ipt_create_chain(handle, c->format, zone->name);
 	}
 
-	if (zone->custom_chains)
-	{
-		if (handle->table == FW3_TABLE_FILTER)
-		{
-			for (i = 0; i < sizeof(flt_chains)/sizeof(flt_chains[0]); i += 2)
-			{
-				r = fw3_ipt_rule_new(handle);
-				fw3_ipt_rule_comment(r, "Custom %s %s rule chain", zone->name, flt_chains[i+1]);
-				fw3_ipt_rule_target(r, "%s_%s_rule", flt_chains[i+1], zone->name);
-				fw3_ipt_rule_append(r, "zone_%s_%s", zone->name, flt_chains[i]);
-			}
-		}
-		else if (handle->table == FW3_TABLE_NAT)
-		{
-			for (i = 0; i < sizeof(nat_chains)/sizeof(nat_chains[0]); i += 2)
-			{
-				r = fw3_ipt_rule_new(handle);
-				fw3_ipt_rule_comment(r, "Custom %s %s rule chain", zone->name, nat_chains[i+1]);
-				fw3_ipt_rule_target(r, "%s_%s_rule", nat_chains[i+1], zone->name);
-				fw3_ipt_rule_append(r, "zone_%s_%s", zone->name, nat_chains[i]);
-			}
-		}
-	}
+	print_custom_jumps(handle, zone);
 
 	set(zone->flags, handle->family, handle->table);
 }
@@ -619,15 +646,70 @@ next_addr(struct fw3_address *addr, struct list_head *list,
 	return NULL;
 }
 
-static void
-print_zone_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
-                bool reload, struct fw3_zone *zone)
+void
+fw3_print_zone_masq(struct fw3_ipt_handle *handle, struct fw3_zone *zone)
 {
 	bool first_src, first_dest;
 	struct fw3_address *msrc;
 	struct fw3_address *mdest;
 	struct fw3_ipt_rule *r;
 
+	if (zone->masq && handle->family == FW3_FAMILY_V4)
+	{
+		/* for any negated masq_src ip, emit -s addr -j RETURN rules */
+		for (msrc = NULL;
+		     (msrc = next_addr(msrc, &zone->masq_src,
+		                       handle->family, true)) != NULL; )
+		{
+			msrc->invert = false;
+			r = fw3_ipt_rule_new(handle);
+			fw3_ipt_rule_src_dest(r, msrc, NULL);
+			fw3_ipt_rule_target(r, "RETURN");
+			fw3_ipt_rule_append(r, "zone_%s_postrouting", zone->name);
+			msrc->invert = true;
+		}
+
+		/* for any negated masq_dest ip, emit -d addr -j RETURN rules */
+		for (mdest = NULL;
+		     (mdest = next_addr(mdest, &zone->masq_dest,
+		                        handle->family, true)) != NULL; )
+		{
+			mdest->invert = false;
+			r = fw3_ipt_rule_new(handle);
+			fw3_ipt_rule_src_dest(r, NULL, mdest);
+			fw3_ipt_rule_target(r, "RETURN");
+			fw3_ipt_rule_append(r, "zone_%s_postrouting", zone->name);
+			mdest->invert = true;
+		}
+
+		/* emit masquerading entries for non-negated addresses
+		   and ensure that both src and dest loops run at least once,
+		   even if there are no relevant addresses */
+		for (first_src = true, msrc = NULL;
+		     (msrc = next_addr(msrc, &zone->masq_src,
+			                   handle->family, false)) || first_src;
+		     first_src = false)
+		{
+			for (first_dest = true, mdest = NULL;
+			     (mdest = next_addr(mdest, &zone->masq_dest,
+				                    handle->family, false)) || first_dest;
+			     first_dest = false)
+			{
+				r = fw3_ipt_rule_new(handle);
+				fw3_ipt_rule_src_dest(r, msrc, mdest);
+				fw3_ipt_rule_target(r, "MASQUERADE");
+				fw3_ipt_rule_append(r, "zone_%s_postrouting", zone->name);
+			}
+		}
+	}
+}
+
+static void
+print_zone_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
+                bool reload, struct fw3_zone *zone)
+{
+	struct fw3_ipt_rule *r;
+
 	if (!fw3_is_family(zone, handle->family))
 		return;
 
@@ -669,54 +751,7 @@ print_zone_rule(struct fw3_ipt_handle *handle, struct fw3_state *state,
 		break;
 
 	case FW3_TABLE_NAT:
-		if (zone->masq && handle->family == FW3_FAMILY_V4)
-		{
-			/* for any negated masq_src ip, emit -s addr -j RETURN rules */
-			for (msrc = NULL;
-			     (msrc = next_addr(msrc, &zone->masq_src,
-			                       handle->family, true)) != NULL; )
-			{
-				msrc->invert = false;
-				r = fw3_ipt_rule_new(handle);
-				fw3_ipt_rule_src_dest(r, msrc, NULL);
-				fw3_ipt_rule_target(r, "RETURN");
-				fw3_ipt_rule_append(r, "zone_%s_postrouting", zone->name);
-				msrc->invert = true;
-			}
-
-			/* for any negated masq_dest ip, emit -d addr -j RETURN rules */
-			for (mdest = NULL;
-			     (mdest = next_addr(mdest, &zone->masq_dest,
-			                        handle->family, true)) != NULL; )
-			{
-				mdest->invert = false;
-				r = fw3_ipt_rule_new(handle);
-				fw3_ipt_rule_src_dest(r, NULL, mdest);
-				fw3_ipt_rule_target(r, "RETURN");
-				fw3_ipt_rule_append(r, "zone_%s_postrouting", zone->name);
-				mdest->invert = true;
-			}
-
-			/* emit masquerading entries for non-negated addresses
-			   and ensure that both src and dest loops run at least once,
-			   even if there are no relevant addresses */
-			for (first_src = true, msrc = NULL;
-			     (msrc = next_addr(msrc, &zone->masq_src,
-				                   handle->family, false)) || first_src;
-			     first_src = false)
-			{
-				for (first_dest = true, mdest = NULL;
-				     (mdest = next_addr(mdest, &zone->masq_dest,
-					                    handle->family, false)) || first_dest;
-				     first_dest = false)
-				{
-					r = fw3_ipt_rule_new(handle);
-					fw3_ipt_rule_src_dest(r, msrc, mdest);
-					fw3_ipt_rule_target(r, "MASQUERADE");
-					fw3_ipt_rule_append(r, "zone_%s_postrouting", zone->name);
-				}
-			}
-		}
+		fw3_print_zone_masq(handle, zone);
 		break;
 
 	case FW3_TABLE_RAW:
@@ -793,18 +828,117 @@ fw3_flush_zones(struct fw3_ipt_handle *handle, struct fw3_state *state,
 	}
 }
 
+/* whether the given chain is flushed by fw3_flush_zones() on reload */
+bool
+fw3_zone_chain_reloaded(struct fw3_state *state, enum fw3_table table,
+                        const char *chain)
+{
+	struct fw3_zone *z;
+	const struct fw3_chain_spec *c;
+	char buf[32];
+
+	list_for_each_entry(z, &state->zones, list)
+	{
+		for (c = zone_chains; c->format; c++)
+		{
+			if (c->table != table || c->flag == FW3_FLAG_CUSTOM_CHAINS)
+				continue;
+
+			snprintf(buf, sizeof(buf), c->format, z->name);
+
+			if (!strcmp(buf, chain))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/* the part of the hotplug timeout left since start, -1 if there is none */
+static int
+hotplug_budget(int timeout, const struct timespec *start)
+{
+	long elapsed;
+	struct timespec now;
+
+	if (timeout <= 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed = (now.tv_sec - start->tv_sec) * 1000 +
+	          (now.tv_nsec - start->tv_nsec) / 1000000;
+
+	return (elapsed < timeout) ? timeout - elapsed : 0;
+}
+
 void
 fw3_hotplug_zones(struct fw3_state *state, bool add)
 {
 	struct fw3_zone *z;
 	struct fw3_device *d;
+	struct timespec start, end;
+	sigset_t chld, mask;
+	pid_t pid, *pids = NULL, *tmp;
+	int running = 0, total = 0, untracked = 0, size = 0;
+	int workers = state->defaults.hotplug_workers;
+	int timeout = state->defaults.hotplug_timeout;
+	bool wait = (workers > 0 || timeout > 0);
+	bool expired = false, track;
+
+	/* only track the hotplug children if a pool size or timeout is set,
+	 * otherwise fire all events at once and do not wait for them */
+	if (wait)
+	{
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &chld, &mask);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
 
 	list_for_each_entry(z, &state->zones, list)
 	{
 		if (add != fw3_hasbit(z->flags[0], FW3_FLAG_HOTPLUG))
 		{
 			list_for_each_entry(d, &z->devices, list)
-				fw3_hotplug(add, z, d);
+			{
+				if (!expired && workers > 0 && running >= workers)
+				{
+					running -= fw3_wait_children(pids, running, 1,
+						hotplug_budget(timeout, &start));
+
+					/* the pool did not drain within the timeout, start
+					 * the remaining events without waiting for them */
+					expired = (running >= workers);
+				}
+
+				track = (wait && !expired);
+
+				if (track && running >= size)
+				{
+					tmp = realloc(pids, (size + 16) * sizeof(*pids));
+
+					if (tmp)
+					{
+						pids = tmp;
+						size += 16;
+					}
+					else
+					{
+						track = false;
+					}
+				}
+
+				if (!(pid = fw3_hotplug(add, z, d)))
+					continue;
+
+				total++;
+
+				if (track)
+					pids[running++] = pid;
+				else if (wait)
+					untracked++;
+			}
 
 			if (add)
 				fw3_setbit(z->flags[0], FW3_FLAG_HOTPLUG);
@@ -812,25 +946,409 @@ fw3_hotplug_zones(struct fw3_state *state, bool add)
 				fw3_delbit(z->flags[0], FW3_FLAG_HOTPLUG);
 		}
 	}
+
+	if (!wait)
+		return;
+
+	running -= fw3_wait_children(pids, running, running,
+	                             hotplug_budget(timeout, &start));
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	free(pids);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (untracked > 0)
+		warn("%d of %d hotplug events started without being waited for, "
+		     "late after %d ms or not trackable", untracked, total, timeout);
+
+	if (running > 0)
+		warn("%d of %d hotplug events still running after %d ms",
+		     running, total, timeout);
+	else if (total > 0 && !untracked)
+		info(" * Hotplug: %d %s events completed in %ld ms", total,
+		     add ? "add" : "remove",
+		     (end.tv_sec - start.tv_sec) * 1000 +
+		     (end.tv_nsec - start.tv_nsec) / 1000000);
 }
 
-struct fw3_zone *
-fw3_lookup_zone(struct fw3_state *state, const char *name)
+/* record the current device addresses as the zone's old addresses, the
+ * in-memory counterpart of the __addrs list written to the state file */
+void
+fw3_snapshot_zone_addrs(struct fw3_state *state)
 {
 	struct fw3_zone *z;
+	struct fw3_device *d;
+	struct fw3_address *addr, *tmp;
+	struct ifaddrs *ifaddr, *ifa;
+	struct fw3_slab *prev;
 
-	if (list_empty(&state->zones))
-		return NULL;
+	if (getifaddrs(&ifaddr))
+		ifaddr = NULL;
+
+	/* replaced on every update, so taken from the heap, not the slab */
+	prev = fw3_slab_use(NULL);
 
 	list_for_each_entry(z, &state->zones, list)
 	{
-		if (strcmp(z->name, name))
+		list_for_each_entry_safe(addr, tmp, &z->old_addrs, list)
+		{
+			list_del(&addr->list);
+			fw3_slab_release(addr);
+		}
+
+		list_for_each_entry(d, &z->devices, list)
+		{
+			for (ifa = ifaddr; ifa; ifa = ifa->ifa_next)
+			{
+				if (!ifa->ifa_addr || strcmp(d->name, ifa->ifa_name))
+					continue;
+
+				if (ifa->ifa_addr->sa_family != AF_INET &&
+				    ifa->ifa_addr->sa_family != AF_INET6)
+					continue;
+
+				addr = fw3_slab_alloc(sizeof(*addr));
+
+				if (!addr)
+					continue;
+
+				addr->set = true;
+
+				if (ifa->ifa_addr->sa_family == AF_INET)
+				{
+					addr->family = FW3_FAMILY_V4;
+					addr->address.v4 =
+						((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+				}
+				else
+				{
+					addr->family = FW3_FAMILY_V6;
+					addr->address.v6 =
+						((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+				}
+
+				list_add_tail(&addr->list, &z->old_addrs);
+			}
+		}
+	}
+
+	fw3_slab_use(prev);
+
+	if (ifaddr)
+		freeifaddrs(ifaddr);
+}
+
+/*
+ * Rules in builtin chains which are derived from the devices and subnets of
+ * a zone, these are regenerated in place on interface changes.
+ */
+struct zone_jump {
+	enum fw3_table table;
+	enum fw3_flag flag;
+	const char *chain;
+	const char *target;
+	const char *comment;
+};
+
+static const struct zone_jump zone_jumps[] = {
+	{ FW3_TABLE_FILTER, FW3_FLAG_UNSPEC,  "INPUT",       "zone_%s_input" },
+	{ FW3_TABLE_FILTER, FW3_FLAG_UNSPEC,  "OUTPUT",      "zone_%s_output" },
+	{ FW3_TABLE_FILTER, FW3_FLAG_UNSPEC,  "FORWARD",     "zone_%s_forward" },
+	{ FW3_TABLE_NAT,    FW3_FLAG_DNAT,    "PREROUTING",  "zone_%s_prerouting" },
+	{ FW3_TABLE_NAT,    FW3_FLAG_SNAT,    "POSTROUTING", "zone_%s_postrouting" },
+	{ FW3_TABLE_MANGLE, FW3_FLAG_UNSPEC,  "FORWARD",     NULL, "Zone %s MTU fix" },
+	{ FW3_TABLE_RAW,    FW3_FLAG_HELPER,  "PREROUTING",  "zone_%s_helper" },
+	{ FW3_TABLE_RAW,    FW3_FLAG_NOTRACK, "PREROUTING",  "zone_%s_notrack" },
+	{ FW3_TABLE_RAW,    FW3_FLAG_HELPER,  "OUTPUT",      "zone_%s_helper" },
+	{ FW3_TABLE_RAW,    FW3_FLAG_NOTRACK, "OUTPUT",      "zone_%s_notrack" },
+	{ }
+};
+
+enum zone_jump_op {
+	ZONE_JUMP_DELETE,
+	ZONE_JUMP_FIRST,
+	ZONE_JUMP_LAST,
+};
+
+static unsigned int
+find_zone_jumps(struct fw3_ipt_handle *h, struct fw3_zone *zone,
+                const char *chain, enum zone_jump_op op)
+{
+	const struct zone_jump *j;
+	char target[32], comment[64];
+	unsigned int pos, rv = 0;
+
+	for (j = zone_jumps; j->chain; j++)
+	{
+		if (j->table != h->table || strcmp(j->chain, chain))
 			continue;
 
-		return z;
+		if (j->target)
+			snprintf(target, sizeof(target), j->target, zone->name);
+
+		if (j->comment)
+			snprintf(comment, sizeof(comment), j->comment, zone->name);
+
+		if (op == ZONE_JUMP_DELETE)
+			pos = fw3_ipt_delete_rules(h, chain, j->target ? target : NULL,
+			                           j->comment ? comment : NULL);
+		else
+			pos = fw3_ipt_find_rule(h, chain, j->target ? target : NULL,
+			                        j->comment ? comment : NULL,
+			                        op == ZONE_JUMP_LAST);
+
+		if (pos && (!rv || ((op == ZONE_JUMP_LAST) ? (pos > rv) : (pos < rv))))
+			rv = pos;
 	}
 
-	return NULL;
+	return rv;
+}
+
+/* position for the rules of a zone which has none in the chain yet, which
+ * is in front of the next or behind the previous zone having some */
+static unsigned int
+neighbour_position(struct fw3_ipt_handle *h, struct fw3_state *state,
+                   struct fw3_zone *zone, const char *chain)
+{
+	struct list_head *p;
+	unsigned int pos;
+
+	for (p = zone->list.next; p != &state->zones; p = p->next)
+		if ((pos = find_zone_jumps(h, list_entry(p, struct fw3_zone, list),
+		                           chain, ZONE_JUMP_FIRST)) > 0)
+			return pos;
+
+	for (p = zone->list.prev; p != &state->zones; p = p->prev)
+		if ((pos = find_zone_jumps(h, list_entry(p, struct fw3_zone, list),
+		                           chain, ZONE_JUMP_LAST)) > 0)
+			return pos + 1;
+
+	return 0;
+}
+
+static bool
+has_network(struct list_head *networks, const char *net)
+{
+	struct fw3_device *dev;
+
+	list_for_each_entry(dev, networks, list)
+		if (!strcmp(dev->name, net))
+			return true;
+
+	return false;
+}
+
+static bool
+has_device(struct list_head *devices, struct fw3_device *dev)
+{
+	struct fw3_device *d;
+
+	list_for_each_entry(d, devices, list)
+		if (!strcmp(d->name, dev->name) && d->invert == dev->invert)
+			return true;
+
+	return false;
+}
+
+static void
+swap_list(struct list_head *a, struct list_head *b)
+{
+	struct list_head tmp;
+
+	INIT_LIST_HEAD(&tmp);
+	list_splice_init(a, &tmp);
+	list_splice_init(b, a);
+	list_splice_init(&tmp, b);
+}
+
+/*
+ * Re-resolve a running zone after the given network changed. The zone is
+ * parsed again from its section and its network, device, subnet and masq
+ * lists are replaced, while flags and policies stay as they are. Returns 1
+ * if the zone was updated, 0 if it is unrelated to the network and -1 if
+ * the change cannot be applied without a full reload.
+ */
+int
+fw3_refresh_zone(struct fw3_state *state, struct uci_package *p,
+                 struct fw3_zone *zone, const char *net)
+{
+	struct uci_section *s;
+	struct uci_element *e;
+	struct fw3_zone *fresh = NULL;
+	struct fw3_device *d;
+	const char *name;
+	bool hotplug = fw3_hasbit(zone->flags[0], FW3_FLAG_HOTPLUG);
+
+	uci_foreach_element(&p->sections, e)
+	{
+		s = uci_to_section(e);
+
+		if (strcmp(s->type, "zone"))
+			continue;
+
+		name = uci_lookup_option_string(p->ctx, s, "name");
+
+		if (!name || strcmp(name, zone->name))
+			continue;
+
+		fresh = load_zone(state, e);
+		break;
+	}
+
+	if (!fresh)
+		return -1;
+
+	if (!has_network(&zone->networks, net) &&
+	    !has_network(&fresh->networks, net))
+	{
+		fw3_free_zone(fresh);
+		return 0;
+	}
+
+	if (fresh->masq && !zone->masq)
+	{
+		fw3_free_zone(fresh);
+		return -1;
+	}
+
+	if (hotplug)
+	{
+		list_for_each_entry(d, &zone->devices, list)
+			if (!has_device(&fresh->devices, d))
+				fw3_hotplug(false, zone, d);
+
+		list_for_each_entry(d, &fresh->devices, list)
+			if (!has_device(&zone->devices, d))
+				fw3_hotplug(true, zone, d);
+	}
+
+	swap_list(&zone->networks, &fresh->networks);
+	swap_list(&zone->devices, &fresh->devices);
+	swap_list(&zone->subnets, &fresh->subnets);
+	swap_list(&zone->masq_src, &fresh->masq_src);
+	swap_list(&zone->masq_dest, &fresh->masq_dest);
+
+	zone->masq = fresh->masq;
+
+	fw3_free_zone(fresh);
+	return 1;
+}
+
+/*
+ * Regenerate the device and subnet dependent rules of a zone in the table
+ * of the given handle. The jumps in builtin chains are put back at the
+ * position of the previous ones, so the order relative to the rules of
+ * other zones and the default rules is kept. Returns false if no such
+ * position can be determined.
+ */
+bool
+fw3_update_zone_rules(struct fw3_ipt_handle *handle, struct fw3_state *state,
+                      struct fw3_zone *zone)
+{
+	const struct zone_jump *j, *k;
+	const struct fw3_chain_spec *c;
+	unsigned int pos;
+	char chain[32];
+
+	if (!fw3_is_family(zone, handle->family) ||
+	    !has(zone->flags, handle->family, handle->table))
+		return true;
+
+	fw3_ipt_clear_anchors(handle);
+
+	for (j = zone_jumps; j->chain; j++)
+	{
+		if (j->table != handle->table)
+			continue;
+
+		for (k = zone_jumps; k < j; k++)
+			if (k->table == j->table && !strcmp(k->chain, j->chain))
+				break;
+
+		/* chain already done */
+		if (k < j)
+			continue;
+
+		pos = find_zone_jumps(handle, zone, j->chain, ZONE_JUMP_DELETE);
+
+		if (!pos)
+			pos = neighbour_position(handle, state, zone, j->chain);
+
+		/* the filter chains end in default rules, appending is wrong */
+		if (!pos && handle->table == FW3_TABLE_FILTER &&
+		    (!list_empty(&zone->devices) || !list_empty(&zone->subnets)))
+		{
+			fw3_ipt_clear_anchors(handle);
+			return false;
+		}
+
+		if (pos)
+			fw3_ipt_set_anchor(handle, j->chain, pos);
+	}
+
+	if (handle->table == FW3_TABLE_FILTER)
+	{
+		for (c = zone_chains; c->format; c++)
+		{
+			if (c->table != FW3_TABLE_FILTER || !c->flag ||
+			    c->flag == FW3_FLAG_CUSTOM_CHAINS)
+				continue;
+
+			if (!has(zone->flags, handle->family, c->flag))
+				continue;
+
+			snprintf(chain, sizeof(chain), c->format, zone->name);
+			fw3_ipt_flush_chain(handle, chain);
+		}
+	}
+
+	print_interface_rules(handle, state, true, zone);
+	fw3_ipt_clear_anchors(handle);
+
+	return true;
+}
+
+/*
+ * Flush the nat chains of a zone and put back the custom chain jumps. The
+ * caller then emits the redirects and nats of the zone followed by
+ * fw3_print_zone_masq(), in the same order as on start.
+ */
+void
+fw3_reset_zone_nat(struct fw3_ipt_handle *handle, struct fw3_zone *zone)
+{
+	const struct fw3_chain_spec *c;
+	char chain[32];
+
+	if (handle->table != FW3_TABLE_NAT ||
+	    !fw3_is_family(zone, handle->family) ||
+	    !has(zone->flags, handle->family, handle->table))
+		return;
+
+	for (c = zone_chains; c->format; c++)
+	{
+		if (c->table != FW3_TABLE_NAT || !fw3_is_family(c, handle->family))
+			continue;
+
+		if (c->flag == FW3_FLAG_CUSTOM_CHAINS ||
+		    !fw3_hasbit(zone->flags[handle->family == FW3_FAMILY_V6], c->flag))
+			continue;
+
+		snprintf(chain, sizeof(chain), c->format, zone->name);
+		fw3_ipt_flush_chain(handle, chain);
+	}
+
+	print_custom_jumps(handle, zone);
+}
+
+struct fw3_zone *
+fw3_lookup_zone(struct fw3_state *state, const char *name)
+{
+	struct fw3_zone *z;
+
+	if (list_empty(&state->zones))
+		return NULL;
+
+	return avl_find_element(&state->zone_index, name, z, node);
 }
 
 struct list_head *
@@ -839,6 +1357,7 @@ fw3_resolve_zone_addresses(struct fw3_zone *zone, struct fw3_address *addr)
 	struct fw3_device *net;
 	struct fw3_address *cur, *tmp;
 	struct list_head *all;
+	struct fw3_slab *prev;
 
 	all = calloc(1, sizeof(*all));
 	if (!all)
@@ -846,9 +1365,12 @@ fw3_resolve_zone_addresses(struct fw3_zone *zone, struct fw3_address *addr)
 
 	INIT_LIST_HEAD(all);
 
+	/* released by fw3_free_list() once the caller is done */
+	prev = fw3_slab_use(NULL);
+
 	if (addr && addr->set)
 	{
-		tmp = malloc(sizeof(*tmp));
+		tmp = fw3_slab_alloc(sizeof(*tmp));
 
 		if (tmp)
 		{
@@ -863,7 +1385,7 @@ fw3_resolve_zone_addresses(struct fw3_zone *zone, struct fw3_address *addr)
 
 		list_for_each_entry(cur, &zone->subnets, list)
 		{
-			tmp = malloc(sizeof(*tmp));
+			tmp = fw3_slab_alloc(sizeof(*tmp));
 
 			if (!tmp)
 				continue;
@@ -873,5 +1395,7 @@ fw3_resolve_zone_addresses(struct fw3_zone *zone, struct fw3_address *addr)
 		}
 	}
 
+	fw3_slab_use(prev);
+
 	return all;
 }
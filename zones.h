@@ -40,8 +40,23 @@ void fw3_print_zone_rules(struct fw3_ipt_handle *handle,
 void fw3_flush_zones(struct fw3_ipt_handle *handle, struct fw3_state *state,
                      bool reload);
 
+bool fw3_zone_chain_reloaded(struct fw3_state *state, enum fw3_table table,
+                             const char *chain);
+
 void fw3_hotplug_zones(struct fw3_state *state, bool add);
 
+void fw3_snapshot_zone_addrs(struct fw3_state *state);
+
+int fw3_refresh_zone(struct fw3_state *state, struct uci_package *p,
+                     struct fw3_zone *zone, const char *net);
+
+bool fw3_update_zone_rules(struct fw3_ipt_handle *handle,
+                           struct fw3_state *state, struct fw3_zone *zone);
+
+void fw3_reset_zone_nat(struct fw3_ipt_handle *handle, struct fw3_zone *zone);
+
+void fw3_print_zone_masq(struct fw3_ipt_handle *handle, struct fw3_zone *zone);
+
 struct fw3_zone * fw3_lookup_zone(struct fw3_state *state, const char *name);
 
 struct list_head * fw3_resolve_zone_addresses(struct fw3_zone *zone,